@@ -0,0 +1,348 @@
+#include <math.h>
+#include "aot.h"
+#include "memory.h"
+
+// emitter: walks the bytecode compile() produced and prints one C function
+// per Lox function. the value stack, frames and runtime errors are the
+// interpreter's, so semantics, messages and line numbers stay the same;
+// what goes away is decoding and dispatching every instruction.
+
+typedef struct {
+	PObjFunction* functions;
+	int count;
+	int capacity;
+} FunctionList;
+
+#define SHORT_AT(code, i) ((code)[i] | ((code)[(i) + 1] << 8))
+#define LONG_AT(code, i) ((code)[i] | ((code)[(i) + 1] << 8) | ((code)[(i) + 2] << 16))
+
+static void collect(FunctionList* list, PObjFunction function){
+	// post order, a function is built before the ones that refer to it
+	PValueArray constants = &function->chunk.constants;
+	for (int i = 0; i < constants->count; i++)
+		if (IS_FUNCTION(constants->values[i]))
+			collect(list, AS_FUNCTION(constants->values[i]));
+	if (list->capacity < list->count + 1){
+		int oldCapacity = list->capacity;
+		list->capacity = GROW_CAPACITY(oldCapacity);
+		list->functions = GROW_ARRAY(PObjFunction, list->functions,
+			oldCapacity, list->capacity, MEM_COMPILER);
+	}
+	list->functions[list->count++] = function;
+}
+static int indexOf(FunctionList* list, PObjFunction function){
+	for (int i = 0; i < list->count; i++)
+		if (list->functions[i] == function)
+			return i;
+	return -1;
+}
+static int jumpTarget(uint8_t* code, int offset){
+	uint8_t instruction = code[offset];
+	if (instruction == OP_LOOP)
+		return offset + 5 - SHORT_AT(code, offset + 1);
+	if (instruction == OP_JUMP || instruction == OP_JUMP_IF_FALSE || instruction == OP_POP_JUMP_IF_FALSE
+		|| (instruction >= OP_JUMP_IF_LESS && instruction <= OP_JUMP_IF_NOT_EQUAL_NUM))
+		return offset + 3 + SHORT_AT(code, offset + 1);
+	return -1;
+}
+static void emitString(FILE* out, const char* chars, int length){
+	fputc('"', out);
+	for (int i = 0; i < length; i++){
+		unsigned char c = chars[i];
+		if (c == '"' || c == '\\' || c == '?') // ? because of trigraphs
+			fprintf(out, "\\%c", c);
+		else if (c < 32 || c >= 127)
+			fprintf(out, "\\%03o", c);
+		else
+			fputc(c, out);
+	}
+	fputc('"', out);
+}
+static void emitNumber(FILE* out, double number){
+	if (isnan(number))
+		fputs("NAN", out);
+	else if (isinf(number))
+		fputs(number < 0 ? "-HUGE_VAL" : "HUGE_VAL", out);
+	else
+		fprintf(out, "%a", number); // exact
+}
+static void compareJump(FILE* out, int offset, const char* op, bool taken, bool checked, int target){
+	if (checked)
+		fprintf(out, "CHECK_NUMBERS(%d); ", offset);
+	fprintf(out, "sp -= 2; if (%s(AS_NUMBER(sp[0]) %s AS_NUMBER(sp[1]))) goto L%d;",
+		taken ? "" : "!", op, target);
+}
+static void emitInstruction(FILE* out, PChunk chunk, int offset){
+	uint8_t* code = chunk->code;
+	int target = jumpTarget(code, offset);
+	switch (code[offset]){
+		case OP_CONSTANT: fprintf(out, "PUSH(k[%d]);", code[offset + 1]); break;
+		case OP_CONSTANT_LONG: fprintf(out, "PUSH(k[%d]);", LONG_AT(code, offset + 1)); break;
+		case OP_GLOBAL_SET:
+			fprintf(out, "GLOBAL_SET(%d, %d);", offset, code[offset + 1]);
+			break;
+		case OP_GLOBAL_SET_LONG:
+			fprintf(out, "GLOBAL_SET(%d, %d);", offset, LONG_AT(code, offset + 1));
+			break;
+		case OP_GLOBAL_GET: fprintf(out, "GLOBAL_GET(%d, %d);", offset, code[offset + 1]); break;
+		case OP_GLOBAL_GET_LONG: fprintf(out, "GLOBAL_GET(%d, %d);", offset, LONG_AT(code, offset + 1)); break;
+		case OP_LOCAL_GET: fprintf(out, "PUSH(slots[%d]);", code[offset + 1]); break;
+		case OP_LOCAL_SET: fprintf(out, "slots[%d] = PEEK(0);", code[offset + 1]); break;
+		case OP_LOCAL_GET_LONG: fprintf(out, "PUSH(slots[%d]);", SHORT_AT(code, offset + 1)); break;
+		case OP_LOCAL_SET_LONG: fprintf(out, "slots[%d] = PEEK(0);", SHORT_AT(code, offset + 1)); break;
+		case OP_NIL: fputs("PUSH(NIL_VAL());", out); break;
+		case OP_TRUE: fputs("PUSH(BOOL_VAL(true));", out); break;
+		case OP_FALSE: fputs("PUSH(BOOL_VAL(false));", out); break;
+		case OP_POP: fputs("sp--;", out); break;
+		case OP_POPN: fprintf(out, "sp -= %d;", code[offset + 1]); break;
+		case OP_EQUAL: fputs("sp--; sp[-1] = BOOL_VAL(valuesEqual(&sp[-1], &sp[0]));", out); break;
+		case OP_GREATER: fprintf(out, "BINARY_OP(%d, BOOL_VAL, >);", offset); break;
+		case OP_LESS: fprintf(out, "BINARY_OP(%d, BOOL_VAL, <);", offset); break;
+		case OP_ADD: fprintf(out, "ADD(%d);", offset); break;
+		case OP_SUBTRACT: fprintf(out, "BINARY_OP(%d, NUMBER_VAL, -);", offset); break;
+		case OP_MULTIPLY: fprintf(out, "BINARY_OP(%d, NUMBER_VAL, *);", offset); break;
+		case OP_DIVIDE: fprintf(out, "BINARY_OP(%d, NUMBER_VAL, /);", offset); break;
+		case OP_NEGATE: fprintf(out, "NEGATE(%d);", offset); break;
+		case OP_NOT: fputs("sp[-1] = BOOL_VAL(!ToBoolean(sp[-1]));", out); break;
+		case OP_PRINT: fputs("printLine(POP());", out); break;
+		case OP_EQUAL_NUM: fputs("NUMBER_OP(BOOL_VAL, ==);", out); break;
+		case OP_GREATER_NUM: fputs("NUMBER_OP(BOOL_VAL, >);", out); break;
+		case OP_LESS_NUM: fputs("NUMBER_OP(BOOL_VAL, <);", out); break;
+		case OP_ADD_NUM: fputs("NUMBER_OP(NUMBER_VAL, +);", out); break;
+		case OP_SUBTRACT_NUM: fputs("NUMBER_OP(NUMBER_VAL, -);", out); break;
+		case OP_MULTIPLY_NUM: fputs("NUMBER_OP(NUMBER_VAL, *);", out); break;
+		case OP_DIVIDE_NUM: fputs("NUMBER_OP(NUMBER_VAL, /);", out); break;
+		case OP_NEGATE_NUM: fputs("sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1]));", out); break;
+		case OP_JUMP:
+		case OP_LOOP:
+			fprintf(out, "goto L%d;", target);
+			break;
+		case OP_JUMP_IF_FALSE: fprintf(out, "if (!ToBoolean(PEEK(0))) goto L%d;", target); break;
+		case OP_POP_JUMP_IF_FALSE: fprintf(out, "if (!ToBoolean(POP())) goto L%d;", target); break;
+		case OP_JUMP_IF_LESS: compareJump(out, offset, "<", true, true, target); break;
+		case OP_JUMP_IF_NOT_LESS: compareJump(out, offset, "<", false, true, target); break;
+		case OP_JUMP_IF_GREATER: compareJump(out, offset, ">", true, true, target); break;
+		case OP_JUMP_IF_NOT_GREATER: compareJump(out, offset, ">", false, true, target); break;
+		case OP_JUMP_IF_LESS_NUM: compareJump(out, offset, "<", true, false, target); break;
+		case OP_JUMP_IF_NOT_LESS_NUM: compareJump(out, offset, "<", false, false, target); break;
+		case OP_JUMP_IF_GREATER_NUM: compareJump(out, offset, ">", true, false, target); break;
+		case OP_JUMP_IF_NOT_GREATER_NUM: compareJump(out, offset, ">", false, false, target); break;
+		case OP_JUMP_IF_EQUAL_NUM: compareJump(out, offset, "==", true, false, target); break;
+		case OP_JUMP_IF_NOT_EQUAL_NUM: compareJump(out, offset, "==", false, false, target); break;
+		case OP_JUMP_IF_EQUAL:
+			fprintf(out, "sp -= 2; if (valuesEqual(&sp[0], &sp[1])) goto L%d;", target);
+			break;
+		case OP_JUMP_IF_NOT_EQUAL:
+			fprintf(out, "sp -= 2; if (!valuesEqual(&sp[0], &sp[1])) goto L%d;", target);
+			break;
+		case OP_CALL: fprintf(out, "CALL(%d, %d);", offset, code[offset + 1]); break;
+		case OP_TAIL_CALL: fprintf(out, "TAIL_CALL(%d, %d);", offset, code[offset + 1]); break;
+		case OP_RETURN: fputs("RETURN();", out); break;
+		case OP_ARRAY:
+			fprintf(out, "HELPER(%d, arrayLiteral(%d)); CHECK_MEMORY(%d);", offset, code[offset + 1], offset);
+			break;
+		case OP_INDEX_GET: fprintf(out, "HELPER(%d, indexGet());", offset); break;
+		case OP_INDEX_SET: fprintf(out, "HELPER(%d, indexSet());", offset); break;
+		case OP_MAP:
+			fprintf(out, "HELPER(%d, mapLiteral(%d)); CHECK_MEMORY(%d);", offset, code[offset + 1], offset);
+			break;
+		case OP_HAS: fprintf(out, "HELPER(%d, mapHas());", offset); break;
+		case OP_DELETE: fprintf(out, "HELPER(%d, mapDelete());", offset); break;
+		case OP_CLOSURE: fprintf(out, "HELPER(%d, makeClosure(code + %d));", offset, offset + 1); break;
+		case OP_OUTER_GET: fprintf(out, "HELPER(%d, outerGet(code + %d));", offset, offset + 1); break;
+		case OP_OUTER_SET: fprintf(out, "HELPER(%d, outerSet(code + %d));", offset, offset + 1); break;
+		case OP_CALL_NESTED: fprintf(out, "CALL_NESTED(%d);", offset); break;
+		case OP_TAIL_CALL_NESTED: fprintf(out, "TAIL_CALL_NESTED(%d);", offset); break;
+		case OP_CLOSE_UPVALUES: fprintf(out, "HELPER(%d, closeScope(code + %d));", offset, offset + 1); break;
+		default: fprintf(out, "; // unknown opcode %d", code[offset]); break;
+	}
+}
+static void emitBody(FILE* out, PObjFunction function, int index){
+	PChunk chunk = &function->chunk;
+	bool* targets = ALLOCATE(bool, chunk->count + 1, MEM_COMPILER);
+	for (int i = 0; i <= chunk->count; i++)
+		targets[i] = false;
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+		int target = jumpTarget(chunk->code, offset);
+		if (target >= 0 && target <= chunk->count)
+			targets[target] = true;
+	}
+	fprintf(out, "static int body%d(void){\n", index);
+	fputs("\tCallFrame* frame = &vm.frames[vm.frameCount - 1];\n"
+		"\tuint8_t* code = frame->function->chunk.code;\n"
+		"\tValue* k = frame->function->chunk.constants.values;\n"
+		"\tValue* slots = frame->slots;\n"
+		"\tValue* sp = vm.stackTop;\n", out);
+	int line = -1;
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+		int at = getLine(chunk, offset);
+		if (at != line)
+			fprintf(out, "\t// line %d\n", at);
+		line = at;
+		if (targets[offset])
+			fprintf(out, "L%d:", offset);
+		fputc('\t', out);
+		emitInstruction(out, chunk, offset);
+		fputc('\n', out);
+	}
+	fputs("}\n", out);
+	FREE_ARRAY(bool, targets, chunk->count + 1, MEM_COMPILER);
+}
+static void emitData(FILE* out, PObjFunction function, int index){
+	// the bytecode and a line per byte, runtimeError still looks lines up
+	// through frame->ip
+	PChunk chunk = &function->chunk;
+	fprintf(out, "static const uint8_t code%d[] = {", index);
+	for (int i = 0; i < chunk->count; i++)
+		fprintf(out, "%s%d,", i % 16 == 0 ? "\n\t" : " ", chunk->code[i]);
+	fprintf(out, "\n};\nstatic const int lines%d[] = {", index);
+	for (int i = 0; i < chunk->count; i++)
+		fprintf(out, "%s%d,", i % 16 == 0 ? "\n\t" : " ", getLine(chunk, i));
+	fputs("\n};\n", out);
+}
+static void emitLoad(FILE* out, FunctionList* list){
+	fprintf(out, "static PObjFunction load(void){\n\tPObjFunction fn[%d];\n", list->count);
+	for (int i = 0; i < list->count; i++){
+		PObjFunction function = list->functions[i];
+		fprintf(out, "\tfn[%d] = aotFunction(", i);
+		if (function->name == NULL)
+			fputs("NULL", out);
+		else
+			emitString(out, function->name->chars, function->name->length);
+		fprintf(out, ", %d, %d, code%d, lines%d, %d, body%d);\n",
+			function->arity, function->slots, i, i, function->chunk.count, i);
+		for (int j = 0; j < function->captureCount; j++)
+			fprintf(out, "\taotCapture(fn[%d], %d, %d);\n", i,
+				function->captures[j].link, function->captures[j].index);
+		PValueArray constants = &function->chunk.constants;
+		for (int j = 0; j < constants->count; j++){
+			Value value = constants->values[j];
+			fprintf(out, "\taotConstant(fn[%d], ", i);
+			switch (value.type){
+				case NUMBER:
+					fputs("NUMBER_VAL(", out);
+					emitNumber(out, AS_NUMBER(value));
+					fputs(")", out);
+					break;
+				case BOOL: fputs(AS_BOOL(value) ? "BOOL_VAL(true)" : "BOOL_VAL(false)", out); break;
+				case NIL: fputs("NIL_VAL()", out); break;
+				case SHORT_STRING:
+				case OBJ:
+					if (IS_STRING(value)){
+						fputs("aotString(", out);
+						emitString(out, stringChars(&value), stringLength(&value));
+						fprintf(out, ", %d)", stringLength(&value));
+					}
+					else
+						fprintf(out, "OBJ_VAL(fn[%d])", indexOf(list, AS_FUNCTION(value)));
+					break;
+			}
+			fputs(");\n", out);
+		}
+	}
+	fprintf(out, "\treturn fn[%d];\n}\n", list->count - 1);
+}
+bool aotSupported(PObjFunction function){
+	// a fiber switch leaves one frame for another in the middle of a body,
+	// which a C function can't do without a stack of its own. classes would
+	// need the inline caches, which generated code does not carry
+	PChunk chunk = &function->chunk;
+	for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk->code[offset])){
+		uint8_t instruction = chunk->code[offset];
+		if (instruction >= OP_FIBER && instruction <= OP_YIELD){
+			fprintf(stderr, "[line %d] Error: Fibers are not supported by --emit-c.\n",
+				getLine(chunk, offset));
+			return false;
+		}
+		if (instruction >= OP_CLASS && instruction <= OP_SUPER_INVOKE){
+			fprintf(stderr, "[line %d] Error: Classes are not supported by --emit-c.\n",
+				getLine(chunk, offset));
+			return false;
+		}
+		if (instruction == OP_IMPORT){
+			// the module is compiled at run time, there is no C for it
+			fprintf(stderr, "[line %d] Error: Imports are not supported by --emit-c.\n",
+				getLine(chunk, offset));
+			return false;
+		}
+	}
+	PValueArray constants = &chunk->constants;
+	for (int i = 0; i < constants->count; i++)
+		if (IS_FUNCTION(constants->values[i]) && !aotSupported(AS_FUNCTION(constants->values[i])))
+			return false;
+	return true;
+}
+bool aotEmit(PObjFunction script, FILE* out){
+	FunctionList list = { NULL, 0, 0 };
+	collect(&list, script);
+	fputs("// generated by clox --emit-c, do not edit\n#include \"aot.h\"\n\n", out);
+	for (int i = 0; i < list.count; i++){
+		emitData(out, list.functions[i], i);
+		emitBody(out, list.functions[i], i);
+		fputc('\n', out);
+	}
+	emitLoad(out, &list);
+	fputs("int main(void){\n\treturn aotMain(load);\n}\n", out);
+	FREE_ARRAY(PObjFunction, list.functions, list.capacity, MEM_COMPILER);
+	return !ferror(out);
+}
+
+// runtime side
+PObjFunction aotFunction(const char* name, int arity, int slots, const uint8_t* code,
+	const int* lines, int count, int (*body)(void)){
+	PObjFunction function = newFunction();
+	function->arity = arity;
+	function->slots = slots;
+	if (name != NULL)
+		function->name = copyString(name, (int)strlen(name));
+	for (int i = 0; i < count; i++)
+		writeChunk(&function->chunk, code[i], lines[i]);
+	function->native = body;
+	return function;
+}
+void aotConstant(PObjFunction function, Value value){
+	addConstant(&function->chunk, value);
+}
+void aotCapture(PObjFunction function, int link, int index){
+	if (function->captureCapacity < function->captureCount + 1){
+		int oldCapacity = function->captureCapacity;
+		function->captureCapacity = GROW_CAPACITY(oldCapacity);
+		function->captures = GROW_ARRAY(Capture, function->captures, oldCapacity,
+			function->captureCapacity, MEM_CHUNK);
+	}
+	function->captures[function->captureCount].link = link;
+	function->captures[function->captureCount].index = index;
+	function->captureCount++;
+}
+Value aotString(const char* chars, int length){
+	return borrowedValue(chars, length); // a literal of the generated program
+}
+static bool runFrame(){
+	// trampoline: a tail call swaps the function in the frame and returns
+	// here, so chains of tail calls do not grow the C stack
+	int frame = vm.frameCount - 1; // an index, the frames move as they grow
+	int status;
+	do
+		status = vm.frames[frame].function->native();
+	while (status == AOT_TAIL_CALL);
+	return status == AOT_RETURN;
+}
+bool aotCall(int argCount){
+	int frameCount = vm.frameCount;
+	if (!callValue(vm.stackTop[-1 - argCount], argCount))
+		return false;
+	return vm.frameCount == frameCount || runFrame(); // natives are done already
+}
+bool aotCallNested(const uint8_t* operands){
+	return callNested(operands) && runFrame();
+}
+int aotMain(PObjFunction (*load)(void)){
+	initVM();
+	vm.jitEnabled = false; // everything is native already
+	PObjFunction script = load();
+	push(OBJ_VAL(script));
+	call(script, 0);
+	bool ok = runFrame();
+	freeVM();
+	return ok ? 0 : 70; // same exit code as the interpreter
+}
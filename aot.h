@@ -0,0 +1,162 @@
+#ifndef clox_aot_h
+#define clox_aot_h
+#include <math.h>
+#include "common.h"
+#include "vm.h"
+#include "object.h"
+#include "table.h"
+#include "memory.h"
+#include "array.h"
+#include "map.h"
+#include "output.h"
+#include "closure.h"
+
+// ahead-of-time backend: every function of a compiled script becomes a C
+// function, see aotEmit. the generated unit includes this header and links
+// against the rest of the runtime, bytecode is only kept for line numbers
+
+typedef enum {
+	AOT_RETURN,
+	AOT_TAIL_CALL, // the frame now holds another function, run it
+	AOT_ERROR // a runtime error was reported
+} AotStatus;
+
+bool aotSupported(PObjFunction);
+bool aotEmit(PObjFunction, FILE*);
+
+// runtime side, used by the generated code
+PObjFunction aotFunction(const char*, int, int, const uint8_t*, const int*, int, int (*)(void));
+void aotConstant(PObjFunction, Value);
+void aotCapture(PObjFunction, int, int); // what a closure of the function captures
+Value aotString(const char*, int);
+bool aotCall(int);
+bool aotCallNested(const uint8_t*);
+int aotMain(PObjFunction (*)(void));
+
+// a generated body keeps the stack top in sp and only writes it back to
+// vm.stackTop around calls, a call can also move the stack so slots is
+// reloaded after it. AT records the instruction for runtimeError
+#define PUSH(value) (*sp++ = (value))
+#define POP() (*--sp)
+#define PEEK(delta) (sp[-1 - (delta)])
+#define AT(offset) (frame->ip = code + (offset) + 1)
+#define CHECK_NUMBERS(offset) \
+	do { \
+	  if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1))){ \
+		AT(offset); \
+		runtimeError("Operands must be numbers."); \
+		return AOT_ERROR; \
+	  } \
+	} while (false)
+#define CHECK_MEMORY(offset) \
+	do { \
+	  if (vm.memory.limit != 0){ \
+		AT(offset); \
+		if (!checkMemoryLimit()) \
+			return AOT_ERROR; \
+	  } \
+	} while (false)
+#define NUMBER_OP(TYPE_VAL, op) \
+	do { \
+	  sp--; \
+	  sp[-1] = TYPE_VAL(AS_NUMBER(sp[-1]) op AS_NUMBER(sp[0])); \
+	} while (false)
+#define BINARY_OP(offset, TYPE_VAL, op) \
+	do { \
+	  CHECK_NUMBERS(offset); \
+	  NUMBER_OP(TYPE_VAL, op); \
+	} while (false)
+#define ADD(offset) \
+	do { \
+	  if (IS_STRING(PEEK(0)) && IS_STRING(PEEK(1))){ \
+		Value b = POP(); \
+		Value a = POP(); \
+		PUSH(concat(a, b)); \
+		CHECK_MEMORY(offset); \
+	  } \
+	  else \
+		BINARY_OP(offset, NUMBER_VAL, +); \
+	} while (false)
+#define NEGATE(offset) \
+	do { \
+	  if (!IS_NUMBER(PEEK(0))){ \
+		AT(offset); \
+		runtimeError("Operand must be a number"); \
+		return AOT_ERROR; \
+	  } \
+	  sp[-1] = NUMBER_VAL(-AS_NUMBER(sp[-1])); \
+	} while (false)
+#define GLOBAL_SET(offset, idx) \
+	do { \
+	  tableSet(&vm.globals, &k[idx], &PEEK(0)); \
+	  CHECK_MEMORY(offset); \
+	} while (false)
+#define GLOBAL_GET(offset, idx) \
+	do { \
+	  Value value; \
+	  if (!tableGet(&vm.globals, &k[idx], &value)){ \
+		AT(offset); \
+		runtimeError("Undefined variable '%.*s'.", stringLength(&k[idx]), stringChars(&k[idx])); \
+		return AOT_ERROR; \
+	  } \
+	  PUSH(value); \
+	} while (false)
+#define CALL(offset, argCount) \
+	do { \
+	  AT(offset); \
+	  vm.stackTop = sp; \
+	  if (!aotCall(argCount)) \
+		return AOT_ERROR; \
+	  sp = vm.stackTop; \
+	  frame = &vm.frames[vm.frameCount - 1]; /* the frames may have grown */ \
+	  slots = frame->slots; \
+	} while (false)
+#define TAIL_CALL(offset, argCount) \
+	do { \
+	  if (IS_NATIVE(PEEK(argCount))){ /* nothing to trampoline, RETURN follows */ \
+		CALL(offset, argCount); \
+		break; \
+	  } \
+	  AT(offset); \
+	  vm.stackTop = sp; \
+	  return tailCall(frame, PEEK(argCount), argCount) ? AOT_TAIL_CALL : AOT_ERROR; \
+	} while (false)
+#define CALL_NESTED(offset) \
+	do { \
+	  AT(offset); \
+	  vm.stackTop = sp; \
+	  if (!aotCallNested(code + (offset) + 1)) \
+		return AOT_ERROR; \
+	  sp = vm.stackTop; \
+	  frame = &vm.frames[vm.frameCount - 1]; \
+	  slots = frame->slots; \
+	} while (false)
+#define TAIL_CALL_NESTED(offset) \
+	do { \
+	  AT(offset); \
+	  vm.stackTop = sp; \
+	  return tailCallNested(code + (offset) + 1) ? AOT_TAIL_CALL : AOT_ERROR; \
+	} while (false)
+// the array, map and closure instructions go through the interpreter's helpers
+#define HELPER(offset, call) \
+	do { \
+	  AT(offset); \
+	  vm.stackTop = sp; \
+	  if (!(call)) \
+		return AOT_ERROR; \
+	  sp = vm.stackTop; \
+	} while (false)
+#define RETURN() \
+	do { \
+	  Value result = POP(); \
+	  closeUpvalues(frame->slots); \
+	  vm.frameCount--; \
+	  if (vm.frameCount == 0){ \
+		vm.stackTop = sp - 1; /* the script itself */ \
+		return AOT_RETURN; \
+	  } \
+	  vm.stackTop = frame->slots; \
+	  *vm.stackTop++ = result; \
+	  return AOT_RETURN; \
+	} while (false)
+#endif
@@ -0,0 +1,324 @@
+#include "array.h"
+#include "vm.h"
+#include "memory.h"
+#include "map.h"
+
+// bulk kernels: avx when the build targets it, sse2 on any x86-64 and
+// plain loops elsewhere. vector sums add in a different order than a loop
+// written in Lox would, so results can differ in the last bits
+#if defined(__AVX__)
+#include <immintrin.h>
+#define LANES 4
+typedef __m256d Vector;
+#define VLOAD(p) _mm256_loadu_pd(p)
+#define VSTORE(p, v) _mm256_storeu_pd(p, v)
+#define VSPLAT(x) _mm256_set1_pd(x)
+#define VADD(a, b) _mm256_add_pd(a, b)
+#define VMUL(a, b) _mm256_mul_pd(a, b)
+#define VMIN(a, b) _mm256_min_pd(a, b)
+#define VMAX(a, b) _mm256_max_pd(a, b)
+#define VNAN(v) _mm256_cmp_pd(v, v, _CMP_UNORD_Q) // all ones in NaN lanes
+#define VOR(a, b) _mm256_or_pd(a, b)
+#define VANY(v) (_mm256_movemask_pd(v) != 0)
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define LANES 2
+typedef __m128d Vector;
+#define VLOAD(p) _mm_loadu_pd(p)
+#define VSTORE(p, v) _mm_storeu_pd(p, v)
+#define VSPLAT(x) _mm_set1_pd(x)
+#define VADD(a, b) _mm_add_pd(a, b)
+#define VMUL(a, b) _mm_mul_pd(a, b)
+#define VMIN(a, b) _mm_min_pd(a, b)
+#define VMAX(a, b) _mm_max_pd(a, b)
+#define VNAN(v) _mm_cmpunord_pd(v, v)
+#define VOR(a, b) _mm_or_pd(a, b)
+#define VANY(v) (_mm_movemask_pd(v) != 0)
+#endif
+
+#ifdef LANES
+static double horizontalSum(Vector v){
+	double lanes[LANES];
+	VSTORE(lanes, v);
+	double sum = 0;
+	for (int i = 0; i < LANES; i++)
+		sum += lanes[i];
+	return sum;
+}
+#endif
+static double kernelSum(const double* a, int n){
+	int i = 0;
+	double sum = 0;
+#ifdef LANES
+	// two accumulators so consecutive adds don't wait on each other
+	Vector acc0 = VSPLAT(0), acc1 = VSPLAT(0);
+	for (; i + 2 * LANES <= n; i += 2 * LANES){
+		acc0 = VADD(acc0, VLOAD(a + i));
+		acc1 = VADD(acc1, VLOAD(a + i + LANES));
+	}
+	sum = horizontalSum(VADD(acc0, acc1));
+#endif
+	for (; i < n; i++)
+		sum += a[i];
+	return sum;
+}
+static double kernelDot(const double* a, const double* b, int n){
+	int i = 0;
+	double sum = 0;
+#ifdef LANES
+	Vector acc0 = VSPLAT(0), acc1 = VSPLAT(0);
+	for (; i + 2 * LANES <= n; i += 2 * LANES){
+		acc0 = VADD(acc0, VMUL(VLOAD(a + i), VLOAD(b + i)));
+		acc1 = VADD(acc1, VMUL(VLOAD(a + i + LANES), VLOAD(b + i + LANES)));
+	}
+	sum = horizontalSum(VADD(acc0, acc1));
+#endif
+	for (; i < n; i++)
+		sum += a[i] * b[i];
+	return sum;
+}
+static void kernelScale(double* a, double k, int n){
+	int i = 0;
+#ifdef LANES
+	Vector factor = VSPLAT(k);
+	for (; i + LANES <= n; i += LANES)
+		VSTORE(a + i, VMUL(VLOAD(a + i), factor));
+#endif
+	for (; i < n; i++)
+		a[i] *= k;
+}
+static void kernelAdd(double* a, const double* b, int n){
+	int i = 0;
+#ifdef LANES
+	for (; i + LANES <= n; i += LANES)
+		VSTORE(a + i, VADD(VLOAD(a + i), VLOAD(b + i)));
+#endif
+	for (; i < n; i++)
+		a[i] += b[i];
+}
+static bool kernelHasNaN(const double* a, int n){
+	int i = 0;
+#ifdef LANES
+	Vector found = VSPLAT(0);
+	for (; i + LANES <= n; i += LANES)
+		found = VOR(found, VNAN(VLOAD(a + i)));
+	if (VANY(found))
+		return true;
+#endif
+	for (; i < n; i++)
+		if (a[i] != a[i])
+			return true;
+	return false;
+}
+static bool kernelExtreme(const double* a, int n, bool max, double* result){
+	// n > 0, false when there is a NaN. minpd and the compares below would
+	// each drop it depending on where it sits, so it is looked for instead
+	int i = 0;
+	*result = a[0];
+#ifdef LANES
+	if (n >= LANES){
+		Vector acc = VLOAD(a);
+		Vector found = VNAN(acc);
+		for (i = LANES; i + LANES <= n; i += LANES){
+			Vector v = VLOAD(a + i);
+			found = VOR(found, VNAN(v));
+			acc = max ? VMAX(acc, v) : VMIN(acc, v);
+		}
+		if (VANY(found))
+			return false;
+		double lanes[LANES];
+		VSTORE(lanes, acc);
+		for (int j = 0; j < LANES; j++)
+			if (max ? lanes[j] > *result : lanes[j] < *result)
+				*result = lanes[j];
+	}
+#endif
+	for (; i < n; i++){
+		if (a[i] != a[i])
+			return false;
+		if (max ? a[i] > *result : a[i] < *result)
+			*result = a[i];
+	}
+	return true;
+}
+
+static bool checkIndex(Value target, Value index, PObjArray* array, int* at){
+	if (!IS_ARRAY(target)){
+		runtimeError("Can only index arrays and maps.");
+		return false;
+	}
+	if (!IS_NUMBER(index)){
+		runtimeError("Array index must be a number.");
+		return false;
+	}
+	*array = AS_ARRAY(target);
+	double position = AS_NUMBER(index);
+	if (!(position >= 0 && position < (*array)->count)){ // NaN too
+		runtimeError("Array index out of bounds.");
+		return false;
+	}
+	*at = (int)position;
+	if (*at != position){
+		runtimeError("Array index must be an integer.");
+		return false;
+	}
+	return true;
+}
+bool arrayLiteral(int count){
+	Value* elements = vm.stackTop - count;
+	for (int i = 0; i < count; i++)
+		if (!IS_NUMBER(elements[i])){
+			runtimeError("Array elements must be numbers.");
+			return false;
+		}
+	PObjArray array = newArray(count);
+	for (int i = 0; i < count; i++)
+		array->values[i] = AS_NUMBER(elements[i]);
+	vm.stackTop = elements;
+	push(OBJ_VAL(array));
+	return true;
+}
+bool indexGet(){
+	// [array, index] -> [element]
+	if (IS_MAP(vm.stackTop[-2]))
+		return mapGet();
+	PObjArray array;
+	int at;
+	if (!checkIndex(vm.stackTop[-2], vm.stackTop[-1], &array, &at))
+		return false;
+	vm.stackTop--;
+	vm.stackTop[-1] = NUMBER_VAL(array->values[at]);
+	return true;
+}
+bool indexSet(){
+	// [array, index, value] -> [value], assignment is an expression
+	if (IS_MAP(vm.stackTop[-3]))
+		return mapSet();
+	Value value = vm.stackTop[-1];
+	PObjArray array;
+	int at;
+	if (!checkIndex(vm.stackTop[-3], vm.stackTop[-2], &array, &at))
+		return false;
+	if (!IS_NUMBER(value)){
+		runtimeError("Array elements must be numbers.");
+		return false;
+	}
+	array->values[at] = AS_NUMBER(value);
+	vm.stackTop -= 2;
+	vm.stackTop[-1] = value;
+	return true;
+}
+
+static bool arrayArg(Value value, const char* native, PObjArray* array){
+	if (!IS_ARRAY(value)){
+		runtimeError("%s() expects an array.", native);
+		return false;
+	}
+	*array = AS_ARRAY(value);
+	return true;
+}
+static bool sameLength(PObjArray a, PObjArray b, const char* native){
+	if (a->count != b->count){
+		runtimeError("%s() expects arrays of the same length.", native);
+		return false;
+	}
+	return true;
+}
+bool arrayNative(Value* args, Value* result){
+	double count = IS_NUMBER(args[0]) ? AS_NUMBER(args[0]) : -1;
+	if (!(count >= 0 && count <= INT32_MAX) || count != (int)count){
+		runtimeError("array() expects a non-negative integer size.");
+		return false;
+	}
+	*result = OBJ_VAL(newArray((int)count));
+	return checkMemoryLimit();
+}
+bool lenNative(Value* args, Value* result){
+	if (IS_MAP(args[0])){
+		*result = NUMBER_VAL(AS_MAP(args[0])->count);
+		return true;
+	}
+	if (!IS_ARRAY(args[0])){
+		runtimeError("len() expects an array or a map.");
+		return false;
+	}
+	*result = NUMBER_VAL(AS_ARRAY(args[0])->count);
+	return true;
+}
+bool sumNative(Value* args, Value* result){
+	PObjArray array;
+	if (!arrayArg(args[0], "sum", &array))
+		return false;
+	*result = NUMBER_VAL(kernelSum(array->values, array->count));
+	return true;
+}
+bool dotNative(Value* args, Value* result){
+	PObjArray a, b;
+	if (!arrayArg(args[0], "dot", &a) || !arrayArg(args[1], "dot", &b) || !sameLength(a, b, "dot"))
+		return false;
+	*result = NUMBER_VAL(kernelDot(a->values, b->values, a->count));
+	return true;
+}
+bool scaleNative(Value* args, Value* result){
+	// in place, the array is returned for chaining
+	PObjArray array;
+	if (!arrayArg(args[0], "scale", &array))
+		return false;
+	if (!IS_NUMBER(args[1])){
+		runtimeError("scale() expects a number factor.");
+		return false;
+	}
+	kernelScale(array->values, AS_NUMBER(args[1]), array->count);
+	*result = args[0];
+	return true;
+}
+bool addNative(Value* args, Value* result){
+	// a += b in place, a is returned
+	PObjArray a, b;
+	if (!arrayArg(args[0], "add", &a) || !arrayArg(args[1], "add", &b) || !sameLength(a, b, "add"))
+		return false;
+	kernelAdd(a->values, b->values, a->count);
+	*result = args[0];
+	return true;
+}
+static bool extremeNative(Value* args, Value* result, const char* native, bool max){
+	PObjArray array;
+	if (!arrayArg(args[0], native, &array))
+		return false;
+	if (array->count == 0){
+		runtimeError("%s() of an empty array.", native);
+		return false;
+	}
+	double extreme;
+	if (!kernelExtreme(array->values, array->count, max, &extreme)){
+		runtimeError("%s() of an array containing NaN.", native);
+		return false;
+	}
+	*result = NUMBER_VAL(extreme);
+	return true;
+}
+bool minNative(Value* args, Value* result){
+	return extremeNative(args, result, "min", false);
+}
+bool maxNative(Value* args, Value* result){
+	return extremeNative(args, result, "max", true);
+}
+static int compareNumbers(const void* a, const void* b){
+	double x = *(const double*)a;
+	double y = *(const double*)b;
+	return (x > y) - (x < y);
+}
+bool sortNative(Value* args, Value* result){
+	// ascending, in place
+	PObjArray array;
+	if (!arrayArg(args[0], "sort", &array))
+		return false;
+	if (kernelHasNaN(array->values, array->count)){
+		// compareNumbers has no place for it, like min() and max()
+		runtimeError("sort() of an array containing NaN.");
+		return false;
+	}
+	qsort(array->values, array->count, sizeof(double), compareNumbers);
+	*result = args[0];
+	return true;
+}
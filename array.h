@@ -0,0 +1,24 @@
+#ifndef clox_array_h
+#define clox_array_h
+#include "common.h"
+#include "value.h"
+#include "object.h"
+
+// numeric arrays: the indexing instructions work on vm.stackTop like the
+// interpreter does, so the jit and generated code call them directly.
+// false means a runtime error was reported. indexing a map goes to map.c
+bool arrayLiteral(int);
+bool indexGet();
+bool indexSet();
+
+// builtins, registered as globals by initVM
+bool arrayNative(Value*, Value*);
+bool lenNative(Value*, Value*);
+bool sumNative(Value*, Value*);
+bool dotNative(Value*, Value*);
+bool scaleNative(Value*, Value*);
+bool addNative(Value*, Value*);
+bool minNative(Value*, Value*);
+bool maxNative(Value*, Value*);
+bool sortNative(Value*, Value*);
+#endif
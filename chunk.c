@@ -2,11 +2,23 @@
 #include <stdlib.h>
 #include "chunk.h"
 #include "memory.h"
+#include "jit.h"
 
 void initChunk(PChunk chunk){
 	chunk->count = 0;
 	chunk->capacity = 0;
 	chunk->code = NULL;
+	chunk->loopCount = 0;
+	chunk->loopCapacity = 0;
+	chunk->loops = NULL;
+	chunk->cacheCount = 0;
+	chunk->cacheCapacity = 0;
+	chunk->caches = NULL;
+	chunk->calls = 0;
+	chunk->cost = 0;
+	chunk->jit = NULL;
+	chunk->jitFailed = false;
+	chunk->borrowed = false;
 	initValueArray(&(chunk->constants));
 	initLineInfo(&(chunk->lineInfo));
 }
@@ -15,15 +27,20 @@ void writeChunk(PChunk chunk, uint8_t byte, int line){
 		int oldCapacity = chunk->capacity;
 		chunk->capacity = GROW_CAPACITY(oldCapacity);
 		chunk->code = GROW_ARRAY(uint8_t,chunk->code, \
-			oldCapacity,chunk->capacity);
+			oldCapacity,chunk->capacity, MEM_CHUNK);
 	}
 	chunk->code[chunk->count] = byte;
 	writeLineInfo(&(chunk->lineInfo),line,chunk->count);
 	chunk->count++;
 }
 void freeChunk(PChunk chunk){
-	FREE_ARRAY(uint8_t,chunk->code,chunk->capacity);
-	freeLineInfo(&(chunk->lineInfo));
+	jitFree(chunk);
+	if (!chunk->borrowed){
+		FREE_ARRAY(uint8_t,chunk->code,chunk->capacity, MEM_CHUNK);
+		freeLineInfo(&(chunk->lineInfo));
+	}
+	FREE_ARRAY(LoopCounter,chunk->loops,chunk->loopCapacity, MEM_CHUNK);
+	FREE_ARRAY(InlineCache,chunk->caches,chunk->cacheCapacity, MEM_CHUNK);
 	freeValueArray(&(chunk->constants));
 	initChunk(chunk);
 }
@@ -31,12 +48,86 @@ int addConstant(PChunk chunk,Value value){
 	writeValueArray(&(chunk->constants),value);
 	return (chunk->constants).count - 1;
 }
-int getLine(PChunk chunk, int offset){
-	int lineCounter = 1;
-	while (chunk->lineInfo.lines[lineCounter] < offset){
-		lineCounter++;
+int addLoopCounter(PChunk chunk, int start){
+	if (chunk->loopCapacity < chunk->loopCount + 1){
+		int oldCapacity = chunk->loopCapacity;
+		chunk->loopCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->loops = GROW_ARRAY(LoopCounter,chunk->loops, \
+			oldCapacity,chunk->loopCapacity, MEM_CHUNK);
 	}
-	return lineCounter;
+	chunk->loops[chunk->loopCount].start = start;
+	chunk->loops[chunk->loopCount].cost = 0;
+	chunk->loops[chunk->loopCount].hits = 0;
+	return chunk->loopCount++;
+}
+int addInlineCache(PChunk chunk){
+	if (chunk->cacheCapacity < chunk->cacheCount + 1){
+		int oldCapacity = chunk->cacheCapacity;
+		chunk->cacheCapacity = GROW_CAPACITY(oldCapacity);
+		chunk->caches = GROW_ARRAY(InlineCache,chunk->caches, \
+			oldCapacity,chunk->cacheCapacity, MEM_CHUNK);
+	}
+	memset(&chunk->caches[chunk->cacheCount], 0, sizeof(InlineCache));
+	return chunk->cacheCount++;
+}
+int instructionLength(uint8_t instruction){
+	switch (instruction){
+		case OP_INVOKE:
+			return 6;
+		case OP_GET_PROPERTY:
+		case OP_SET_PROPERTY:
+			return 5;
+		case OP_SUPER_INVOKE:
+		case OP_OUTER_GET:
+		case OP_OUTER_SET:
+			return 4;
+		case OP_CALL_NESTED:
+		case OP_TAIL_CALL_NESTED:
+		case OP_CLOSURE:
+		case OP_CLOSE_UPVALUES:
+		case OP_CLASS:
+		case OP_METHOD:
+		case OP_GET_SUPER:
+			return 3;
+		case OP_CONSTANT_LONG:
+		case OP_GLOBAL_SET_LONG:
+		case OP_GLOBAL_GET_LONG:
+			return 4;
+		case OP_CONSTANT:
+		case OP_GLOBAL_SET:
+		case OP_GLOBAL_GET:
+		case OP_LOCAL_GET:
+		case OP_LOCAL_SET:
+		case OP_POPN:
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_FIBER:
+		case OP_SPAWN:
+		case OP_ARRAY:
+		case OP_MAP:
+			return 2;
+		case OP_LOOP:
+			return 5;
+		case OP_LOCAL_GET_LONG:
+		case OP_LOCAL_SET_LONG:
+		case OP_JUMP:
+		case OP_JUMP_IF_FALSE:
+		case OP_POP_JUMP_IF_FALSE:
+			return 3;
+		default:
+			if (instruction >= OP_JUMP_IF_LESS && instruction <= OP_JUMP_IF_NOT_EQUAL_NUM)
+				return 3;
+			return 1;
+	}
+}
+int countInstructions(PChunk chunk, int from, int to){
+	int count = 0;
+	for (int offset = from; offset < to; offset += instructionLength(chunk->code[offset]))
+		count++;
+	return count;
+}
+int getLine(PChunk chunk, int offset){
+	return findLine(&chunk->lineInfo, offset);
 }
 int writeConstant(PChunk chunk, Value value,int line){
 	int constantIdx = addConstant(chunk,value);
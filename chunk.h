@@ -29,8 +29,105 @@ typedef enum {
 	OP_DIVIDE,
 	OP_NEGATE,
 	OP_NOT,
-	OP_PRINT
+	OP_PRINT,
+	// operands are statically known numbers, no tag checks
+	OP_EQUAL_NUM,
+	OP_GREATER_NUM,
+	OP_LESS_NUM,
+	OP_ADD_NUM,
+	OP_SUBTRACT_NUM,
+	OP_MULTIPLY_NUM,
+	OP_DIVIDE_NUM,
+	OP_NEGATE_NUM,
+	OP_JUMP,
+	OP_JUMP_IF_FALSE, // leaves the condition on the stack (and, or)
+	OP_POP_JUMP_IF_FALSE,
+	OP_LOOP,
+	// compare-and-branch, both operands are popped
+	OP_JUMP_IF_LESS,
+	OP_JUMP_IF_NOT_LESS,
+	OP_JUMP_IF_GREATER,
+	OP_JUMP_IF_NOT_GREATER,
+	OP_JUMP_IF_EQUAL,
+	OP_JUMP_IF_NOT_EQUAL,
+	OP_JUMP_IF_LESS_NUM,
+	OP_JUMP_IF_NOT_LESS_NUM,
+	OP_JUMP_IF_GREATER_NUM,
+	OP_JUMP_IF_NOT_GREATER_NUM,
+	OP_JUMP_IF_EQUAL_NUM,
+	OP_JUMP_IF_NOT_EQUAL_NUM,
+	OP_CALL,
+	OP_TAIL_CALL, // call that reuses the caller's frame
+	// like OP_CALL, but the call runs in a new fiber
+	OP_FIBER,
+	OP_SPAWN, // the new fiber goes to the scheduler
+	OP_RESUME,
+	OP_YIELD,
+	OP_ARRAY, // literal, operand is the number of elements on the stack
+	OP_INDEX_GET, // arrays and maps
+	OP_INDEX_SET,
+	OP_MAP, // literal, operand is the number of key/value pairs on the stack
+	OP_HAS,
+	OP_DELETE,
+	OP_LOCAL_GET_LONG, // two-byte slot, for slots past UINT8_MAX
+	OP_LOCAL_SET_LONG,
+	OP_IMPORT, // module name on the stack, runs the module body like a call
+	// classes, the first operand is a two-byte name constant
+	OP_CLASS,
+	OP_INHERIT, // [class, superclass] -> [class], no operand
+	OP_METHOD, // [class, function] -> [class]
+	// then a two-byte index into the chunk's inline caches
+	OP_GET_PROPERTY,
+	OP_SET_PROPERTY,
+	OP_INVOKE, // then the argument count, a method call without the bound method
+	OP_GET_SUPER, // [this] -> [bound method], looked up above the method's class
+	OP_SUPER_INVOKE, // then the argument count
+	// nested functions, see closure.h
+	OP_CLOSURE, // then a two-byte function constant, [] -> [closure]
+	// then a link byte and a two-byte index: the local at index of the frame
+	// link hops up the static links, or with OUTER_UPVALUE the upvalue at
+	// index of the closure running in that frame
+	OP_OUTER_GET,
+	OP_OUTER_SET,
+	OP_CALL_NESTED, // then the argument count and the hops to the declaring frame
+	OP_CLOSE_UPVALUES, // then a two-byte slot, upvalues from there up move to the heap
+	OP_TAIL_CALL_NESTED // like OP_CALL_NESTED reusing the caller's frame, at least one hop up
 } OpCode;
+#define OUTER_UPVALUE 0x80
+
+typedef struct {
+	int start; // offset of the loop header
+	int cost; // instructions in the loop, charged to the budget per iteration
+	uint64_t hits; // times the back edge was taken
+} LoopCounter;
+
+// a property site remembers the shapes it has seen. a shape fixes both the
+// field layout and the class, so a hit finds the field or method without
+// any lookup. one way is monomorphic, up to CACHE_WAYS polymorphic, past
+// that the site is megamorphic and gives up on caching
+#define CACHE_WAYS 4
+typedef struct {
+	struct _ObjShape* shape; // NULL for an unused way
+	struct _ObjShape* next; // sets that add the field: the shape after it
+	int slot; // field index, -1 for a method
+	struct _ObjFunction* method;
+} CacheWay;
+typedef struct {
+	CacheWay ways[CACHE_WAYS];
+	int count; // ways in use
+	bool megamorphic;
+} InlineCache;
+typedef enum {
+	SITE_GET,
+	SITE_SET,
+	SITE_INVOKE,
+	SITE_KIND_COUNT
+} SiteKind;
+typedef struct {
+	uint64_t hits[SITE_KIND_COUNT];
+	uint64_t misses[SITE_KIND_COUNT];
+	uint64_t megamorphic; // sites that went megamorphic
+} CacheStats;
 
 typedef struct {
 	int count;
@@ -38,6 +135,17 @@ typedef struct {
 	uint8_t* code;
 	LineInfo lineInfo;
 	ValueArray constants;
+	int loopCount;
+	int loopCapacity;
+	LoopCounter* loops;
+	int cacheCount;
+	int cacheCapacity;
+	InlineCache* caches;
+	int calls;
+	int cost; // instructions in the chunk, charged to the budget per call
+	struct _JitCode* jit; // native code once the chunk got hot
+	bool jitFailed;
+	bool borrowed; // code, line info and captures belong to the module cache, see module.h
 } Chunk, *PChunk;
 void initChunk(PChunk);
 void writeChunk(PChunk, uint8_t,int);
@@ -45,4 +153,8 @@ void freeChunk(PChunk);
 int addConstant(PChunk, Value);
 int getLine(PChunk, int);
 int writeConstant(PChunk,Value,int);
+int addLoopCounter(PChunk, int);
+int addInlineCache(PChunk);
+int instructionLength(uint8_t);
+int countInstructions(PChunk, int, int);
 #endif
\ No newline at end of file
@@ -0,0 +1,230 @@
+#include "class.h"
+#include "vm.h"
+#include "memory.h"
+
+#define SHORT_AT(p) ((p)[0] | ((p)[1] << 8))
+
+static PChunk runningChunk(){
+	return &vm.frames[vm.frameCount - 1].function->chunk;
+}
+static Value nameAt(PChunk chunk, const uint8_t* operands){
+	return chunk->constants.values[SHORT_AT(operands)];
+}
+static int findField(PObjShape shape, Value name){
+	// walks back from the newest field, chains are as long as the
+	// instance has fields
+	for (; shape->parent != NULL; shape = shape->parent)
+		if (valuesEqual(&shape->name, &name))
+			return shape->count - 1;
+	return -1;
+}
+static PObjFunction findMethod(PObjClass klass, Value name){
+	Value method;
+	if (!tableGet(&klass->methods, &name, &method))
+		return NULL;
+	return AS_FUNCTION(method);
+}
+static PObjShape transition(PObjShape shape, Value name){
+	Value next;
+	if (tableGet(&shape->transitions, &name, &next))
+		return (PObjShape)AS_OBJ(next);
+	PObjShape child = newShape(shape->klass, shape, name);
+	next = OBJ_VAL(child);
+	tableSet(&shape->transitions, &name, &next);
+	return child;
+}
+static void addField(PObjInstance instance, PObjShape shape){
+	// fields restored from a snapshot sit in its image, those are copied
+	// out instead of reallocated
+	if (shape->count > instance->capacity){
+		int capacity = GROW_CAPACITY(instance->capacity);
+		uintptr_t at = (uintptr_t)instance->fields;
+		if (at >= (uintptr_t)vm.image && at < (uintptr_t)vm.image + vm.imageSize){
+			Value* fields = ALLOCATE(Value, capacity, MEM_OBJECTS);
+			memcpy(fields, instance->fields, sizeof(Value) * instance->shape->count);
+			instance->fields = fields;
+		} else {
+			instance->fields = GROW_ARRAY(Value, instance->fields, instance->capacity, capacity, MEM_OBJECTS);
+		}
+		instance->capacity = capacity;
+	}
+	instance->shape = shape;
+	if (shape->count > shape->klass->fields)
+		shape->klass->fields = shape->count;
+}
+
+static CacheWay* probe(InlineCache* cache, PObjShape shape){
+	for (int i = 0; i < cache->count; i++)
+		if (cache->ways[i].shape == shape)
+			return &cache->ways[i];
+	return NULL;
+}
+static void remember(InlineCache* cache, CacheWay* way){
+	if (cache->megamorphic)
+		return;
+	if (cache->count == CACHE_WAYS){
+		// too many shapes to be worth probing, every access looks up
+		cache->megamorphic = true;
+		vm.caches.megamorphic++;
+		return;
+	}
+	cache->ways[cache->count++] = *way;
+}
+static bool lookup(InlineCache* cache, SiteKind kind, PObjShape shape, Value name, CacheWay* way){
+	// fields shadow methods. a hit copies the way, a miss finds the name
+	// and remembers where
+	CacheWay* hit = probe(cache, shape);
+	if (hit != NULL){
+		vm.caches.hits[kind]++;
+		*way = *hit;
+		return true;
+	}
+	vm.caches.misses[kind]++;
+	way->shape = shape;
+	way->next = NULL;
+	way->slot = findField(shape, name);
+	way->method = way->slot >= 0 ? NULL : findMethod(shape->klass, name);
+	if (way->slot < 0 && way->method == NULL){
+		runtimeError("Undefined property '%.*s'.", stringLength(&name), stringChars(&name));
+		return false;
+	}
+	remember(cache, way);
+	return true;
+}
+
+bool declareClass(Value name){
+	push(OBJ_VAL(newClass(copyString(stringChars(&name), stringLength(&name)))));
+	return checkMemoryLimit();
+}
+bool inheritClass(){
+	Value superclass = vm.stackTop[-1];
+	if (!IS_CLASS(superclass)){
+		runtimeError("Superclass must be a class.");
+		return false;
+	}
+	// copied down once, a method call never walks the hierarchy
+	PObjClass klass = AS_CLASS(vm.stackTop[-2]);
+	klass->superclass = AS_CLASS(superclass);
+	tableCopy(&klass->superclass->methods, &klass->methods);
+	klass->initializer = klass->superclass->initializer;
+	vm.stackTop--;
+	return checkMemoryLimit();
+}
+bool defineMethod(Value name){
+	PObjClass klass = AS_CLASS(vm.stackTop[-2]);
+	Value method = vm.stackTop[-1];
+	AS_FUNCTION(method)->owner = klass;
+	tableSet(&klass->methods, &name, &method);
+	if (stringLength(&name) == 4 && memcmp(stringChars(&name), "init", 4) == 0)
+		klass->initializer = AS_FUNCTION(method);
+	vm.stackTop--;
+	return checkMemoryLimit();
+}
+bool getProperty(const uint8_t* operands){
+	Value receiver = vm.stackTop[-1];
+	if (!IS_INSTANCE(receiver)){
+		runtimeError("Only instances have properties.");
+		return false;
+	}
+	PObjInstance instance = AS_INSTANCE(receiver);
+	PChunk chunk = runningChunk();
+	CacheWay way;
+	if (!lookup(&chunk->caches[SHORT_AT(operands + 2)], SITE_GET, instance->shape, nameAt(chunk, operands), &way))
+		return false;
+	if (way.slot >= 0){
+		vm.stackTop[-1] = instance->fields[way.slot];
+		return true;
+	}
+	vm.stackTop[-1] = OBJ_VAL(newBoundMethod(receiver, way.method));
+	return checkMemoryLimit();
+}
+bool setProperty(const uint8_t* operands){
+	Value receiver = vm.stackTop[-2];
+	if (!IS_INSTANCE(receiver)){
+		runtimeError("Only instances have fields.");
+		return false;
+	}
+	PObjInstance instance = AS_INSTANCE(receiver);
+	PChunk chunk = runningChunk();
+	InlineCache* cache = &chunk->caches[SHORT_AT(operands + 2)];
+	CacheWay* hit = probe(cache, instance->shape);
+	CacheWay way;
+	if (hit != NULL){
+		vm.caches.hits[SITE_SET]++;
+		way = *hit;
+	} else {
+		// a new field is a transition, remembered like any other way so
+		// the next instance built the same way takes it without a lookup
+		vm.caches.misses[SITE_SET]++;
+		Value name = nameAt(chunk, operands);
+		way.shape = instance->shape;
+		way.next = NULL;
+		way.method = NULL;
+		way.slot = findField(instance->shape, name);
+		if (way.slot < 0){
+			way.next = transition(instance->shape, name);
+			way.slot = instance->shape->count;
+		}
+		remember(cache, &way);
+	}
+	if (way.next != NULL)
+		addField(instance, way.next);
+	instance->fields[way.slot] = vm.stackTop[-1];
+	vm.stackTop[-2] = vm.stackTop[-1];
+	vm.stackTop--;
+	return way.next == NULL || checkMemoryLimit();
+}
+bool invoke(const uint8_t* operands){
+	// obj.m(args) calls the method right away, no bound method is made
+	int argCount = operands[4];
+	Value receiver = vm.stackTop[-argCount - 1];
+	if (!IS_INSTANCE(receiver)){
+		runtimeError("Only instances have methods.");
+		return false;
+	}
+	PObjInstance instance = AS_INSTANCE(receiver);
+	PChunk chunk = runningChunk();
+	CacheWay way;
+	if (!lookup(&chunk->caches[SHORT_AT(operands + 2)], SITE_INVOKE, instance->shape, nameAt(chunk, operands), &way))
+		return false;
+	if (way.slot >= 0){
+		Value field = instance->fields[way.slot];
+		vm.stackTop[-argCount - 1] = field;
+		return callValue(field, argCount);
+	}
+	return call(way.method, argCount);
+}
+static PObjFunction superMethod(const uint8_t* operands){
+	// the compiler only allows super in methods of a class with a superclass
+	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	Value name = nameAt(&frame->function->chunk, operands);
+	PObjFunction method = findMethod(frame->function->owner->superclass, name);
+	if (method == NULL)
+		runtimeError("Undefined property '%.*s'.", stringLength(&name), stringChars(&name));
+	return method;
+}
+bool getSuper(const uint8_t* operands){
+	PObjFunction method = superMethod(operands);
+	if (method == NULL)
+		return false;
+	vm.stackTop[-1] = OBJ_VAL(newBoundMethod(vm.stackTop[-1], method));
+	return checkMemoryLimit();
+}
+bool superInvoke(const uint8_t* operands){
+	PObjFunction method = superMethod(operands);
+	return method != NULL && call(method, operands[2]);
+}
+bool callClass(PObjClass klass, int argCount){
+	vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+	if (klass->initializer != NULL)
+		return call(klass->initializer, argCount);
+	if (argCount != 0){
+		runtimeError("Expected 0 arguments but got %d.", argCount);
+		return false;
+	}
+	return checkMemoryLimit();
+}
+bool callBoundMethod(PObjBoundMethod bound, int argCount){
+	vm.stackTop[-argCount - 1] = bound->receiver;
+	return call(bound->method, argCount);
+}
@@ -0,0 +1,23 @@
+#ifndef clox_class_h
+#define clox_class_h
+#include "common.h"
+#include "value.h"
+#include "object.h"
+
+// classes and instances. like the array and map instructions these work on
+// vm.stackTop and return false after reporting a runtime error. property
+// instructions take a pointer to their operands, the name constant and the
+// inline cache of the running chunk, so the jit can pass its code directly
+bool declareClass(Value); // [] -> [class]
+bool inheritClass(); // [class, superclass] -> [class]
+bool defineMethod(Value); // [class, function] -> [class]
+bool getProperty(const uint8_t*); // [receiver] -> [value]
+bool setProperty(const uint8_t*); // [receiver, value] -> [value]
+bool invoke(const uint8_t*); // [receiver, args...] -> a frame, like OP_CALL
+bool getSuper(const uint8_t*); // [this] -> [bound method]
+bool superInvoke(const uint8_t*);
+// calling a class makes an instance and runs init on it, calling a bound
+// method puts the receiver in slot 0
+bool callClass(PObjClass, int);
+bool callBoundMethod(PObjBoundMethod, int);
+#endif
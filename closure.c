@@ -0,0 +1,93 @@
+#include "closure.h"
+#include "vm.h"
+#include "memory.h"
+
+#define SHORT_AT(p) ((p)[0] | ((p)[1] << 8))
+
+static CallFrame* outerFrame(uint8_t link){
+	// follows the static links from the running frame
+	int frame = vm.frameCount - 1;
+	for (int hops = link & ~OUTER_UPVALUE; hops > 0; hops--)
+		frame = vm.frames[frame].link;
+	return &vm.frames[frame];
+}
+static Value* outerSlot(const uint8_t* operands){
+	CallFrame* frame = outerFrame(operands[0]);
+	int index = SHORT_AT(operands + 1);
+	if (operands[0] & OUTER_UPVALUE)
+		return AS_CLOSURE(frame->slots[0])->upvalues[index]->location;
+	return &frame->slots[index];
+}
+static PObjUpvalue captureUpvalue(Value* slot){
+	// one upvalue per slot, closures made in the same scope share it
+	PObjUpvalue* link = &vm.fiber->openUpvalues;
+	while (*link != NULL && (*link)->location > slot)
+		link = &(*link)->next;
+	if (*link != NULL && (*link)->location == slot)
+		return *link;
+	PObjUpvalue upvalue = newUpvalue(slot);
+	upvalue->next = *link;
+	*link = upvalue;
+	return upvalue;
+}
+bool makeClosure(const uint8_t* operands){
+	PChunk chunk = &vm.frames[vm.frameCount - 1].function->chunk;
+	PObjFunction function = AS_FUNCTION(chunk->constants.values[SHORT_AT(operands)]);
+	PObjClosure closure = newClosure(function);
+	for (int i = 0; i < function->captureCount; i++){
+		Capture capture = function->captures[i];
+		CallFrame* frame = outerFrame(capture.link);
+		if (capture.link & OUTER_UPVALUE)
+			closure->upvalues[i] = AS_CLOSURE(frame->slots[0])->upvalues[capture.index];
+		else
+			closure->upvalues[i] = captureUpvalue(&frame->slots[capture.index]);
+	}
+	push(OBJ_VAL(closure));
+	return checkMemoryLimit();
+}
+bool outerGet(const uint8_t* operands){
+	push(*outerSlot(operands));
+	return true;
+}
+bool outerSet(const uint8_t* operands){
+	*outerSlot(operands) = vm.stackTop[-1];
+	return true;
+}
+bool callNested(const uint8_t* operands){
+	// the callee is a plain function, the compiler only links direct calls
+	// of a function declared hops frames up
+	int argCount = operands[0];
+	int link = vm.frameCount - 1;
+	for (int hops = operands[1]; hops > 0; hops--)
+		link = vm.frames[link].link;
+	if (!call(AS_FUNCTION(vm.stackTop[-argCount - 1]), argCount))
+		return false;
+	vm.frames[vm.frameCount - 1].link = link;
+	return true;
+}
+bool tailCallNested(const uint8_t* operands){
+	// the link is found before the frame is replaced and kept for the
+	// callee. at least one hop up, so it is never the frame being replaced
+	int argCount = operands[0];
+	CallFrame* frame = &vm.frames[vm.frameCount - 1];
+	int link = frame->link;
+	for (int hops = operands[1]; hops > 1; hops--)
+		link = vm.frames[link].link;
+	if (!tailCall(frame, vm.stackTop[-argCount - 1], argCount))
+		return false;
+	frame->link = link;
+	return true;
+}
+bool closeScope(const uint8_t* operands){
+	closeUpvalues(vm.frames[vm.frameCount - 1].slots + SHORT_AT(operands));
+	return true;
+}
+void closeUpvalues(Value* last){
+	PObjFiber fiber = vm.fiber;
+	while (fiber->openUpvalues != NULL && fiber->openUpvalues->location >= last){
+		PObjUpvalue upvalue = fiber->openUpvalues;
+		upvalue->closed = *upvalue->location;
+		upvalue->location = &upvalue->closed;
+		fiber->openUpvalues = upvalue->next;
+	}
+}
@@ -0,0 +1,22 @@
+#ifndef clox_closure_h
+#define clox_closure_h
+#include "common.h"
+#include "value.h"
+#include "object.h"
+
+// functions declared inside functions. the compiler tells two kinds apart:
+// one only ever called directly while the frame it was declared in is
+// alive stays a plain function, its frames link to the enclosing one and it
+// reaches the variables there in place. one that may escape becomes a
+// closure and what it captures moves to the heap when its scope ends.
+// like the class instructions these work on vm.stackTop, take a pointer to
+// their operands and return false after reporting a runtime error
+bool makeClosure(const uint8_t*); // [] -> [closure]
+bool outerGet(const uint8_t*); // [] -> [value]
+bool outerSet(const uint8_t*); // [value] -> [value]
+bool callNested(const uint8_t*); // [function, args...] -> a linked frame, like OP_CALL
+bool tailCallNested(const uint8_t*); // the same in the running frame, like OP_TAIL_CALL
+bool closeScope(const uint8_t*); // closes the upvalues of slots from the operand up
+// closes the running fiber's upvalues for slots at or above the given one
+void closeUpvalues(Value*);
+#endif
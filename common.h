@@ -1,7 +1,9 @@
 #ifndef clox_common_h
 #define clox_common_h
 
-#define DEBUG_TRACE_EXECUTION
+//#define DEBUG_TRACE_EXECUTION
+#define ENABLE_JIT // x86-64 only, and not while tracing
+//#define DEBUG_PROFILE_LOOPS
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
@@ -1,5 +1,6 @@
 
 #include "compiler.h"
+#include "memory.h"
 
 typedef struct {
 	Token current;
@@ -7,19 +8,47 @@ typedef struct {
 	bool hadError;
 	bool panicMode;
 } Parser;
+typedef struct {
+	Parser parser;
+	Scanner scanner;
+	int codeCount;
+	int constantCount;
+	int loopCount;
+	int cacheCount;
+	int localCount;
+	int scopeDepth;
+} Checkpoint; // everything a dry run of a loop body touches
+typedef struct {
+	StaticType types[TYPED_LOCALS];
+} TypeState;
+#define BODIES_MAX 64 // bodies the escape scan follows, deeper counts as escaping
+#define SCAN_NESTING 16 // functions it looks into to see whether they escape
 Parser parser;
-PChunk compilingChunk;
 bool canAssign;
+StaticType exprType; // type of the last parsed expression
+int dryRun = 0; // > 0 while code is compiled only to learn the local types
+bool assigned[TYPED_LOCALS]; // locals stored to by the loop a dry run is inside
+int lastCompare = -1; // offset of the last comparison, for fusing it into a jump
+int lastJumpTarget = -1;
+int lastCall = -1; // offset of the last OP_CALL, for turning it into a tail call
+int lastIndex = -1; // offset of the last OP_INDEX_GET, for turning it into a delete
+int nestedCall = -1; // hops to the frame of a non-escaping function about to be called
+bool escapeAnalysis = true;
+int functionCount = 0; // ids handed out so far
 PCompiler current = NULL;
+PClassCompiler currentClass = NULL; // innermost class being declared
 static void initParser(){
 	parser.hadError = false;
 	parser.panicMode = false;
 }
 static PChunk currentChunk(){
-	return compilingChunk;
+	return &current->function->chunk;
 }
 static void errorAt(Token* token,const char* msg){
 	if (parser.panicMode) return;
+	parser.hadError = true;
+	parser.panicMode = true;
+	if (dryRun) return; // the real pass reports it
 	fprintf(stderr,"[Line %d] Error", token->line);
 	if (token->type == TOKEN_EOF) {
 		fprintf(stderr, " at end");
@@ -29,8 +58,6 @@ static void errorAt(Token* token,const char* msg){
 		fprintf(stderr, " at '%.*s'", token->length, token->start);
 	}
 	fprintf(stderr, ": %s\n", msg);
-	parser.hadError = true;
-	parser.panicMode = true;
 }
 static void error(const char* msg){
 	errorAt(&parser.previous,msg);
@@ -74,13 +101,94 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 static int emitConstant(Value value){
 	return writeConstant(currentChunk(), value,parser.previous.line);
 }
+static int emitJump(uint8_t instruction){
+	emitByte(instruction);
+	emitByte(0xff);
+	emitByte(0xff);
+	return currentChunk()->count - 2;
+}
+static void patchJump(int offset){
+	int jump = currentChunk()->count - offset - 2;
+	if (jump > UINT16_MAX)
+		error("Too much code to jump over.");
+	currentChunk()->code[offset] = jump & 0xff;
+	currentChunk()->code[offset + 1] = (jump >> 8) & 0xff;
+	lastJumpTarget = currentChunk()->count;
+}
+static void emitLoop(int loopStart){
+	emitByte(OP_LOOP);
+	int offset = currentChunk()->count - loopStart + 4; // skip our own operands
+	if (offset > UINT16_MAX)
+		error("Loop body too large.");
+	emitByte(offset & 0xff);
+	emitByte((offset >> 8) & 0xff);
+	int counter = addLoopCounter(currentChunk(), loopStart);
+	if (counter > UINT16_MAX)
+		error("Too many loops in one chunk.");
+	emitByte(counter & 0xff);
+	emitByte((counter >> 8) & 0xff);
+	// every instruction of the body at most once per iteration, an upper
+	// bound that lets the budget be checked only at back edges and calls
+	currentChunk()->loops[counter].cost = countInstructions(currentChunk(), loopStart, currentChunk()->count);
+}
+static StaticType joinType(StaticType a, StaticType b){
+	return a == b ? a : TYPE_UNKNOWN;
+}
+static int typedLocals(){
+	return current->localCount < TYPED_LOCALS ? current->localCount : TYPED_LOCALS;
+}
+static void saveTypes(TypeState* state){
+	for (int i = 0; i < typedLocals(); i++)
+		state->types[i] = current->locals[i].type;
+}
+static void loadTypes(TypeState* state){
+	for (int i = 0; i < typedLocals(); i++)
+		current->locals[i].type = state->types[i];
+}
+static void joinTypes(TypeState* state){
+	// control flow merges, keep only what both paths agree on
+	for (int i = 0; i < typedLocals(); i++)
+		current->locals[i].type = joinType(current->locals[i].type, state->types[i]);
+}
+static bool sameTypes(TypeState* state){
+	for (int i = 0; i < typedLocals(); i++){
+		if (current->locals[i].type != state->types[i])
+			return false;
+	}
+	return true;
+}
+static void checkpoint(Checkpoint* cp){
+	cp->parser = parser;
+	cp->scanner = scanner;
+	cp->codeCount = currentChunk()->count;
+	cp->constantCount = currentChunk()->constants.count;
+	cp->loopCount = currentChunk()->loopCount;
+	cp->cacheCount = currentChunk()->cacheCount;
+	cp->localCount = current->localCount;
+	cp->scopeDepth = current->scopeDepth;
+}
+static void popLocals(int);
+static void rewindTo(Checkpoint* cp){
+	// local types are left alone, they are what the dry run was for
+	parser = cp->parser;
+	scanner = cp->scanner;
+	currentChunk()->count = cp->codeCount;
+	currentChunk()->constants.count = cp->constantCount;
+	currentChunk()->loopCount = cp->loopCount;
+	currentChunk()->cacheCount = cp->cacheCount;
+	popLocals(cp->localCount);
+	current->scopeDepth = cp->scopeDepth;
+}
 static void number(){
 	double value = strtod(parser.previous.start,NULL);
 	emitConstant(NUMBER_VAL(value));
+	exprType = TYPE_NUMBER;
 }
 static void string(){
-	emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, \
-		parser.previous.length -2)));
+	// the source outlives the compile, see releaseSource
+	emitConstant(borrowedValue(parser.previous.start + 1, \
+		parser.previous.length -2));
+	exprType = TYPE_STRING;
 }
 // forward declarations here
 static void expression();
@@ -88,6 +196,10 @@ static ParseRule* getRule(TokenType type);
 static void parsePrecedence(Precedence precedence);
 static void statement();
 static void declaration();
+static void varDecl();
+static void expressionStatement();
+static void beginScope();
+static void endScope();
 // for recursion
 static void grouping(){
 	expression();
@@ -99,47 +211,218 @@ static void unary(){
 	parsePrecedence(PREC_UNARY);
 	switch (operatorType){
 		case TOKEN_BANG:
-			emitByte(OP_NOT);break;
+			emitByte(OP_NOT);
+			exprType = TYPE_BOOL;
+			break;
 		case TOKEN_MINUS:
-			emitByte(OP_NEGATE);break;
+			emitByte(exprType == TYPE_NUMBER ? OP_NEGATE_NUM : OP_NEGATE);
+			exprType = TYPE_NUMBER; // anything else is a runtime error
+			break;
 		default:
 			return;
 	}
 }
+static StaticType addResultType(StaticType a, StaticType b){
+	// OP_ADD either adds two numbers, concats two strings or errors out,
+	// so one known operand is enough to know the result
+	if (a == TYPE_NUMBER || b == TYPE_NUMBER)
+		return TYPE_NUMBER;
+	if (a == TYPE_STRING || b == TYPE_STRING)
+		return TYPE_STRING;
+	return TYPE_UNKNOWN;
+}
 static void binary(){
 	TokenType operatorType = parser.previous.type;
+	StaticType leftType = exprType;
 	PParseRule rule = getRule(operatorType);
 	parsePrecedence((Precedence)(rule->prec + 1)); // left associative
+	bool numeric = leftType == TYPE_NUMBER && exprType == TYPE_NUMBER;
+	StaticType resultType = TYPE_BOOL;
 	switch (operatorType){
 		case TOKEN_PLUS: 
-			emitByte(OP_ADD); break;
+			emitByte(numeric ? OP_ADD_NUM : OP_ADD);
+			resultType = addResultType(leftType, exprType);
+			break;
 		case TOKEN_MINUS:      
-			emitByte(OP_SUBTRACT); break;
+			emitByte(numeric ? OP_SUBTRACT_NUM : OP_SUBTRACT);
+			resultType = TYPE_NUMBER;
+			break;
 		case TOKEN_STAR:      
-			emitByte(OP_MULTIPLY); break;
+			emitByte(numeric ? OP_MULTIPLY_NUM : OP_MULTIPLY);
+			resultType = TYPE_NUMBER;
+			break;
 		case TOKEN_SLASH:    
-			emitByte(OP_DIVIDE); break;
+			emitByte(numeric ? OP_DIVIDE_NUM : OP_DIVIDE);
+			resultType = TYPE_NUMBER;
+			break;
 		case TOKEN_BANG_EQUAL:    
-			emitBytes(OP_EQUAL, OP_NOT); break;
+			lastCompare = currentChunk()->count;
+			emitBytes(numeric ? OP_EQUAL_NUM : OP_EQUAL, OP_NOT); break;
 		case TOKEN_EQUAL_EQUAL:   
-			emitByte(OP_EQUAL); break;
+			lastCompare = currentChunk()->count;
+			emitByte(numeric ? OP_EQUAL_NUM : OP_EQUAL); break;
 		case TOKEN_GREATER:       
-			emitByte(OP_GREATER); break;
+			lastCompare = currentChunk()->count;
+			emitByte(numeric ? OP_GREATER_NUM : OP_GREATER); break;
 		case TOKEN_GREATER_EQUAL: 
-			emitBytes(OP_LESS, OP_NOT); break;
+			lastCompare = currentChunk()->count;
+			emitBytes(numeric ? OP_LESS_NUM : OP_LESS, OP_NOT); break;
 		case TOKEN_LESS:          
-			emitByte(OP_LESS); break;
+			lastCompare = currentChunk()->count;
+			emitByte(numeric ? OP_LESS_NUM : OP_LESS); break;
 		case TOKEN_LESS_EQUAL:    
-			emitBytes(OP_GREATER, OP_NOT); break;
+			lastCompare = currentChunk()->count;
+			emitBytes(numeric ? OP_GREATER_NUM : OP_GREATER, OP_NOT); break;
 		default: 
 			return;
 	}
+	exprType = resultType;
+}
+static void and_(){
+	StaticType leftType = exprType;
+	int endJump = emitJump(OP_JUMP_IF_FALSE);
+	emitByte(OP_POP);
+	TypeState left;
+	saveTypes(&left);
+	parsePrecedence(PREC_AND);
+	joinTypes(&left); // the right side might not have run
+	patchJump(endJump);
+	exprType = joinType(leftType, exprType);
+}
+static void or_(){
+	StaticType leftType = exprType;
+	int elseJump = emitJump(OP_JUMP_IF_FALSE);
+	int endJump = emitJump(OP_JUMP);
+	patchJump(elseJump);
+	emitByte(OP_POP);
+	TypeState left;
+	saveTypes(&left);
+	parsePrecedence(PREC_OR);
+	joinTypes(&left);
+	patchJump(endJump);
+	exprType = joinType(leftType, exprType);
+}
+static uint8_t argumentList(){
+	uint8_t argCount = 0;
+	if (!check(TOKEN_RIGHT_PAREN)){
+		do {
+			expression();
+			if (argCount == 255)
+				error("Can't have more than 255 arguments.");
+			argCount++;
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+	return argCount;
+}
+static void call(){
+	int link = nestedCall;
+	nestedCall = -1;
+	uint8_t argCount = argumentList();
+	lastCall = currentChunk()->count;
+	if (link != -1){
+		emitBytes(OP_CALL_NESTED, argCount);
+		emitByte(link);
+	} else {
+		emitBytes(OP_CALL, argCount);
+	}
+	exprType = TYPE_UNKNOWN;
+}
+static void arrayLiteral(){
+	int count = 0;
+	if (!check(TOKEN_RIGHT_BRACKET)){
+		do {
+			expression();
+			if (count == 255)
+				error("Can't have more than 255 elements in an array literal.");
+			count++;
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_BRACKET, "Expect ']' after array elements.");
+	emitBytes(OP_ARRAY, count);
+	exprType = TYPE_ARRAY;
+}
+static void mapLiteral(){
+	int count = 0;
+	if (!check(TOKEN_RIGHT_BRACE)){
+		do {
+			expression();
+			consume(TOKEN_COLON, "Expect ':' after map key.");
+			expression();
+			if (count == 255)
+				error("Can't have more than 255 entries in a map literal.");
+			count++;
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+	emitBytes(OP_MAP, count);
+	exprType = TYPE_UNKNOWN;
+}
+static void subscript(){
+	bool assign = canAssign;
+	StaticType receiver = exprType;
+	expression();
+	consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+	if (match(TOKEN_EQUAL)){
+		if (assign){
+			expression();
+			emitByte(OP_INDEX_SET);
+		} else {
+			error("Invalid assignment target.");
+		}
+	} else {
+		lastIndex = currentChunk()->count;
+		emitByte(OP_INDEX_GET);
+	}
+	// array elements are numbers, anything else is a runtime error. a map
+	// holds anything
+	exprType = receiver == TYPE_ARRAY ? TYPE_NUMBER : TYPE_UNKNOWN;
+}
+static void in_(){
+	parsePrecedence(PREC_COMPARISON + 1);
+	emitByte(OP_HAS);
+	exprType = TYPE_BOOL;
+}
+static void delete_(){
+	// delete m[k]: parsed as the lookup, which then turns into the delete
+	lastIndex = -1;
+	lastJumpTarget = -1;
+	parsePrecedence(PREC_CALL);
+	PChunk chunk = currentChunk();
+	if (lastIndex != chunk->count - 1 || lastJumpTarget > lastIndex){
+		error("Expect a subscript after 'delete'.");
+		return;
+	}
+	chunk->code[lastIndex] = OP_DELETE;
+	lastIndex = -1;
+	exprType = TYPE_BOOL;
+}
+static void fiber(){
+	// fiber f(x) and spawn f(x) evaluate f and x here, the call itself
+	// happens in the new fiber
+	bool spawn = parser.previous.type == TOKEN_SPAWN;
+	lastCall = -1;
+	lastJumpTarget = -1;
+	parsePrecedence(PREC_CALL);
+	PChunk chunk = currentChunk();
+	if (lastCall != chunk->count - 2 || lastJumpTarget > lastCall){
+		error(spawn ? "Expect a call after 'spawn'." : "Expect a call after 'fiber'.");
+		return;
+	}
+	chunk->code[lastCall] = spawn ? OP_SPAWN : OP_FIBER;
+	lastCall = -1; // not a call any more, return must not make it a tail call
+	exprType = TYPE_UNKNOWN;
+}
+static void resume_(){
+	parsePrecedence(PREC_UNARY);
+	emitByte(OP_RESUME);
+	exprType = TYPE_UNKNOWN;
 }
 static void literal(){
 	switch(parser.previous.type){
-		case TOKEN_FALSE: emitByte(OP_FALSE); break;
-		case TOKEN_TRUE: emitByte(OP_TRUE); break;
-		case TOKEN_NIL: emitByte(OP_NIL); break;
+		case TOKEN_FALSE: emitByte(OP_FALSE); exprType = TYPE_BOOL; break;
+		case TOKEN_TRUE: emitByte(OP_TRUE); exprType = TYPE_BOOL; break;
+		case TOKEN_NIL: emitByte(OP_NIL); exprType = TYPE_NIL; break;
 		default:
 			return;
 	}
@@ -151,11 +434,14 @@ static void parsePrecedence(Precedence prec){
 		error("Expect expression.");
 		return;
 	}
-	canAssign = prec <= PREC_ASSIGNMENT;
+	bool assignable = prec <= PREC_ASSIGNMENT;
+	canAssign = assignable;
+	exprType = TYPE_UNKNOWN;
 	prefixRule();
 	while (prec <= getRule(parser.current.type)->prec) {
 		advance();
 		ParseFn infixRule = getRule(parser.previous.type)->infix;
+		canAssign = assignable; // operands parsed so far may have changed it
 		infixRule();
 	}
 }
@@ -174,10 +460,8 @@ static void emitGlobal(int global, bool set){
 		else 
 			emitBytes(OP_GLOBAL_GET,global & 0xff);
 	} else {
-		if (set){
+		if (set)
 			emitByte(OP_GLOBAL_SET_LONG);
-			emitByte(OP_POP);
-		}
 		else 
 			emitByte(OP_GLOBAL_GET_LONG);
 		emitByte(global & 0xff);
@@ -186,27 +470,233 @@ static void emitGlobal(int global, bool set){
 	}
 }
 static void emitLocal(int offset, bool set){
-	if (set)
-		emitBytes(OP_LOCAL_SET,offset & 0xff);
-	else 
-		emitBytes(OP_LOCAL_GET,offset & 0xff);
+	if (offset <= UINT8_MAX){
+		emitBytes(set ? OP_LOCAL_SET : OP_LOCAL_GET, offset);
+	} else {
+		emitByte(set ? OP_LOCAL_SET_LONG : OP_LOCAL_GET_LONG);
+		emitBytes(offset & 0xff, (offset >> 8) & 0xff);
+	}
 }
 static bool idEqual(Token a, Token b){
-	return a.length == b.length && memcmp(&a.start,&b.start,a.length) == 0;
+	return a.length == b.length && memcmp(a.start,b.start,a.length) == 0;
 }
 
+static LocalName* findName(PCompiler compiler, Token name, uint32_t hash){
+	uint32_t mask = (uint32_t)compiler->nameCapacity - 1;
+	for (uint32_t i = hash & mask;; i = (i + 1) & mask){
+		LocalName* entry = &compiler->names[i];
+		if (entry->name.start == NULL || idEqual(entry->name, name))
+			return entry;
+	}
+}
 static int resolveLocal(PCompiler compiler,Token name){
-	for (int i = compiler->localCount-1; i >= 0; i--){
-		// decremental for loop for local shadowing
-		if (idEqual(name,compiler->locals[i].name))
+	// the table points at the innermost local of each name, so shadowing
+	// needs no scan
+	if (compiler->nameCount == 0)
+		return -1;
+	LocalName* entry = findName(compiler, name, calcHash(name.start, name.length));
+	return entry->name.start == NULL ? -1 : entry->local;
+}
+static bool visible(PCompiler compiler, Token name){
+	for (; compiler != NULL; compiler = compiler->enclosing)
+		if (resolveLocal(compiler, name) != -1)
+			return true;
+	return false;
+}
+static int addCapture(PCompiler compiler, uint8_t link, int index){
+	// one upvalue per variable, however often the function uses it
+	PObjFunction function = compiler->function;
+	for (int i = 0; i < function->captureCount; i++)
+		if (function->captures[i].link == link && function->captures[i].index == index)
 			return i;
+	if (function->captureCount == UINT16_MAX + 1){
+		error("Too many captured variables in function.");
+		return 0;
+	}
+	if (function->captureCapacity < function->captureCount + 1){
+		int oldCapacity = function->captureCapacity;
+		function->captureCapacity = GROW_CAPACITY(oldCapacity);
+		function->captures = GROW_ARRAY(Capture, function->captures, oldCapacity,
+			function->captureCapacity, MEM_CHUNK);
 	}
-	return -1;
+	function->captures[function->captureCount].link = link;
+	function->captures[function->captureCount].index = index;
+	return function->captureCount++;
 }
-static void varRead(){
-	Token name = parser.previous;
-	int idx = emitConstant(OBJ_VAL(copyString(name.start,name.length)));
-	int stackOffset; bool set = false;
+static int resolveOuter(PCompiler compiler, Token name, uint8_t* link, bool set, bool escaping){
+	// a variable of an enclosing function, -1 when there is none. a function
+	// that never escapes reaches it through the static links, link hops up
+	// (see OP_OUTER_GET). an escaping one captures it into an upvalue of its
+	// own, the variable then has to be closed when its scope ends. escaping
+	// is whether a function between the variable and its use escapes
+	PCompiler enclosing = compiler->enclosing;
+	if (enclosing == NULL)
+		return -1;
+	if (compiler->type == FUN_METHOD || compiler->type == FUN_INITIALIZER){
+		// methods are looked up by name, there is no closure to carry
+		if (visible(enclosing, name))
+			error("Can't use local variables of an enclosing function in a method.");
+		return -1;
+	}
+	escaping = escaping || compiler->escaping;
+	uint8_t outer = 0;
+	int index = resolveLocal(enclosing, name);
+	if (index != -1){
+		Local* local = &enclosing->locals[index];
+		local->captured = local->captured || escaping;
+		local->shared = local->shared || set;
+	} else {
+		index = resolveOuter(enclosing, name, &outer, set, escaping);
+		if (index == -1)
+			return -1;
+	}
+	if (compiler->escaping){
+		*link = OUTER_UPVALUE;
+		return addCapture(compiler, outer, index);
+	}
+	if ((outer & ~OUTER_UPVALUE) == (uint8_t)~OUTER_UPVALUE)
+		error("Too many nested functions.");
+	*link = outer + 1;
+	return index;
+}
+static Local* outerLocal(uint8_t link, int index){
+	PCompiler compiler = current;
+	for (int hops = link; hops > 0; hops--)
+		compiler = compiler->enclosing;
+	return &compiler->locals[index];
+}
+static void growNames(PCompiler compiler){
+	int oldCapacity = compiler->nameCapacity;
+	LocalName* old = compiler->names;
+	compiler->nameCapacity = GROW_CAPACITY(oldCapacity);
+	compiler->names = ALLOCATE(LocalName, compiler->nameCapacity, MEM_COMPILER);
+	for (int i = 0; i < compiler->nameCapacity; i++)
+		compiler->names[i].name.start = NULL;
+	for (int i = 0; i < oldCapacity; i++){
+		if (old[i].name.start == NULL)
+			continue;
+		Token name = old[i].name;
+		*findName(compiler, name, calcHash(name.start, name.length)) = old[i];
+	}
+	FREE_ARRAY(LocalName, old, oldCapacity, MEM_COMPILER);
+}
+static void pushLocal(Token name){
+	PCompiler compiler = current;
+	if (compiler->localCount == compiler->localCapacity){
+		int oldCapacity = compiler->localCapacity;
+		compiler->localCapacity = GROW_CAPACITY(oldCapacity);
+		compiler->locals = GROW_ARRAY(Local, compiler->locals, oldCapacity,
+			compiler->localCapacity, MEM_COMPILER);
+	}
+	if ((compiler->nameCount + 1) * 4 > compiler->nameCapacity * 3)
+		growNames(compiler);
+	uint32_t hash = calcHash(name.start, name.length);
+	LocalName* entry = findName(compiler, name, hash);
+	if (entry->name.start == NULL){
+		entry->name = name;
+		entry->local = -1;
+		compiler->nameCount++;
+	}
+	int slot = compiler->localCount++;
+	Local* local = &compiler->locals[slot];
+	local->name = name;
+	local->depth = compiler->scopeDepth;
+	local->type = slot < TYPED_LOCALS ? exprType : TYPE_UNKNOWN;
+	local->hash = hash;
+	local->shadowed = entry->local;
+	local->captured = false;
+	local->shared = false;
+	local->nested = false;
+	entry->local = slot;
+	if (compiler->localCount > compiler->function->slots)
+		compiler->function->slots = compiler->localCount;
+}
+static void popLocals(int count){
+	// back down to count locals, the names they shadowed resolve again
+	while (current->localCount > count){
+		Local* local = &current->locals[--current->localCount];
+		findName(current, local->name, local->hash)->local = local->shadowed;
+	}
+}
+static int identifierConstant(Token name){
+	// the name is only an operand, it is never pushed
+	return addConstant(currentChunk(),stringValue(name.start,name.length));
+}
+static int shortConstant(Token name){
+	// names of classes, methods and properties take a two-byte operand
+	int constant = identifierConstant(name);
+	if (constant > UINT16_MAX)
+		error("Too many constants in one chunk.");
+	return constant;
+}
+static void emitShort(uint8_t instruction, int operand){
+	emitByte(instruction);
+	emitBytes(operand & 0xff, (operand >> 8) & 0xff);
+}
+static void emitProperty(uint8_t instruction, int name){
+	// every site gets an inline cache of its own
+	int cache = addInlineCache(currentChunk());
+	if (cache > UINT16_MAX)
+		error("Too many property accesses in one chunk.");
+	emitShort(instruction, name);
+	emitBytes(cache & 0xff, (cache >> 8) & 0xff);
+}
+static void dot(){
+	bool assign = canAssign;
+	consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
+	int name = shortConstant(parser.previous);
+	if (match(TOKEN_EQUAL)){
+		if (assign){
+			expression();
+			emitProperty(OP_SET_PROPERTY, name);
+		} else {
+			error("Invalid assignment target.");
+		}
+	} else if (match(TOKEN_LEFT_PAREN)){
+		uint8_t argCount = argumentList();
+		emitProperty(OP_INVOKE, name);
+		emitByte(argCount);
+	} else {
+		emitProperty(OP_GET_PROPERTY, name);
+	}
+	exprType = TYPE_UNKNOWN;
+}
+static bool inMethod(){
+	return current->type == FUN_METHOD || current->type == FUN_INITIALIZER;
+}
+static void variable(Token name);
+static void this_(){
+	// the receiver is slot 0 of a method, named so that functions nested
+	// in one find it like any other variable of the method
+	if (currentClass == NULL){
+		error("Can't use 'this' outside of a method.");
+		return;
+	}
+	Token name = { .start = "this", .length = 4 };
+	canAssign = false;
+	variable(name);
+	exprType = TYPE_UNKNOWN;
+}
+static void super_(){
+	if (!inMethod())
+		error("Can't use 'super' outside of a method.");
+	else if (!currentClass->hasSuperclass)
+		error("Can't use 'super' in a class with no superclass.");
+	consume(TOKEN_DOT, "Expect '.' after 'super'.");
+	consume(TOKEN_IDENTIFIER, "Expect superclass method name.");
+	int name = shortConstant(parser.previous);
+	emitLocal(0, false);
+	if (match(TOKEN_LEFT_PAREN)){
+		uint8_t argCount = argumentList();
+		emitShort(OP_SUPER_INVOKE, name);
+		emitByte(argCount);
+	} else {
+		emitShort(OP_GET_SUPER, name);
+	}
+	exprType = TYPE_UNKNOWN;
+}
+static void variable(Token name){
+	bool set = false;
 	if (match(TOKEN_EQUAL)){
 		if (canAssign){
 			expression();
@@ -215,22 +705,49 @@ static void varRead(){
 			error("Invalid assignment target.");
 		}
 	} 
-	stackOffset = resolveLocal(current,name);
+	int stackOffset = resolveLocal(current,name);
 	if (stackOffset != -1){
+		Local* local = &current->locals[stackOffset];
 		emitLocal(stackOffset, set);
+		if (set && stackOffset < TYPED_LOCALS){
+			local->type = exprType;
+			assigned[stackOffset] = true;
+		} else
+			exprType = local->shared ? TYPE_UNKNOWN : local->type;
+		if (local->nested && !set)
+			nestedCall = 0;
 		return;
 	}
-	
-	emitGlobal(idx,set);	
+	uint8_t link;
+	int index = resolveOuter(current, name, &link, set, false);
+	if (index != -1){
+		emitBytes(set ? OP_OUTER_SET : OP_OUTER_GET, link);
+		emitBytes(index & 0xff, (index >> 8) & 0xff);
+		if (!set){
+			exprType = TYPE_UNKNOWN;
+			if (!(link & OUTER_UPVALUE) && outerLocal(link, index)->nested)
+				nestedCall = link;
+		}
+		return;
+	}
+	emitGlobal(identifierConstant(name),set);
+	if (!set)
+		exprType = TYPE_UNKNOWN; // globals can change under our feet
+}
+static void varRead(){
+	variable(parser.previous);
 }
 
 ParseRule rules[] = {
-  [TOKEN_LEFT_PAREN]    = {grouping, NULL,   PREC_NONE},
+  [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
+  [TOKEN_LEFT_BRACE]    = {mapLiteral, NULL, PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {arrayLiteral, subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_DOT]           = {NULL,     dot,    PREC_CALL},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
   [TOKEN_PLUS]          = {NULL,     binary, PREC_TERM},
   [TOKEN_SEMICOLON]     = {NULL,     NULL,   PREC_NONE},
@@ -247,31 +764,51 @@ ParseRule rules[] = {
   [TOKEN_IDENTIFIER]    = {varRead,     NULL,   PREC_NONE},
   [TOKEN_STRING]        = {string,     NULL,   PREC_NONE},
   [TOKEN_NUMBER]        = {number,   NULL,   PREC_NONE},
-  [TOKEN_AND]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_AND]           = {NULL,     and_,   PREC_AND},
   [TOKEN_CLASS]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_DELETE]        = {delete_,  NULL,   PREC_NONE},
   [TOKEN_ELSE]          = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FALSE]         = {literal,     NULL,   PREC_NONE},
+  [TOKEN_FIBER]         = {fiber,    NULL,   PREC_NONE},
   [TOKEN_FOR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_FUN]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_IF]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IN]            = {NULL,     in_,    PREC_COMPARISON},
   [TOKEN_NIL]           = {literal,     NULL,   PREC_NONE},
-  [TOKEN_OR]            = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_OR]            = {NULL,     or_,    PREC_OR},
   [TOKEN_PRINT]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_RESUME]        = {resume_,  NULL,   PREC_NONE},
   [TOKEN_RETURN]        = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_SUPER]         = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_THIS]          = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_SPAWN]         = {fiber,    NULL,   PREC_NONE},
+  [TOKEN_SUPER]         = {super_,   NULL,   PREC_NONE},
+  [TOKEN_THIS]          = {this_,    NULL,   PREC_NONE},
   [TOKEN_TRUE]          = {literal,     NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_YIELD]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IMPORT]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
 static PParseRule getRule(TokenType type){
 	return &rules[type];
 }
-static void endCompiler(){
+static void emitReturn(){
+	if (current->type == FUN_INITIALIZER)
+		emitLocal(0, false);
+	else
+		emitByte(OP_NIL);
 	emitByte(OP_RETURN);
 }
+static PObjFunction endCompiler(){
+	emitReturn();
+	PObjFunction function = current->function;
+	function->chunk.cost = countInstructions(&function->chunk, 0, function->chunk.count);
+	FREE_ARRAY(Local, current->locals, current->localCapacity, MEM_COMPILER);
+	FREE_ARRAY(LocalName, current->names, current->nameCapacity, MEM_COMPILER);
+	current = current->enclosing;
+	return function;
+}
 static void expressionStatement(){
 	expression();
 	consume(TOKEN_SEMICOLON,"Expect ';' after expression.");
@@ -282,13 +819,15 @@ static void beginScope(){
 }
 static void endScope(){
 	int prevCount = current->localCount;
-	while (current->localCount > 0 &&
-		current->locals[current->localCount-1].depth == current->scopeDepth){
-		current->localCount--;	
-	}
-	int delta = prevCount - current->localCount;
-	if (delta)
-		emitBytes(OP_POPN, delta & 0xff);
+	int count = prevCount;
+	bool captured = false;
+	while (count > 0 && current->locals[count-1].depth == current->scopeDepth)
+		captured = current->locals[--count].captured || captured;
+	if (captured)
+		emitShort(OP_CLOSE_UPVALUES, count);
+	popLocals(count);
+	for (int delta = prevCount - count; delta > 0; delta -= UINT8_MAX)
+		emitBytes(OP_POPN, delta < UINT8_MAX ? delta : UINT8_MAX);
 	current->scopeDepth--;
 }
 static void block(){
@@ -297,9 +836,244 @@ static void block(){
 	}
 	consume(TOKEN_RIGHT_BRACE,"Expect '}' after block.");
 }
+static OpCode fusedJump(OpCode compare, bool negated){
+	// the jump is taken when the condition is false
+	switch (compare){
+		case OP_LESS: return negated ? OP_JUMP_IF_LESS : OP_JUMP_IF_NOT_LESS;
+		case OP_GREATER: return negated ? OP_JUMP_IF_GREATER : OP_JUMP_IF_NOT_GREATER;
+		case OP_EQUAL: return negated ? OP_JUMP_IF_EQUAL : OP_JUMP_IF_NOT_EQUAL;
+		case OP_LESS_NUM: return negated ? OP_JUMP_IF_LESS_NUM : OP_JUMP_IF_NOT_LESS_NUM;
+		case OP_GREATER_NUM: return negated ? OP_JUMP_IF_GREATER_NUM : OP_JUMP_IF_NOT_GREATER_NUM;
+		case OP_EQUAL_NUM: return negated ? OP_JUMP_IF_EQUAL_NUM : OP_JUMP_IF_NOT_EQUAL_NUM;
+		default: return OP_POP_JUMP_IF_FALSE;
+	}
+}
+static int condition(TokenType closing, const char* msg){
+	// compiles a condition and the jump taken when it is false. a comparison
+	// at the very end is folded into the jump, unless another jump lands
+	// right after it (and, or)
+	lastCompare = -1;
+	lastJumpTarget = -1;
+	expression();
+	consume(closing, msg);
+	PChunk chunk = currentChunk();
+	if (lastCompare != -1 && lastJumpTarget <= lastCompare){
+		bool negated = lastCompare == chunk->count - 2 && chunk->code[chunk->count - 1] == OP_NOT;
+		if (negated || lastCompare == chunk->count - 1){
+			OpCode compare = chunk->code[lastCompare];
+			chunk->count = lastCompare;
+			return emitJump(fusedJump(compare, negated));
+		}
+	}
+	return emitJump(OP_POP_JUMP_IF_FALSE);
+}
+static void returnStatement(){
+	if (current->type == FUN_SCRIPT)
+		error("Can't return from top-level code.");
+	if (match(TOKEN_SEMICOLON)){
+		emitReturn();
+		return;
+	}
+	if (current->type == FUN_INITIALIZER)
+		error("Can't return a value from an initializer.");
+	lastCall = -1;
+	lastJumpTarget = -1;
+	expression();
+	consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
+	PChunk chunk = currentChunk();
+	if (lastCall >= 0 && lastJumpTarget <= lastCall){
+		if (lastCall == chunk->count - 2 && chunk->code[lastCall] == OP_CALL)
+			chunk->code[lastCall] = OP_TAIL_CALL;
+		// a nested callee can only take over the frame when it links to one
+		// below it, a function declared in this frame needs the frame itself
+		else if (lastCall == chunk->count - 3 && chunk->code[lastCall] == OP_CALL_NESTED &&
+			chunk->code[lastCall + 2] > 0)
+			chunk->code[lastCall] = OP_TAIL_CALL_NESTED;
+	}
+	emitByte(OP_RETURN); // not reached when the tail call is to a function
+}
+static void yieldStatement(){
+	if (match(TOKEN_SEMICOLON))
+		emitByte(OP_NIL);
+	else {
+		expression();
+		consume(TOKEN_SEMICOLON, "Expect ';' after yield value.");
+	}
+	emitByte(OP_YIELD);
+}
+static void importStatement(){
+	// runs when reached, the module body leaves its result like a call
+	consume(TOKEN_STRING, "Expect module name string after 'import'.");
+	string();
+	consume(TOKEN_SEMICOLON, "Expect ';' after module name.");
+	emitBytes(OP_IMPORT, OP_POP);
+}
+static void ifStatement(){
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+	int thenJump = condition(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	TypeState branch;
+	saveTypes(&branch);
+	statement();
+	if (match(TOKEN_ELSE)){
+		int elseJump = emitJump(OP_JUMP);
+		patchJump(thenJump);
+		TypeState thenTypes;
+		saveTypes(&thenTypes);
+		loadTypes(&branch);
+		statement();
+		joinTypes(&thenTypes);
+		patchJump(elseJump);
+	} else {
+		patchJump(thenJump);
+		joinTypes(&branch);
+	}
+}
+static void dryLoop(void (*trip)(TypeState*), TypeState* entry){
+	// a loop inside one that is being compiled dry makes a single trip, the
+	// outer fixpoint runs it again anyway. when its back edge would widen the
+	// header, everything it assigns is taken to be unknown past it
+	bool outer[TYPED_LOCALS];
+	memcpy(outer, assigned, sizeof(assigned));
+	memset(assigned, 0, sizeof(assigned));
+	TypeState end, exit;
+	trip(&end);
+	saveTypes(&exit);
+	loadTypes(entry);
+	joinTypes(&end);
+	if (sameTypes(entry)){
+		loadTypes(&exit); // the header held, the trip was exact
+	} else {
+		loadTypes(entry);
+		for (int i = 0; i < typedLocals(); i++){
+			if (assigned[i])
+				current->locals[i].type = TYPE_UNKNOWN;
+		}
+	}
+	for (int i = 0; i < TYPED_LOCALS; i++)
+		assigned[i] |= outer[i];
+}
+static void compileLoop(void (*trip)(TypeState*)){
+	// types assigned in the body flow back to the header. the loop is compiled
+	// dry, without keeping any code, until the header types stop widening.
+	// trip() compiles the whole loop and hands back the types at its back edge
+	Checkpoint header;
+	TypeState entry, end;
+	saveTypes(&entry);
+	if (dryRun){
+		dryLoop(trip, &entry);
+		return;
+	}
+	checkpoint(&header);
+	dryRun++;
+	for (;;){
+		trip(&end);
+		rewindTo(&header);
+		loadTypes(&entry);
+		joinTypes(&end);
+		if (sameTypes(&entry))
+			break;
+		saveTypes(&entry);
+	}
+	dryRun--;
+	trip(&end);
+}
+static void whileLoop(TypeState* end){
+	int loopStart = currentChunk()->count;
+	int exitJump = condition(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+	TypeState exit;
+	saveTypes(&exit);
+	statement();
+	saveTypes(end);
+	emitLoop(loopStart);
+	patchJump(exitJump);
+	loadTypes(&exit);
+}
+static void whileStatement(){
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+	compileLoop(whileLoop);
+}
+static void skipClause(){
+	// steps over the increment without compiling it, its errors are
+	// reported when it is compiled after the body
+	bool hadError = parser.hadError;
+	bool panicMode = parser.panicMode;
+	int depth = 0;
+	dryRun++;
+	while (!check(TOKEN_EOF)){
+		if (check(TOKEN_LEFT_PAREN))
+			depth++;
+		else if (check(TOKEN_RIGHT_PAREN) && depth-- == 0)
+			break;
+		advance();
+	}
+	dryRun--;
+	parser.hadError = hadError;
+	parser.panicMode = panicMode;
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+}
+static void forLoop(TypeState* end){
+	int loopStart = currentChunk()->count;
+	int exitJump = -1;
+	if (!match(TOKEN_SEMICOLON))
+		exitJump = condition(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+	TypeState exit;
+	saveTypes(&exit);
+	// the increment runs after the body, so it is compiled after it too:
+	// skip it, compile the body, come back for it and then jump past the body
+	Token incrementCurrent = parser.current, incrementPrevious = parser.previous;
+	Scanner increment = scanner;
+	skipClause();
+	statement();
+	Token afterCurrent = parser.current, afterPrevious = parser.previous;
+	Scanner afterBody = scanner;
+	bool panicMode = parser.panicMode; // of the body, it recovers from here
+	parser.current = incrementCurrent; parser.previous = incrementPrevious;
+	scanner = increment;
+	parser.panicMode = false;
+	if (!check(TOKEN_RIGHT_PAREN)){
+		expression();
+		emitByte(OP_POP);
+	}
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+	// an error in the increment is reported by now, recovering from it
+	// after the body would skip tokens that were parsed fine
+	parser.current = afterCurrent; parser.previous = afterPrevious;
+	scanner = afterBody;
+	parser.panicMode = panicMode;
+	saveTypes(end);
+	emitLoop(loopStart);
+	if (exitJump != -1)
+		patchJump(exitJump);
+	loadTypes(&exit);
+}
+static void forStatement(){
+	beginScope();
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+	if (match(TOKEN_SEMICOLON)){
+		// no initializer
+	} else if (match(TOKEN_VAR)){
+		varDecl();
+	} else {
+		expressionStatement();
+	}
+	compileLoop(forLoop);
+	endScope();
+}
 static void statement(){
 	if(match(TOKEN_PRINT)){
 		printStatement();
+	} else if (match(TOKEN_IF)){
+		ifStatement();
+	} else if (match(TOKEN_RETURN)){
+		returnStatement();
+	} else if (match(TOKEN_YIELD)){
+		yieldStatement();
+	} else if (match(TOKEN_IMPORT)){
+		importStatement();
+	} else if (match(TOKEN_WHILE)){
+		whileStatement();
+	} else if (match(TOKEN_FOR)){
+		forStatement();
 	} else if (match(TOKEN_LEFT_BRACE)){
 		beginScope();
 		block();
@@ -322,6 +1096,8 @@ static void synchronize(){
 			case TOKEN_WHILE:
 			case TOKEN_PRINT:
 			case TOKEN_RETURN:
+			case TOKEN_YIELD:
+			case TOKEN_IMPORT:
 				return;
 			default: ;
 		}
@@ -333,11 +1109,10 @@ static void addLocal(Token name){
 		error("Too many local variables, slow down!");
 		return;
 	}
-	if (resolveLocal(current, name) != -1)
+	int existing = resolveLocal(current, name);
+	if (existing != -1 && current->locals[existing].depth == current->scopeDepth)
 		error("Variables with the same name in the same scope.");
-	Local* local = &current->locals[current->localCount++];
-	local->name = name;
-	local->depth = current->scopeDepth;
+	pushLocal(name);
 }
 static int parseVar(const char* errMsg){
 	consume(TOKEN_IDENTIFIER,errMsg);
@@ -345,48 +1120,281 @@ static int parseVar(const char* errMsg){
 	if (current->scopeDepth > 0){
 		return -1;
 	}
-	return emitConstant(OBJ_VAL(copyString(name.start,name.length)));
+	return identifierConstant(name);
 }
 static void varDecl(){
 	// in case of locals, we just let the value for the variable to be pushed to the stack 
 	// we don't emit the identifier constant or the global get/set opcode
 	int global = parseVar("Expect variable name.");
+	Token name = parser.previous;
 	if (match(TOKEN_EQUAL)){
 		expression();
 	} else {
 		emitByte(OP_NIL);
+		exprType = TYPE_NIL;
 	}
-	if (current->scopeDepth > 0)
-		return;
 	consume(TOKEN_SEMICOLON,"Expect ';' after variable declaration.");
+	if (current->scopeDepth > 0){
+		addLocal(name);
+		return;
+	}
 	bool set = true;
 	emitGlobal(global, set);
+	emitByte(OP_POP);
 	
 }
+static void initCompiler(PCompiler, FunctionType, PObjFunction);
+static void function(FunctionType type, bool escaping){
+	Compiler compiler;
+	initCompiler(&compiler, type, newFunction());
+	compiler.escaping = escaping;
+	current->function->id = ++functionCount;
+	beginScope();
+	consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+	if (!check(TOKEN_RIGHT_PAREN)){
+		do {
+			current->function->arity++;
+			if (current->function->arity > 255)
+				errorAtCurrent("Can't have more than 255 parameters.");
+			consume(TOKEN_IDENTIFIER, "Expect parameter name.");
+			exprType = TYPE_UNKNOWN; // whatever the caller passes
+			addLocal(parser.previous);
+		} while (match(TOKEN_COMMA));
+	}
+	consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters.");
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+	block();
+	PObjFunction function = endCompiler();
+	if (function->captureCount == 0){
+		emitConstant(OBJ_VAL(function));
+		return;
+	}
+	int constant = addConstant(currentChunk(), OBJ_VAL(function));
+	if (constant > UINT16_MAX)
+		error("Too many constants in one chunk.");
+	emitShort(OP_CLOSURE, constant);
+}
+typedef struct {
+	int depth; // of the brace that opened it
+	Token name; // of the function, start is NULL for a class body
+	Token next; // the token after the name, the scanner resumes after it
+	Scanner scanner;
+	int stays; // whether the function never escapes itself, -1 until asked
+} Body; // of a function or class met by the escape scan
+static bool scanEscapes(Token name, Token previous, Token token, int nesting);
+static bool bodyStays(Body* body, int nesting){
+	// a use inside another function's body is still a direct call from a
+	// live frame when that function can't escape either
+	if (body->stays == -1){
+		Scanner resume = scanner;
+		scanner = body->scanner;
+		body->stays = body->name.start != NULL && nesting < SCAN_NESTING &&
+			!scanEscapes(body->name, body->name, body->next, nesting + 1);
+		scanner = resume;
+	}
+	return body->stays;
+}
+static bool scanEscapes(Token name, Token previous, Token token, int nesting){
+	// the scanner is right after token, the one after the name
+	Body bodies[BODIES_MAX];
+	int bodyCount = 0;
+	int depth = 0; // braces opened since the declaration
+	bool own = true; // the next brace opens the declared function's body
+	bool pending = false; // the next brace opens a function or class body
+	Body body;
+	while (depth >= 0 && token.type != TOKEN_EOF){
+		Token next = scanToken();
+		switch (token.type){
+			case TOKEN_LEFT_BRACE:
+				depth++;
+				if (own){
+					own = false;
+				} else if (pending){
+					if (bodyCount == BODIES_MAX)
+						return true;
+					body.depth = depth;
+					bodies[bodyCount++] = body;
+					pending = false;
+				}
+				break;
+			case TOKEN_RIGHT_BRACE:
+				if (bodyCount > 0 && bodies[bodyCount - 1].depth == depth)
+					bodyCount--;
+				depth--; // below 0 at the end of the declaring block
+				break;
+			case TOKEN_CLASS:
+				pending = true;
+				body.name.start = NULL;
+				body.stays = false;
+				break;
+			case TOKEN_IDENTIFIER:
+				if (previous.type == TOKEN_FUN){
+					pending = true;
+					body.name = token;
+					body.next = next;
+					body.scanner = scanner;
+					body.stays = -1;
+				}
+				if (!idEqual(token, name) || previous.type == TOKEN_DOT)
+					break;
+				if (next.type != TOKEN_LEFT_PAREN || previous.type == TOKEN_FIBER || previous.type == TOKEN_SPAWN)
+					return true;
+				for (int i = 0; i < bodyCount; i++)
+					if (!bodyStays(&bodies[i], nesting))
+						return true;
+				break;
+			default:
+				break;
+		}
+		previous = token;
+		token = next;
+	}
+	return false;
+}
+static bool escapes(Token name){
+	// whether a function declared in a block can outlive the frame
+	// declaring it. it can't when the rest of the block only ever calls it
+	// directly: from the declaring function, from its own body or from
+	// functions that can't escape either. reads ahead with the scanner and
+	// rewinds it, nothing is compiled
+	if (!escapeAnalysis)
+		return true;
+	Scanner start = scanner;
+	bool escaped = scanEscapes(name, parser.previous, parser.current, 0);
+	scanner = start;
+	return escaped;
+}
+static void funDecl(){
+	int global = parseVar("Expect function name.");
+	Token name = parser.previous;
+	if (current->scopeDepth > 0){
+		// the function value lands in the new local's slot
+		bool escaping = escapes(name);
+		exprType = TYPE_UNKNOWN;
+		addLocal(name);
+		current->locals[current->localCount - 1].nested = !escaping;
+		function(FUN_FUNCTION, escaping);
+		return;
+	}
+	function(FUN_FUNCTION, true);
+	emitGlobal(global, true);
+	emitByte(OP_POP);
+}
+static void method(){
+	consume(TOKEN_IDENTIFIER, "Expect method name.");
+	int name = shortConstant(parser.previous);
+	Token init = { .start = "init", .length = 4 };
+	function(idEqual(parser.previous, init) ? FUN_INITIALIZER : FUN_METHOD, true);
+	emitShort(OP_METHOD, name);
+}
+static void classDecl(){
+	// the class is complete before its name is bound, methods never
+	// change once an instance can exist
+	int global = parseVar("Expect class name.");
+	Token name = parser.previous;
+	emitShort(OP_CLASS, shortConstant(name));
+	ClassCompiler classCompiler = { currentClass, false };
+	currentClass = &classCompiler;
+	if (match(TOKEN_LESS)){
+		consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+		if (idEqual(name, parser.previous))
+			error("A class can't inherit from itself.");
+		canAssign = false;
+		varRead();
+		emitByte(OP_INHERIT);
+		classCompiler.hasSuperclass = true;
+	}
+	consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+	while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF))
+		method();
+	consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+	currentClass = currentClass->enclosing;
+	exprType = TYPE_UNKNOWN;
+	if (current->scopeDepth > 0){
+		addLocal(name);
+		return;
+	}
+	emitGlobal(global, true);
+	emitByte(OP_POP);
+}
 static void declaration(){
-	if (match(TOKEN_VAR))
+	if (match(TOKEN_CLASS))
+		classDecl();
+	else if (match(TOKEN_FUN))
+		funDecl();
+	else if (match(TOKEN_VAR))
 		varDecl();
 	else 
 		statement();
 	if (parser.panicMode)
 		synchronize();
 }
-static void initCompiler(PCompiler compiler){
+static void initCompiler(PCompiler compiler, FunctionType type, PObjFunction function){
+	compiler->enclosing = current;
+	compiler->type = type;
+	compiler->locals = NULL;
 	compiler->localCount = 0;
+	compiler->localCapacity = 0;
+	compiler->names = NULL;
+	compiler->nameCount = 0;
+	compiler->nameCapacity = 0;
 	compiler->scopeDepth = 0;
+	compiler->escaping = false;
+	compiler->function = function;
 	current = compiler;
-	
+	if (type != FUN_SCRIPT)
+		current->function->name = copyString(parser.previous.start, parser.previous.length);
+	// slot 0 holds the function being called, or this for a method
+	Token slot0 = { .start = "", .length = 0 };
+	if (type == FUN_METHOD || type == FUN_INITIALIZER)
+		slot0 = (Token){ .start = "this", .length = 4 };
+	pushLocal(slot0);
+	current->locals[0].type = TYPE_UNKNOWN;
 }
-bool compile(const char* source, PChunk chunk){
+PObjFunction compile(const char* source){
 	Compiler compiler;
-	initCompiler(&compiler);
-	compilingChunk = chunk;
 	initScanner(source);
+	functionCount = 0;
+	currentClass = NULL;
+	nestedCall = -1;
+	initCompiler(&compiler, FUN_SCRIPT, newFunction());
 	initParser();
 	advance();
 	while (!match(TOKEN_EOF)){
 		declaration();
 	}
+	PObjFunction function = endCompiler();
+	return parser.hadError ? NULL : function;
+}
+int compileLine(PObjFunction script, const char* source, int line){
+	// repl input goes after the code of the lines before it
+	PChunk chunk = &script->chunk;
+	int start = chunk->count;
+	int constantCount = chunk->constants.count;
+	int loopCount = chunk->loopCount;
+	int cacheCount = chunk->cacheCount;
+	Compiler compiler;
+	initScanner(source);
+	scanner.line = line;
+	initCompiler(&compiler, FUN_SCRIPT, script);
+	initParser();
+	lastCompare = lastJumpTarget = lastCall = lastIndex = nestedCall = -1;
+	currentClass = NULL;
+	advance();
+	while (!match(TOKEN_EOF)){
+		declaration();
+	}
 	endCompiler();
-	return !parser.hadError;
+	if (parser.hadError){
+		// nothing of a bad line survives, stale line runs go on the next write
+		chunk->count = start;
+		chunk->constants.count = constantCount;
+		chunk->loopCount = loopCount;
+		chunk->cacheCount = cacheCount;
+		return -1;
+	}
+	return start;
+}
+void setEscapeAnalysis(bool enabled){
+	escapeAnalysis = enabled;
 }
\ No newline at end of file
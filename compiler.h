@@ -2,10 +2,19 @@
 #ifndef clox_compiler_h
 #define clox_compiler_h
 #include "chunk.h"
+#include "object.h"
 #include "common.h"
 #include "scanner.h"
-#define LOCALS_MAX UINT8_MAX + 1
-bool compile(const char*, PChunk);
+#define LOCALS_MAX (UINT16_MAX + 1) // slots past the first 256 take a two-byte operand
+#define TYPED_LOCALS (UINT8_MAX + 1) // locals past these always have TYPE_UNKNOWN
+PObjFunction compile(const char*);
+extern int functionCount; // ids handed out since the last compile(), see ObjFunction.id
+// appends to a script compiled earlier, numbering lines from the given one.
+// the offset the new code starts at, -1 after a compile error
+int compileLine(PObjFunction, const char*, int);
+// off turns every nested function that captures anything into a closure,
+// to compare against what the escape analysis keeps on the stack
+void setEscapeAnalysis(bool);
 typedef enum {
   PREC_NONE,
   PREC_ASSIGNMENT,  // =
@@ -25,13 +34,49 @@ typedef struct {
 	ParseFn infix;
 	Precedence prec;
 } ParseRule, *PParseRule;
+typedef enum {
+	TYPE_UNKNOWN, // anything, the vm checks at runtime
+	TYPE_NUMBER,
+	TYPE_BOOL,
+	TYPE_NIL,
+	TYPE_STRING,
+	TYPE_ARRAY // indexing it gives a number
+} StaticType;
 typedef struct {
 	Token name;
 	int depth;
+	StaticType type; // what the slot holds at this point of the compile
+	uint32_t hash; // of the name
+	int shadowed; // local of an outer scope with the same name, -1 if none
+	bool captured; // by a closure, its upvalue is closed when the scope ends
+	bool shared; // assigned by a nested function, its type is never known
+	bool nested; // a function that never escapes, calls to it are linked
 } Local;
 typedef struct {
-	Local locals[LOCALS_MAX];
+	Token name; // start is NULL while the entry is unused
+	int local; // innermost local with the name, -1 when none is in scope
+} LocalName;
+typedef enum {
+	FUN_FUNCTION,
+	FUN_SCRIPT,
+	FUN_METHOD, // slot 0 holds this
+	FUN_INITIALIZER // a method that returns this
+} FunctionType;
+typedef struct _Compiler {
+	struct _Compiler* enclosing;
+	PObjFunction function;
+	FunctionType type;
+	Local* locals;
 	int localCount;
+	int localCapacity;
+	LocalName* names; // open addressing by name, entries are never removed
+	int nameCount;
+	int nameCapacity;
 	int scopeDepth;
+	bool escaping; // may outlive the frames it reaches into, captures instead
 } Compiler, *PCompiler;
+typedef struct _ClassCompiler {
+	struct _ClassCompiler* enclosing;
+	bool hasSuperclass;
+} ClassCompiler, *PClassCompiler;
 #endif
\ No newline at end of file
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE // F_SETSIG, F_SETOWN_EX, syscall
+
+#include <errno.h>
+#include <signal.h>
+#include "counters.h"
+#include "debug.h"
+
+bool counterSampling = false;
+volatile int sampledOpcode = SAMPLE_OUTSIDE;
+
+static const char* counterNames[COUNTER_COUNT] = {
+	"cycles", "instructions", "branch_misses", "cache_misses", "page_faults"
+};
+// the phases anything is charged to, load and teardown are not
+static const Phase reported[] = { PHASE_SCAN, PHASE_COMPILE, PHASE_JIT, PHASE_RUN };
+static const char* reportedNames[] = { "scan", "compile", "jit", "run" };
+#define REPORTED_COUNT (sizeof(reported) / sizeof(reported[0]))
+
+static bool started = false;
+static int openError = 0; // of the first counter that could not be opened
+static uint64_t totals[PHASE_COUNT][COUNTER_COUNT];
+
+#ifdef __linux__
+#include <fcntl.h>
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+typedef struct {
+	const char* name;
+	uint32_t type;
+	uint64_t config;
+	uint64_t period; // events between samples
+} Event;
+
+static const Event counted[COUNTER_COUNT] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 0 },
+	{ "instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS, 0 },
+	{ "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 0 },
+	{ "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 0 },
+	{ "page_faults", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS, 0 },
+};
+// the task clock stands in for cycles on machines without a pmu, so the
+// opcodes still get a profile. odd periods keep samples from falling into
+// step with loops
+static const Event sampled[] = {
+	{ "cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES, 1000003 },
+	{ "task_clock", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK, 100003 }, // nanoseconds
+	{ "branch_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES, 10007 },
+	{ "cache_misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES, 10007 },
+};
+#define SAMPLED_COUNT (sizeof(sampled) / sizeof(sampled[0]))
+
+static int fds[COUNTER_COUNT]; // -1 for a counter we don't have
+static int sampleFds[SAMPLED_COUNT];
+static bool opened[COUNTER_COUNT]; // still true after stopCounters, for the report
+static bool sampleOpened[SAMPLED_COUNT];
+static volatile uint32_t samples[SAMPLE_NATIVE + 1][SAMPLED_COUNT];
+static Phase current = PHASE_COUNT;
+static uint64_t last[COUNTER_COUNT];
+
+static int openEvent(const Event* event){
+	struct perf_event_attr attr;
+	memset(&attr, 0, sizeof(attr));
+	attr.size = sizeof(attr);
+	attr.type = event->type;
+	attr.config = event->config;
+	attr.exclude_kernel = 1; // what an unprivileged process may count
+	attr.exclude_hv = 1;
+	attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+	if (event->period != 0){
+		attr.sample_period = event->period;
+		attr.disabled = 1; // armed one overflow at a time, see onOverflow
+	}
+	int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, PERF_FLAG_FD_CLOEXEC);
+	if (fd < 0 && openError == 0)
+		openError = errno;
+	return fd;
+}
+static uint64_t readCounter(int fd){
+	// scaled up when the kernel had to multiplex it with other events
+	uint64_t values[3]; // count, time enabled, time running
+	if (read(fd, values, sizeof(values)) != sizeof(values) || values[2] == 0)
+		return 0;
+	if (values[2] < values[1])
+		return (uint64_t)((double)values[0] * values[1] / values[2]);
+	return values[0];
+}
+static void onOverflow(int signal, siginfo_t* info, void* context){
+	(void)signal;
+	(void)context;
+	int saved = errno;
+	for (size_t i = 0; i < SAMPLED_COUNT; i++){
+		if (sampleFds[i] != info->si_fd)
+			continue;
+		int opcode = sampledOpcode;
+		if (opcode != SAMPLE_OUTSIDE)
+			samples[opcode][i]++;
+		ioctl(info->si_fd, PERF_EVENT_IOC_REFRESH, 1);
+		break;
+	}
+	errno = saved;
+}
+static bool startSampling(){
+	// every overflow raises SIGIO on this thread, the sweeper never sees one
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_sigaction = onOverflow;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_SIGINFO | SA_RESTART;
+	sigaction(SIGIO, &action, NULL);
+	struct f_owner_ex owner = { F_OWNER_TID, (pid_t)syscall(SYS_gettid) };
+	bool any = false;
+	for (size_t i = 0; i < SAMPLED_COUNT; i++){
+		sampleFds[i] = -1;
+		if (sampled[i].type == PERF_TYPE_SOFTWARE && sampleFds[0] >= 0)
+			continue; // there are real cycles
+		int fd = openEvent(&sampled[i]);
+		if (fd < 0)
+			continue;
+		if (fcntl(fd, F_SETFL, O_ASYNC) != 0 || fcntl(fd, F_SETSIG, SIGIO) != 0 ||
+			fcntl(fd, F_SETOWN_EX, &owner) != 0){
+			close(fd);
+			continue;
+		}
+		sampleFds[i] = fd;
+		sampleOpened[i] = true;
+		ioctl(fd, PERF_EVENT_IOC_REFRESH, 1);
+		any = true;
+	}
+	if (!any)
+		signal(SIGIO, SIG_DFL);
+	return any;
+}
+bool startCounters(bool sample){
+	started = true;
+	bool any = false;
+	for (int i = 0; i < COUNTER_COUNT; i++){
+		fds[i] = openEvent(&counted[i]);
+		opened[i] = fds[i] >= 0;
+		any |= opened[i];
+	}
+	if (sample)
+		counterSampling = startSampling();
+	return any || counterSampling;
+}
+Phase enterPhase(Phase phase){
+	if (!started)
+		return PHASE_COUNT;
+	sampledOpcode = SAMPLE_OUTSIDE; // run() sets it again at the next instruction
+	for (int i = 0; i < COUNTER_COUNT; i++){
+		if (fds[i] < 0)
+			continue;
+		uint64_t now = readCounter(fds[i]);
+		if (current != PHASE_COUNT && now > last[i]) // scaled counts can step back
+			totals[current][i] += now - last[i];
+		last[i] = now;
+	}
+	Phase left = current;
+	current = phase;
+	return left;
+}
+static void writeSamples(FILE* out){
+	bool any = false;
+	for (size_t i = 0; i < SAMPLED_COUNT; i++)
+		any |= sampleOpened[i];
+	if (!any)
+		return;
+	fputs(",\n \"samples\": {\"periods\": {", out);
+	bool first = true;
+	for (size_t i = 0; i < SAMPLED_COUNT; i++){
+		if (!sampleOpened[i])
+			continue;
+		fprintf(out, "%s\"%s\": %llu", first ? "" : ", ", sampled[i].name,
+			(unsigned long long)sampled[i].period);
+		first = false;
+	}
+	fputs("}, \"opcodes\": {", out);
+	first = true;
+	for (int opcode = 0; opcode <= SAMPLE_NATIVE; opcode++){
+		uint32_t total = 0;
+		for (size_t i = 0; i < SAMPLED_COUNT; i++)
+			total += samples[opcode][i];
+		if (total == 0)
+			continue;
+		const char* name = opcode == SAMPLE_NATIVE ? "native" : opcodeName((uint8_t)opcode);
+		if (name == NULL)
+			fprintf(out, "%s\"%d\": {", first ? "" : ", ", opcode);
+		else
+			fprintf(out, "%s\"%s\": {", first ? "" : ", ", name);
+		first = false;
+		bool firstCount = true;
+		for (size_t i = 0; i < SAMPLED_COUNT; i++){
+			if (!sampleOpened[i])
+				continue;
+			fprintf(out, "%s\"%s\": %u", firstCount ? "" : ", ", sampled[i].name, samples[opcode][i]);
+			firstCount = false;
+		}
+		fputs("}", out);
+	}
+	fputs("}}", out);
+}
+static bool counting(Counter counter){
+	return opened[counter];
+}
+void stopCounters(){
+	if (!started)
+		return;
+	enterPhase(PHASE_COUNT);
+	for (int i = 0; i < COUNTER_COUNT; i++){
+		if (fds[i] >= 0)
+			close(fds[i]);
+		fds[i] = -1;
+	}
+	if (counterSampling){
+		for (size_t i = 0; i < SAMPLED_COUNT; i++){
+			if (sampleFds[i] >= 0){
+				ioctl(sampleFds[i], PERF_EVENT_IOC_DISABLE, 0);
+				close(sampleFds[i]);
+			}
+			sampleFds[i] = -1;
+		}
+		signal(SIGIO, SIG_IGN); // one may still be on its way
+		counterSampling = false;
+	}
+}
+#else
+// nothing to count with, every counter is reported as null
+bool startCounters(bool sample){
+	(void)sample;
+	started = true;
+	openError = ENOSYS;
+	return false;
+}
+Phase enterPhase(Phase phase){
+	(void)phase;
+	return PHASE_COUNT;
+}
+static void writeSamples(FILE* out){
+	(void)out;
+}
+static bool counting(Counter counter){
+	(void)counter;
+	return false;
+}
+void stopCounters(){
+}
+#endif
+
+void writeCounters(FILE* out){
+	// a member of the stats object, nothing unless counters were asked for
+	if (!started)
+		return;
+	fputs(",\n \"counters\": {", out);
+	if (openError != 0)
+		fprintf(out, "\"unavailable\": \"%s\", ", strerror(openError));
+	fputs("\"phases\": {", out);
+	for (size_t p = 0; p < REPORTED_COUNT; p++){
+		uint64_t* counts = totals[reported[p]];
+		fprintf(out, "%s\"%s\": {", p == 0 ? "" : ", ", reportedNames[p]);
+		for (int i = 0; i < COUNTER_COUNT; i++){
+			fprintf(out, "\"%s\": ", counterNames[i]);
+			if (counting((Counter)i))
+				fprintf(out, "%llu, ", (unsigned long long)counts[i]);
+			else
+				fputs("null, ", out);
+		}
+		if (counting(COUNTER_CYCLES) && counting(COUNTER_INSTRUCTIONS) && counts[COUNTER_CYCLES] != 0)
+			fprintf(out, "\"ipc\": %.3f}", (double)counts[COUNTER_INSTRUCTIONS] / counts[COUNTER_CYCLES]);
+		else
+			fputs("\"ipc\": null}", out);
+	}
+	fputs("}", out);
+	writeSamples(out);
+	fputs("}", out);
+}
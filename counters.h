@@ -0,0 +1,33 @@
+#ifndef clox_counters_h
+#define clox_counters_h
+#include "common.h"
+#include "vm.h"
+
+// hardware counters from perf_event_open, charged to the phase that is
+// running and reported with the timing stats. whatever the machine or the
+// kernel does not let us count is reported as null, the rest still counts.
+// in sampling mode every overflow of a sampled counter is charged to the
+// opcode the interpreter is at
+typedef enum {
+	COUNTER_CYCLES,
+	COUNTER_INSTRUCTIONS,
+	COUNTER_BRANCH_MISSES,
+	COUNTER_CACHE_MISSES,
+	COUNTER_PAGE_FAULTS, // a software event, there even without a pmu
+	COUNTER_COUNT
+} Counter;
+
+#define SAMPLE_OUTSIDE (-1) // not in run(), overflows are dropped
+#define SAMPLE_NATIVE 256 // in code the jit generated
+
+extern bool counterSampling;
+extern volatile int sampledOpcode; // set by run() before each instruction while sampling
+
+bool startCounters(bool); // true to sample by opcode, false when nothing can be counted
+// charges what was counted since the last switch to the phase that was
+// running and returns it, PHASE_COUNT for none. switching back to it
+// nests phases, the jit inside run for one
+Phase enterPhase(Phase);
+void writeCounters(FILE*);
+void stopCounters();
+#endif
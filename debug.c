@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include "debug.h"
 #include "value.h"
+#include "output.h"
 static int simpleInstruction(const char* name, int offset){
 	printf("%s\n",name);
 	return offset + 1;
@@ -9,14 +10,16 @@ static int constantInstruction(const char* name, PChunk chunk, int offset){
 	uint8_t constantIdx = chunk->code[offset+1];
 	printf("%-16s %08d '",name,constantIdx);
 	printValue((chunk->constants).values[constantIdx]);
+	flushOutput(); // printValue goes through the output buffer
 	printf("'\n");
 	return offset + 2;
 }
 static int constantLongInstruction(const char* name, PChunk chunk, int offset){
-	int constantIdx = chunk->code[offset+1] + chunk->code[offset+2] << 8 \
-		+ chunk->code[offset+3] << 16;
+	int constantIdx = chunk->code[offset+1] | (chunk->code[offset+2] << 8) |
+		(chunk->code[offset+3] << 16);
 	printf("%-16s %08d '",name,constantIdx);
 	printValue((chunk->constants).values[constantIdx]);
+	flushOutput();
 	printf("'\n");
 	return offset + 4;
 }
@@ -25,6 +28,65 @@ static int byteInstruction(const char* name, PChunk chunk, int offset){
 	printf("%-16s %4d\n", name, slot);
 	return offset + 2;
 }
+static int shortInstruction(const char* name, PChunk chunk, int offset){
+	uint16_t slot = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+	printf("%-16s %4d\n", name, slot);
+	return offset + 3;
+}
+static int propertyInstruction(const char* name, PChunk chunk, int offset){
+	// name, inline cache and for invokes the argument count
+	uint16_t constantIdx = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+	uint16_t cache = chunk->code[offset + 3] | (chunk->code[offset + 4] << 8);
+	InlineCache* site = &chunk->caches[cache];
+	printf("%-16s %08d '", name, constantIdx);
+	printValue((chunk->constants).values[constantIdx]);
+	flushOutput();
+	printf("' cache %d (%d ways%s)", cache, site->count, site->megamorphic ? ", megamorphic" : "");
+	if (chunk->code[offset] == OP_INVOKE){
+		printf(" (%d args)\n", chunk->code[offset + 5]);
+		return offset + 6;
+	}
+	printf("\n");
+	return offset + 5;
+}
+static int nameInstruction(const char* name, PChunk chunk, int offset){
+	uint16_t constantIdx = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+	printf("%-16s %08d '", name, constantIdx);
+	printValue((chunk->constants).values[constantIdx]);
+	flushOutput();
+	if (chunk->code[offset] == OP_SUPER_INVOKE){
+		printf("' (%d args)\n", chunk->code[offset + 3]);
+		return offset + 4;
+	}
+	printf("'\n");
+	return offset + 3;
+}
+static int outerInstruction(const char* name, PChunk chunk, int offset){
+	uint8_t link = chunk->code[offset + 1];
+	uint16_t index = chunk->code[offset + 2] | (chunk->code[offset + 3] << 8);
+	printf("%-16s %4d %s %d hops up\n", name, index,
+		link & OUTER_UPVALUE ? "upvalue" : "local", link & ~OUTER_UPVALUE);
+	return offset + 4;
+}
+static int jumpInstruction(const char* name, int sign, PChunk chunk, int offset){
+	uint16_t jump = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+	printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+	return offset + 3;
+}
+static int loopInstruction(const char* name, PChunk chunk, int offset){
+	uint16_t jump = chunk->code[offset + 1] | (chunk->code[offset + 2] << 8);
+	uint16_t counter = chunk->code[offset + 3] | (chunk->code[offset + 4] << 8);
+	printf("%-16s %4d -> %d (hits %llu)\n", name, offset, offset + 5 - jump,
+		(unsigned long long)chunk->loops[counter].hits);
+	return offset + 5;
+}
+void printLoopCounters(PChunk chunk){
+	for (int i = 0; i < chunk->loopCount; i++){
+		LoopCounter* loop = &chunk->loops[i];
+		printf("\tloop at %04d (line %d): %llu back edges\n", loop->start,
+			getLine(chunk, loop->start), (unsigned long long)loop->hits);
+	}
+}
 void disassembleChunk(PChunk chunk, const char* name){
 	printf("\t== %s ==\n",name);
 	for (int offset = 0; offset < chunk->count;){
@@ -53,6 +115,12 @@ int disassembleInstruction(PChunk chunk, int offset){
 			return byteInstruction("OP_LOCAL_GET", chunk, offset);
 		case OP_LOCAL_SET:
 			return byteInstruction("OP_LOCAL_SET", chunk, offset);
+		case OP_LOCAL_GET_LONG:
+			return shortInstruction("OP_LOCAL_GET_LONG", chunk, offset);
+		case OP_LOCAL_SET_LONG:
+			return shortInstruction("OP_LOCAL_SET_LONG", chunk, offset);
+		case OP_IMPORT:
+			return simpleInstruction("OP_IMPORT", offset);
 		case OP_PRINT:
 			return simpleInstruction("OP_PRINT", offset);
 		case OP_POP:
@@ -84,8 +152,195 @@ int disassembleInstruction(PChunk chunk, int offset){
 			return simpleInstruction("OP_NEGATE",offset);
 		case OP_NOT:
 			return simpleInstruction("OP_NOT",offset);
+		case OP_EQUAL_NUM:
+			return simpleInstruction("OP_EQUAL_NUM", offset);
+		case OP_GREATER_NUM:
+			return simpleInstruction("OP_GREATER_NUM", offset);
+		case OP_LESS_NUM:
+			return simpleInstruction("OP_LESS_NUM", offset);
+		case OP_ADD_NUM:
+			return simpleInstruction("OP_ADD_NUM", offset);
+		case OP_SUBTRACT_NUM:
+			return simpleInstruction("OP_SUBTRACT_NUM", offset);
+		case OP_MULTIPLY_NUM:
+			return simpleInstruction("OP_MULTIPLY_NUM", offset);
+		case OP_DIVIDE_NUM:
+			return simpleInstruction("OP_DIVIDE_NUM", offset);
+		case OP_NEGATE_NUM:
+			return simpleInstruction("OP_NEGATE_NUM",offset);
+		case OP_CALL:
+			return byteInstruction("OP_CALL", chunk, offset);
+		case OP_TAIL_CALL:
+			return byteInstruction("OP_TAIL_CALL", chunk, offset);
+		case OP_FIBER:
+			return byteInstruction("OP_FIBER", chunk, offset);
+		case OP_SPAWN:
+			return byteInstruction("OP_SPAWN", chunk, offset);
+		case OP_RESUME:
+			return simpleInstruction("OP_RESUME", offset);
+		case OP_YIELD:
+			return simpleInstruction("OP_YIELD", offset);
+		case OP_ARRAY:
+			return byteInstruction("OP_ARRAY", chunk, offset);
+		case OP_INDEX_GET:
+			return simpleInstruction("OP_INDEX_GET", offset);
+		case OP_INDEX_SET:
+			return simpleInstruction("OP_INDEX_SET", offset);
+		case OP_MAP:
+			return byteInstruction("OP_MAP", chunk, offset);
+		case OP_HAS:
+			return simpleInstruction("OP_HAS", offset);
+		case OP_DELETE:
+			return simpleInstruction("OP_DELETE", offset);
+		case OP_CLASS:
+			return nameInstruction("OP_CLASS", chunk, offset);
+		case OP_INHERIT:
+			return simpleInstruction("OP_INHERIT", offset);
+		case OP_METHOD:
+			return nameInstruction("OP_METHOD", chunk, offset);
+		case OP_GET_PROPERTY:
+			return propertyInstruction("OP_GET_PROPERTY", chunk, offset);
+		case OP_SET_PROPERTY:
+			return propertyInstruction("OP_SET_PROPERTY", chunk, offset);
+		case OP_INVOKE:
+			return propertyInstruction("OP_INVOKE", chunk, offset);
+		case OP_GET_SUPER:
+			return nameInstruction("OP_GET_SUPER", chunk, offset);
+		case OP_SUPER_INVOKE:
+			return nameInstruction("OP_SUPER_INVOKE", chunk, offset);
+		case OP_CLOSURE:
+			return nameInstruction("OP_CLOSURE", chunk, offset);
+		case OP_OUTER_GET:
+			return outerInstruction("OP_OUTER_GET", chunk, offset);
+		case OP_OUTER_SET:
+			return outerInstruction("OP_OUTER_SET", chunk, offset);
+		case OP_CALL_NESTED:
+			printf("%-16s %4d args %d hops up\n", "OP_CALL_NESTED", chunk->code[offset + 1], chunk->code[offset + 2]);
+			return offset + 3;
+		case OP_TAIL_CALL_NESTED:
+			printf("%-16s %4d args %d hops up\n", "OP_TAIL_CALL_NESTED", chunk->code[offset + 1], chunk->code[offset + 2]);
+			return offset + 3;
+		case OP_CLOSE_UPVALUES:
+			return shortInstruction("OP_CLOSE_UPVALUES", chunk, offset);
+		case OP_JUMP:
+			return jumpInstruction("OP_JUMP", 1, chunk, offset);
+		case OP_JUMP_IF_FALSE:
+			return jumpInstruction("OP_JUMP_IF_FALSE", 1, chunk, offset);
+		case OP_POP_JUMP_IF_FALSE:
+			return jumpInstruction("OP_POP_JUMP_IF_FALSE", 1, chunk, offset);
+		case OP_LOOP:
+			return loopInstruction("OP_LOOP", chunk, offset);
+		case OP_JUMP_IF_LESS:
+			return jumpInstruction("OP_JUMP_IF_LESS", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_LESS:
+			return jumpInstruction("OP_JUMP_IF_NOT_LESS", 1, chunk, offset);
+		case OP_JUMP_IF_GREATER:
+			return jumpInstruction("OP_JUMP_IF_GREATER", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_GREATER:
+			return jumpInstruction("OP_JUMP_IF_NOT_GREATER", 1, chunk, offset);
+		case OP_JUMP_IF_EQUAL:
+			return jumpInstruction("OP_JUMP_IF_EQUAL", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_EQUAL:
+			return jumpInstruction("OP_JUMP_IF_NOT_EQUAL", 1, chunk, offset);
+		case OP_JUMP_IF_LESS_NUM:
+			return jumpInstruction("OP_JUMP_IF_LESS_NUM", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_LESS_NUM:
+			return jumpInstruction("OP_JUMP_IF_NOT_LESS_NUM", 1, chunk, offset);
+		case OP_JUMP_IF_GREATER_NUM:
+			return jumpInstruction("OP_JUMP_IF_GREATER_NUM", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_GREATER_NUM:
+			return jumpInstruction("OP_JUMP_IF_NOT_GREATER_NUM", 1, chunk, offset);
+		case OP_JUMP_IF_EQUAL_NUM:
+			return jumpInstruction("OP_JUMP_IF_EQUAL_NUM", 1, chunk, offset);
+		case OP_JUMP_IF_NOT_EQUAL_NUM:
+			return jumpInstruction("OP_JUMP_IF_NOT_EQUAL_NUM", 1, chunk, offset);
 		default:
 			printf("Unknown opcode %d\n", opcode);
 			return offset + 1;
 	}
+}
+// by value, for reports that name opcodes without disassembling
+static const char* opcodeNames[] = {
+	[OP_RETURN] = "OP_RETURN",
+	[OP_CONSTANT] = "OP_CONSTANT",
+	[OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+	[OP_GLOBAL_SET] = "OP_GLOBAL_SET",
+	[OP_GLOBAL_SET_LONG] = "OP_GLOBAL_SET_LONG",
+	[OP_GLOBAL_GET] = "OP_GLOBAL_GET",
+	[OP_GLOBAL_GET_LONG] = "OP_GLOBAL_GET_LONG",
+	[OP_LOCAL_GET] = "OP_LOCAL_GET",
+	[OP_LOCAL_SET] = "OP_LOCAL_SET",
+	[OP_TRUE] = "OP_TRUE",
+	[OP_FALSE] = "OP_FALSE",
+	[OP_POP] = "OP_POP",
+	[OP_POPN] = "OP_POPN",
+	[OP_EQUAL] = "OP_EQUAL",
+	[OP_GREATER] = "OP_GREATER",
+	[OP_LESS] = "OP_LESS",
+	[OP_NIL] = "OP_NIL",
+	[OP_ADD] = "OP_ADD",
+	[OP_SUBTRACT] = "OP_SUBTRACT",
+	[OP_MULTIPLY] = "OP_MULTIPLY",
+	[OP_DIVIDE] = "OP_DIVIDE",
+	[OP_NEGATE] = "OP_NEGATE",
+	[OP_NOT] = "OP_NOT",
+	[OP_PRINT] = "OP_PRINT",
+	[OP_EQUAL_NUM] = "OP_EQUAL_NUM",
+	[OP_GREATER_NUM] = "OP_GREATER_NUM",
+	[OP_LESS_NUM] = "OP_LESS_NUM",
+	[OP_ADD_NUM] = "OP_ADD_NUM",
+	[OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+	[OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+	[OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+	[OP_NEGATE_NUM] = "OP_NEGATE_NUM",
+	[OP_JUMP] = "OP_JUMP",
+	[OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+	[OP_POP_JUMP_IF_FALSE] = "OP_POP_JUMP_IF_FALSE",
+	[OP_LOOP] = "OP_LOOP",
+	[OP_JUMP_IF_LESS] = "OP_JUMP_IF_LESS",
+	[OP_JUMP_IF_NOT_LESS] = "OP_JUMP_IF_NOT_LESS",
+	[OP_JUMP_IF_GREATER] = "OP_JUMP_IF_GREATER",
+	[OP_JUMP_IF_NOT_GREATER] = "OP_JUMP_IF_NOT_GREATER",
+	[OP_JUMP_IF_EQUAL] = "OP_JUMP_IF_EQUAL",
+	[OP_JUMP_IF_NOT_EQUAL] = "OP_JUMP_IF_NOT_EQUAL",
+	[OP_JUMP_IF_LESS_NUM] = "OP_JUMP_IF_LESS_NUM",
+	[OP_JUMP_IF_NOT_LESS_NUM] = "OP_JUMP_IF_NOT_LESS_NUM",
+	[OP_JUMP_IF_GREATER_NUM] = "OP_JUMP_IF_GREATER_NUM",
+	[OP_JUMP_IF_NOT_GREATER_NUM] = "OP_JUMP_IF_NOT_GREATER_NUM",
+	[OP_JUMP_IF_EQUAL_NUM] = "OP_JUMP_IF_EQUAL_NUM",
+	[OP_JUMP_IF_NOT_EQUAL_NUM] = "OP_JUMP_IF_NOT_EQUAL_NUM",
+	[OP_CALL] = "OP_CALL",
+	[OP_TAIL_CALL] = "OP_TAIL_CALL",
+	[OP_FIBER] = "OP_FIBER",
+	[OP_SPAWN] = "OP_SPAWN",
+	[OP_RESUME] = "OP_RESUME",
+	[OP_YIELD] = "OP_YIELD",
+	[OP_ARRAY] = "OP_ARRAY",
+	[OP_INDEX_GET] = "OP_INDEX_GET",
+	[OP_INDEX_SET] = "OP_INDEX_SET",
+	[OP_MAP] = "OP_MAP",
+	[OP_HAS] = "OP_HAS",
+	[OP_DELETE] = "OP_DELETE",
+	[OP_LOCAL_GET_LONG] = "OP_LOCAL_GET_LONG",
+	[OP_LOCAL_SET_LONG] = "OP_LOCAL_SET_LONG",
+	[OP_IMPORT] = "OP_IMPORT",
+	[OP_CLASS] = "OP_CLASS",
+	[OP_INHERIT] = "OP_INHERIT",
+	[OP_METHOD] = "OP_METHOD",
+	[OP_GET_PROPERTY] = "OP_GET_PROPERTY",
+	[OP_SET_PROPERTY] = "OP_SET_PROPERTY",
+	[OP_INVOKE] = "OP_INVOKE",
+	[OP_GET_SUPER] = "OP_GET_SUPER",
+	[OP_SUPER_INVOKE] = "OP_SUPER_INVOKE",
+	[OP_CLOSURE] = "OP_CLOSURE",
+	[OP_OUTER_GET] = "OP_OUTER_GET",
+	[OP_OUTER_SET] = "OP_OUTER_SET",
+	[OP_CALL_NESTED] = "OP_CALL_NESTED",
+	[OP_CLOSE_UPVALUES] = "OP_CLOSE_UPVALUES",
+	[OP_TAIL_CALL_NESTED] = "OP_TAIL_CALL_NESTED",
+};
+const char* opcodeName(uint8_t opcode){
+	if (opcode >= sizeof(opcodeNames) / sizeof(opcodeNames[0]) || opcodeNames[opcode] == NULL)
+		return NULL;
+	return opcodeNames[opcode];
 }
\ No newline at end of file
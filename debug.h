@@ -5,4 +5,6 @@
 
 void disassembleChunk(PChunk, const char*);
 int disassembleInstruction(PChunk, int);
+void printLoopCounters(PChunk);
+const char* opcodeName(uint8_t); // NULL for an unknown opcode
 #endif
\ No newline at end of file
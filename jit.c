@@ -0,0 +1,672 @@
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#include <stddef.h>
+#include "jit.h"
+#include "memory.h"
+#include "object.h"
+#include "array.h"
+#include "map.h"
+#include "class.h"
+#include "closure.h"
+#include "output.h"
+#include "counters.h"
+
+#ifdef JIT_SUPPORTED
+#include <sys/mman.h>
+
+// baseline template jit: every instruction becomes a fixed piece of x86-64.
+// the value stack stays in memory, the registers below only cache pointers
+// into it, so native code and the interpreter can hand over at any
+// instruction boundary.
+//   rbx  CallFrame*
+//   r12  stack top
+//   r13  frame->slots
+//   r14  &vm
+enum { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RSP = 4, RBP = 5, RSI = 6, RDI = 7,
+	R12 = 12, R13 = 13, R14 = 14 };
+enum { CC_P = 0xa, CC_E = 0x4, CC_NE = 0x5, CC_BE = 0x6, CC_A = 0x7, CC_NP = 0xb, CC_G = 0xf };
+
+#define VALUE_SIZE ((int)sizeof(Value))
+#define PAYLOAD ((int)offsetof(Value, as))
+#define TOP(n) (-(n) * VALUE_SIZE) // n-th value from the top, TOP(1) is the top
+#define FRAME_IP ((int)offsetof(CallFrame, ip))
+#define FRAME_SLOTS ((int)offsetof(CallFrame, slots))
+#define VM_STACK_TOP ((int)offsetof(VM, stackTop))
+#define VM_FUEL ((int)offsetof(VM, fuel))
+
+typedef struct {
+	uint8_t* code;
+	int count;
+	int capacity;
+} Asm;
+
+typedef struct {
+	int at; // rel32 to patch
+	int target; // bytecode offset
+} Fixup;
+
+static void byte(Asm* a, uint8_t b){
+	if (a->capacity < a->count + 1){
+		int oldCapacity = a->capacity;
+		a->capacity = GROW_CAPACITY(oldCapacity);
+		a->code = GROW_ARRAY(uint8_t, a->code, oldCapacity, a->capacity, MEM_JIT);
+	}
+	a->code[a->count++] = b;
+}
+static void bytes2(Asm* a, uint8_t b1, uint8_t b2){
+	byte(a, b1);
+	byte(a, b2);
+}
+static void u32(Asm* a, uint32_t v){
+	for (int i = 0; i < 4; i++)
+		byte(a, (v >> (8 * i)) & 0xff);
+}
+static void u64(Asm* a, uint64_t v){
+	for (int i = 0; i < 8; i++)
+		byte(a, (v >> (8 * i)) & 0xff);
+}
+static void patch32(Asm* a, int at, int32_t v){
+	for (int i = 0; i < 4; i++)
+		a->code[at + i] = ((uint32_t)v >> (8 * i)) & 0xff;
+}
+// [base + disp32] memory operand with an optional legacy prefix,
+// REX and a one or two byte opcode (0x0f escape)
+static void mem(Asm* a, uint8_t prefix, bool wide, uint8_t op1, int op2, int reg, int base, int32_t disp){
+	if (prefix)
+		byte(a, prefix);
+	uint8_t rex = 0x40 | (wide ? 8 : 0) | ((reg & 8) ? 4 : 0) | ((base & 8) ? 1 : 0);
+	if (rex != 0x40)
+		byte(a, rex);
+	byte(a, op1);
+	if (op2 >= 0)
+		byte(a, (uint8_t)op2);
+	byte(a, 0x80 | ((reg & 7) << 3) | (base & 7));
+	if ((base & 7) == RSP)
+		byte(a, 0x24); // sib, no index
+	u32(a, (uint32_t)disp);
+}
+static void movImm64(Asm* a, int reg, uint64_t v){
+	byte(a, 0x48 | ((reg & 8) ? 1 : 0));
+	byte(a, 0xb8 | (reg & 7));
+	u64(a, v);
+}
+static void adjustStack(Asm* a, int delta){
+	if (delta == 0)
+		return;
+	bytes2(a, 0x49, 0x81);
+	byte(a, delta > 0 ? 0xc4 : 0xec); // add / sub r12
+	u32(a, (uint32_t)(delta > 0 ? delta : -delta));
+}
+static void copyValue(Asm* a, int srcBase, int32_t src, int dstBase, int32_t dst){
+	mem(a, 0xf3, false, 0x0f, 0x6f, 0, srcBase, src); // movdqu xmm0, src
+	mem(a, 0xf3, false, 0x0f, 0x7f, 0, dstBase, dst); // movdqu dst, xmm0
+}
+static void pushValueAt(Asm* a, const Value* value){
+	movImm64(a, RAX, (uint64_t)(uintptr_t)value);
+	copyValue(a, RAX, 0, R12, 0);
+	adjustStack(a, VALUE_SIZE);
+}
+static void storeTag(Asm* a, int32_t disp, ValueType type){
+	mem(a, 0, false, 0xc7, -1, 0, R12, disp); // mov dword [r12 + disp], type
+	u32(a, type);
+}
+static void pushLiteral(Asm* a, ValueType type, uint64_t payload){
+	storeTag(a, 0, type);
+	mem(a, 0, true, 0xc7, -1, 0, R12, PAYLOAD); // mov qword, sign extended
+	u32(a, (uint32_t)payload);
+	adjustStack(a, VALUE_SIZE);
+}
+static int jcc(Asm* a, int cc){
+	bytes2(a, 0x0f, 0x80 | cc);
+	u32(a, 0);
+	return a->count - 4;
+}
+static int jmp(Asm* a){
+	byte(a, 0xe9);
+	u32(a, 0);
+	return a->count - 4;
+}
+static void jumpBack(Asm* a, int cc, int label){
+	// cc < 0 is an unconditional jump
+	int at = cc < 0 ? jmp(a) : jcc(a, cc);
+	patch32(a, at, label - (at + 4));
+}
+static void patchHere(Asm* a, int at){
+	patch32(a, at, a->count - (at + 4));
+}
+static int checkTag(Asm* a, int32_t disp, ValueType type){
+	// jumps away when the value is not of the given type
+	mem(a, 0, false, 0x81, -1, 7, R12, disp); // cmp dword
+	u32(a, type);
+	return jcc(a, CC_NE);
+}
+
+typedef struct {
+	Asm a;
+	PChunk chunk;
+	int exitSync; // store the stack top, then return eax
+	int exitNoSync;
+	int errorExit;
+	Fixup* fixups;
+	int fixupCount;
+	int fixupCapacity;
+} JitCompiler;
+
+static void addFixup(JitCompiler* jc, int at, int target){
+	if (jc->fixupCapacity < jc->fixupCount + 1){
+		int oldCapacity = jc->fixupCapacity;
+		jc->fixupCapacity = GROW_CAPACITY(oldCapacity);
+		jc->fixups = GROW_ARRAY(Fixup, jc->fixups, oldCapacity, jc->fixupCapacity, MEM_JIT);
+	}
+	jc->fixups[jc->fixupCount].at = at;
+	jc->fixups[jc->fixupCount].target = target;
+	jc->fixupCount++;
+}
+static void branch(JitCompiler* jc, int cc, int target){
+	int at = cc < 0 ? jmp(&jc->a) : jcc(&jc->a, cc);
+	addFixup(jc, at, target);
+}
+static void setIp(JitCompiler* jc, int offset){
+	movImm64(&jc->a, RAX, (uint64_t)(uintptr_t)(jc->chunk->code + offset));
+	mem(&jc->a, 0, true, 0x89, -1, RAX, RBX, FRAME_IP);
+}
+static void callHelperWith(JitCompiler* jc, void* helper, int next, const void* arg){
+	// helpers see the same state the interpreter would: stack top in vm,
+	// ip past the instruction for error lines. false means an error.
+	Asm* a = &jc->a;
+	mem(a, 0, true, 0x89, -1, R12, R14, VM_STACK_TOP);
+	setIp(jc, next);
+	movImm64(a, RDI, (uint64_t)(uintptr_t)arg);
+	movImm64(a, RAX, (uint64_t)(uintptr_t)helper);
+	bytes2(a, 0xff, 0xd0); // call rax
+	bytes2(a, 0x84, 0xc0); // test al, al
+	jumpBack(a, CC_E, jc->errorExit);
+	mem(a, 0, true, 0x8b, -1, R12, R14, VM_STACK_TOP);
+}
+static void callHelper(JitCompiler* jc, void* helper, int next){
+	callHelperWith(jc, helper, next, NULL);
+}
+static void exitTo(JitCompiler* jc, int offset){
+	Asm* a = &jc->a;
+	setIp(jc, offset);
+	byte(a, 0xb8); // mov eax, JIT_EXIT
+	u32(a, JIT_EXIT);
+	jumpBack(a, -1, jc->exitSync);
+}
+
+static bool jitNumbersError(){
+	runtimeError("Operands must be numbers.");
+	return false;
+}
+static bool jitNegateError(){
+	runtimeError("Operand must be a number");
+	return false;
+}
+static bool jitAdd(){
+	if (IS_STRING(vm.stackTop[-1]) && IS_STRING(vm.stackTop[-2])){
+		Value b = pop();
+		Value a = pop();
+		push(concat(a, b));
+		return checkMemoryLimit();
+	}
+	return jitNumbersError();
+}
+static bool jitEqual(){
+	Value b = pop();
+	Value a = pop();
+	push(BOOL_VAL(valuesEqual(&a,&b)));
+	return true;
+}
+static bool jitNot(){
+	push(BOOL_VAL(!ToBoolean(pop())));
+	return true;
+}
+static bool jitPrint(){
+	printLine(pop());
+	return true;
+}
+static bool jitGlobalGet(Value* idValue){
+	Value value;
+	if (!tableGet(&vm.globals,idValue,&value)){
+		runtimeError("Undefined variable '%.*s'.",stringLength(idValue),stringChars(idValue));
+		return false;
+	}
+	push(value);
+	return true;
+}
+static bool jitGlobalSet(Value* idValue){
+	Value value = vm.stackTop[-1];
+	tableSet(&vm.globals,idValue,&value);
+	return checkMemoryLimit();
+}
+static bool jitTruthy(Value* value){
+	return ToBoolean(*value);
+}
+static bool jitValuesEqual(Value* a, Value* b){
+	return valuesEqual(a, b);
+}
+
+static void numberArith(JitCompiler* jc, int sseOp, bool checked, int next, void* slow){
+	Asm* a = &jc->a;
+	int notNumber1 = -1, notNumber2 = -1;
+	if (checked){
+		notNumber1 = checkTag(a, TOP(1), NUMBER);
+		notNumber2 = checkTag(a, TOP(2), NUMBER);
+	}
+	mem(a, 0xf2, false, 0x0f, 0x10, 0, R12, TOP(2) + PAYLOAD); // movsd xmm0, a
+	mem(a, 0xf2, false, 0x0f, sseOp, 0, R12, TOP(1) + PAYLOAD); // op xmm0, b
+	mem(a, 0xf2, false, 0x0f, 0x11, 0, R12, TOP(2) + PAYLOAD);
+	adjustStack(a, -VALUE_SIZE);
+	if (!checked)
+		return;
+	int done = jmp(a);
+	patchHere(a, notNumber1);
+	patchHere(a, notNumber2);
+	callHelper(jc, slow, next);
+	patchHere(a, done);
+}
+static void loadCompare(Asm* a, bool swap, int32_t first, int32_t second){
+	// leaves the flags of ucomisd for first ? second, swapped for less than
+	int32_t left = swap ? second : first;
+	int32_t right = swap ? first : second;
+	mem(a, 0xf2, false, 0x0f, 0x10, 0, R12, left + PAYLOAD);
+	mem(a, 0x66, false, 0x0f, 0x2e, 0, R12, right + PAYLOAD);
+}
+static void numberCompare(JitCompiler* jc, OpCode op, bool checked, int next){
+	Asm* a = &jc->a;
+	int notNumber1 = -1, notNumber2 = -1;
+	if (checked){
+		notNumber1 = checkTag(a, TOP(1), NUMBER);
+		notNumber2 = checkTag(a, TOP(2), NUMBER);
+	}
+	loadCompare(a, op == OP_LESS || op == OP_LESS_NUM, TOP(2), TOP(1));
+	if (op == OP_EQUAL_NUM){
+		byte(a, 0x0f); bytes2(a, 0x90 | CC_E, 0xc0); // sete al
+		byte(a, 0x0f); bytes2(a, 0x90 | CC_NP, 0xc1); // setnp cl
+		bytes2(a, 0x20, 0xc8); // and al, cl
+	} else {
+		byte(a, 0x0f); bytes2(a, 0x90 | CC_A, 0xc0); // seta al
+	}
+	byte(a, 0x0f); bytes2(a, 0xb6, 0xc0); // movzx eax, al
+	storeTag(a, TOP(2), BOOL);
+	mem(a, 0, true, 0x89, -1, RAX, R12, TOP(2) + PAYLOAD);
+	adjustStack(a, -VALUE_SIZE);
+	if (!checked)
+		return;
+	int done = jmp(a);
+	patchHere(a, notNumber1);
+	patchHere(a, notNumber2);
+	callHelper(jc, jitNumbersError, next);
+	patchHere(a, done);
+}
+static void compareJump(JitCompiler* jc, OpCode op, bool checked, int next, int target){
+	Asm* a = &jc->a;
+	if (checked){
+		int notNumber1 = checkTag(a, TOP(1), NUMBER);
+		int notNumber2 = checkTag(a, TOP(2), NUMBER);
+		int ok = jmp(a);
+		patchHere(a, notNumber1);
+		patchHere(a, notNumber2);
+		callHelper(jc, jitNumbersError, next);
+		patchHere(a, ok);
+	}
+	adjustStack(a, -2 * VALUE_SIZE);
+	// the popped operands are still in memory: a at TOP(-0)... b above it
+	int32_t left = 0, right = VALUE_SIZE;
+	switch (op){
+		case OP_JUMP_IF_LESS: case OP_JUMP_IF_LESS_NUM:
+			loadCompare(a, true, left, right); branch(jc, CC_A, target); break;
+		case OP_JUMP_IF_NOT_LESS: case OP_JUMP_IF_NOT_LESS_NUM:
+			loadCompare(a, true, left, right); branch(jc, CC_BE, target); break;
+		case OP_JUMP_IF_GREATER: case OP_JUMP_IF_GREATER_NUM:
+			loadCompare(a, false, left, right); branch(jc, CC_A, target); break;
+		case OP_JUMP_IF_NOT_GREATER: case OP_JUMP_IF_NOT_GREATER_NUM:
+			loadCompare(a, false, left, right); branch(jc, CC_BE, target); break;
+		case OP_JUMP_IF_EQUAL_NUM: {
+			loadCompare(a, false, left, right);
+			int unordered = jcc(a, CC_P);
+			branch(jc, CC_E, target);
+			patchHere(a, unordered);
+			break;
+		}
+		case OP_JUMP_IF_NOT_EQUAL_NUM:
+			loadCompare(a, false, left, right);
+			branch(jc, CC_P, target);
+			branch(jc, CC_NE, target);
+			break;
+		default:
+			break;
+	}
+}
+static void equalJump(JitCompiler* jc, bool taken, int target){
+	Asm* a = &jc->a;
+	adjustStack(a, -2 * VALUE_SIZE);
+	mem(a, 0, true, 0x8d, -1, RDI, R12, 0); // lea rdi, a
+	mem(a, 0, true, 0x8d, -1, RSI, R12, VALUE_SIZE);
+	movImm64(a, RAX, (uint64_t)(uintptr_t)jitValuesEqual);
+	bytes2(a, 0xff, 0xd0);
+	bytes2(a, 0x84, 0xc0);
+	branch(jc, taken ? CC_NE : CC_E, target);
+}
+static void falseJump(JitCompiler* jc, bool popped, int target){
+	// BOOL is tested inline, everything else asks ToBoolean
+	Asm* a = &jc->a;
+	int32_t at = TOP(1);
+	if (popped){
+		adjustStack(a, -VALUE_SIZE);
+		at = 0;
+	}
+	int notBool = checkTag(a, at, BOOL);
+	mem(a, 0, false, 0x80, -1, 7, R12, at + PAYLOAD); // cmp byte, 0
+	byte(a, 0);
+	branch(jc, CC_E, target);
+	int done = jmp(a);
+	patchHere(a, notBool);
+	mem(a, 0, true, 0x8d, -1, RDI, R12, at);
+	movImm64(a, RAX, (uint64_t)(uintptr_t)jitTruthy);
+	bytes2(a, 0xff, 0xd0);
+	bytes2(a, 0x84, 0xc0);
+	branch(jc, CC_E, target);
+	patchHere(a, done);
+}
+
+static void prologue(JitCompiler* jc){
+	Asm* a = &jc->a;
+	byte(a, 0x55); // push rbp
+	byte(a, 0x48); bytes2(a, 0x89, 0xe5); // mov rbp, rsp
+	byte(a, 0x53); // push rbx
+	bytes2(a, 0x41, 0x54); // push r12
+	bytes2(a, 0x41, 0x55); // push r13
+	bytes2(a, 0x41, 0x56); // push r14
+	byte(a, 0x48); bytes2(a, 0x89, 0xfb); // mov rbx, rdi
+	movImm64(a, R14, (uint64_t)(uintptr_t)&vm);
+	mem(a, 0, true, 0x8b, -1, R12, R14, VM_STACK_TOP);
+	mem(a, 0, true, 0x8b, -1, R13, RBX, FRAME_SLOTS);
+	bytes2(a, 0xff, 0xe6); // jmp rsi
+	jc->exitSync = a->count;
+	mem(a, 0, true, 0x89, -1, R12, R14, VM_STACK_TOP);
+	jc->exitNoSync = a->count;
+	bytes2(a, 0x41, 0x5e); // pop r14
+	bytes2(a, 0x41, 0x5d);
+	bytes2(a, 0x41, 0x5c);
+	byte(a, 0x5b);
+	byte(a, 0x5d);
+	byte(a, 0xc3);
+	jc->errorExit = a->count;
+	byte(a, 0xb8);
+	u32(a, JIT_ERROR);
+	jumpBack(a, -1, jc->exitNoSync); // runtimeError already reset the stack
+}
+
+static int instruction(JitCompiler* jc, int offset){
+	// emits one instruction, returns the offset of the next one
+	Asm* a = &jc->a;
+	PChunk chunk = jc->chunk;
+	uint8_t* code = chunk->code;
+	#define SHORT_AT(i) (code[i] | (code[(i) + 1] << 8))
+	switch (code[offset]){
+		case OP_CONSTANT:
+			pushValueAt(a, &chunk->constants.values[code[offset + 1]]);
+			return offset + 2;
+		case OP_CONSTANT_LONG: {
+			int idx = code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16);
+			pushValueAt(a, &chunk->constants.values[idx]);
+			return offset + 4;
+		}
+		case OP_GLOBAL_GET:
+		case OP_GLOBAL_SET: {
+			Value* name = &chunk->constants.values[code[offset + 1]];
+			callHelperWith(jc, code[offset] == OP_GLOBAL_GET ? (void*)jitGlobalGet : (void*)jitGlobalSet,
+				offset + 2, name);
+			return offset + 2;
+		}
+		case OP_GLOBAL_GET_LONG:
+		case OP_GLOBAL_SET_LONG: {
+			int idx = code[offset + 1] | (code[offset + 2] << 8) | (code[offset + 3] << 16);
+			Value* name = &chunk->constants.values[idx];
+			callHelperWith(jc, code[offset] == OP_GLOBAL_GET_LONG ? (void*)jitGlobalGet : (void*)jitGlobalSet,
+				offset + 4, name);
+			return offset + 4;
+		}
+		case OP_LOCAL_GET:
+			copyValue(a, R13, code[offset + 1] * VALUE_SIZE, R12, 0);
+			adjustStack(a, VALUE_SIZE);
+			return offset + 2;
+		case OP_LOCAL_SET:
+			copyValue(a, R12, TOP(1), R13, code[offset + 1] * VALUE_SIZE);
+			return offset + 2;
+		case OP_LOCAL_GET_LONG:
+			copyValue(a, R13, SHORT_AT(offset + 1) * VALUE_SIZE, R12, 0);
+			adjustStack(a, VALUE_SIZE);
+			return offset + 3;
+		case OP_LOCAL_SET_LONG:
+			copyValue(a, R12, TOP(1), R13, SHORT_AT(offset + 1) * VALUE_SIZE);
+			return offset + 3;
+		case OP_NIL: pushLiteral(a, NIL, 0); return offset + 1;
+		case OP_TRUE: pushLiteral(a, BOOL, 1); return offset + 1;
+		case OP_FALSE: pushLiteral(a, BOOL, 0); return offset + 1;
+		case OP_POP: adjustStack(a, -VALUE_SIZE); return offset + 1;
+		case OP_POPN: adjustStack(a, -code[offset + 1] * VALUE_SIZE); return offset + 2;
+		case OP_EQUAL: callHelper(jc, jitEqual, offset + 1); return offset + 1;
+		case OP_NOT: callHelper(jc, jitNot, offset + 1); return offset + 1;
+		case OP_PRINT: callHelper(jc, jitPrint, offset + 1); return offset + 1;
+		case OP_GREATER:
+		case OP_LESS:
+			numberCompare(jc, code[offset], true, offset + 1);
+			return offset + 1;
+		case OP_GREATER_NUM:
+		case OP_LESS_NUM:
+		case OP_EQUAL_NUM:
+			numberCompare(jc, code[offset], false, offset + 1);
+			return offset + 1;
+		case OP_ADD: numberArith(jc, 0x58, true, offset + 1, jitAdd); return offset + 1;
+		case OP_SUBTRACT: numberArith(jc, 0x5c, true, offset + 1, jitNumbersError); return offset + 1;
+		case OP_MULTIPLY: numberArith(jc, 0x59, true, offset + 1, jitNumbersError); return offset + 1;
+		case OP_DIVIDE: numberArith(jc, 0x5e, true, offset + 1, jitNumbersError); return offset + 1;
+		case OP_ADD_NUM: numberArith(jc, 0x58, false, offset + 1, NULL); return offset + 1;
+		case OP_SUBTRACT_NUM: numberArith(jc, 0x5c, false, offset + 1, NULL); return offset + 1;
+		case OP_MULTIPLY_NUM: numberArith(jc, 0x59, false, offset + 1, NULL); return offset + 1;
+		case OP_DIVIDE_NUM: numberArith(jc, 0x5e, false, offset + 1, NULL); return offset + 1;
+		case OP_NEGATE:
+		case OP_NEGATE_NUM: {
+			int notNumber = -1;
+			if (code[offset] == OP_NEGATE)
+				notNumber = checkTag(a, TOP(1), NUMBER);
+			mem(a, 0, true, 0x0f, 0xba, 7, R12, TOP(1) + PAYLOAD); // btc qword, 63
+			byte(a, 63);
+			if (notNumber != -1){
+				int done = jmp(a);
+				patchHere(a, notNumber);
+				callHelper(jc, jitNegateError, offset + 1);
+				patchHere(a, done);
+			}
+			return offset + 1;
+		}
+		case OP_JUMP:
+			branch(jc, -1, offset + 3 + SHORT_AT(offset + 1));
+			return offset + 3;
+		case OP_JUMP_IF_FALSE:
+			falseJump(jc, false, offset + 3 + SHORT_AT(offset + 1));
+			return offset + 3;
+		case OP_POP_JUMP_IF_FALSE:
+			falseJump(jc, true, offset + 3 + SHORT_AT(offset + 1));
+			return offset + 3;
+		case OP_LOOP: {
+			LoopCounter* counter = &chunk->loops[SHORT_AT(offset + 3)];
+			int target = offset + 5 - SHORT_AT(offset + 1);
+			movImm64(a, RAX, (uint64_t)(uintptr_t)&counter->hits);
+			byte(a, 0x48); bytes2(a, 0xff, 0x00); // inc qword [rax]
+			// same budget charge as the interpreter, refuel only when it runs out
+			mem(a, 0, true, 0x81, -1, 5, R14, VM_FUEL); // sub qword [vm.fuel], cost
+			u32(a, (uint32_t)counter->cost);
+			branch(jc, CC_G, target);
+			movImm64(a, RAX, (uint64_t)(uintptr_t)refuel);
+			bytes2(a, 0xff, 0xd0);
+			bytes2(a, 0x84, 0xc0);
+			branch(jc, CC_NE, target);
+			setIp(jc, target);
+			byte(a, 0xb8); // mov eax, JIT_YIELD
+			u32(a, JIT_YIELD);
+			jumpBack(a, -1, jc->exitSync);
+			return offset + 5;
+		}
+		case OP_JUMP_IF_LESS: case OP_JUMP_IF_NOT_LESS:
+		case OP_JUMP_IF_GREATER: case OP_JUMP_IF_NOT_GREATER:
+			compareJump(jc, code[offset] + (OP_JUMP_IF_LESS_NUM - OP_JUMP_IF_LESS), true,
+				offset + 3, offset + 3 + SHORT_AT(offset + 1));
+			return offset + 3;
+		case OP_JUMP_IF_LESS_NUM: case OP_JUMP_IF_NOT_LESS_NUM:
+		case OP_JUMP_IF_GREATER_NUM: case OP_JUMP_IF_NOT_GREATER_NUM:
+		case OP_JUMP_IF_EQUAL_NUM: case OP_JUMP_IF_NOT_EQUAL_NUM:
+			compareJump(jc, code[offset], false, offset + 3, offset + 3 + SHORT_AT(offset + 1));
+			return offset + 3;
+		case OP_JUMP_IF_EQUAL:
+		case OP_JUMP_IF_NOT_EQUAL:
+			equalJump(jc, code[offset] == OP_JUMP_IF_EQUAL, offset + 3 + SHORT_AT(offset + 1));
+			return offset + 3;
+		case OP_CALL:
+		case OP_TAIL_CALL:
+		case OP_FIBER:
+		case OP_SPAWN:
+			exitTo(jc, offset);
+			return offset + 2;
+		case OP_RETURN:
+		case OP_RESUME:
+		case OP_YIELD:
+		case OP_IMPORT:
+			exitTo(jc, offset);
+			return offset + 1;
+		case OP_ARRAY:
+		case OP_MAP:
+			exitTo(jc, offset);
+			return offset + 2;
+		case OP_INDEX_GET: callHelper(jc, indexGet, offset + 1); return offset + 1;
+		case OP_INDEX_SET: callHelper(jc, indexSet, offset + 1); return offset + 1;
+		case OP_HAS: callHelper(jc, mapHas, offset + 1); return offset + 1;
+		case OP_DELETE: callHelper(jc, mapDelete, offset + 1); return offset + 1;
+		// the helpers probe the site's inline cache, a call still goes
+		// back to the interpreter
+		case OP_GET_PROPERTY: callHelperWith(jc, getProperty, offset + 5, code + offset + 1); return offset + 5;
+		case OP_SET_PROPERTY: callHelperWith(jc, setProperty, offset + 5, code + offset + 1); return offset + 5;
+		case OP_GET_SUPER: callHelperWith(jc, getSuper, offset + 3, code + offset + 1); return offset + 3;
+		// captured variables go through the static links or the running
+		// closure, a nested call goes back to the interpreter
+		case OP_CLOSURE: callHelperWith(jc, makeClosure, offset + 3, code + offset + 1); return offset + 3;
+		case OP_OUTER_GET: callHelperWith(jc, outerGet, offset + 4, code + offset + 1); return offset + 4;
+		case OP_OUTER_SET: callHelperWith(jc, outerSet, offset + 4, code + offset + 1); return offset + 4;
+		case OP_CLOSE_UPVALUES: callHelperWith(jc, closeScope, offset + 3, code + offset + 1); return offset + 3;
+		case OP_CALL_NESTED:
+		case OP_TAIL_CALL_NESTED:
+		case OP_INVOKE:
+		case OP_SUPER_INVOKE:
+		case OP_CLASS:
+		case OP_INHERIT:
+		case OP_METHOD:
+			exitTo(jc, offset);
+			return offset + instructionLength(code[offset]);
+		default:
+			// unknown to the jit, stop compiling here and let the
+			// interpreter run the rest
+			exitTo(jc, offset);
+			return -1;
+	}
+	#undef SHORT_AT
+}
+
+static bool compileChunk(PChunk chunk){
+	JitCompiler jc;
+	jc.a.code = NULL;
+	jc.a.count = 0;
+	jc.a.capacity = 0;
+	jc.chunk = chunk;
+	jc.fixups = NULL;
+	jc.fixupCount = 0;
+	jc.fixupCapacity = 0;
+	int* entries = ALLOCATE(int, chunk->count + 1, MEM_JIT);
+	for (int i = 0; i <= chunk->count; i++)
+		entries[i] = -1;
+	prologue(&jc);
+	int offset = 0;
+	while (offset >= 0 && offset < chunk->count){
+		entries[offset] = jc.a.count;
+		offset = instruction(&jc, offset);
+	}
+	bool ok = true;
+	for (int i = 0; i < jc.fixupCount; i++){
+		Fixup* fixup = &jc.fixups[i];
+		if (fixup->target < 0 || fixup->target >= chunk->count || entries[fixup->target] < 0){
+			ok = false; // jumps past what we compiled
+			break;
+		}
+		patch32(&jc.a, fixup->at, entries[fixup->target] - (fixup->at + 4));
+	}
+	uint8_t* code = MAP_FAILED;
+	size_t size = jc.a.count;
+	if (ok)
+		code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (code != MAP_FAILED){
+		memcpy(code, jc.a.code, size);
+		if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0){
+			munmap(code, size);
+			code = MAP_FAILED;
+		}
+	}
+	FREE_ARRAY(uint8_t, jc.a.code, jc.a.capacity, MEM_JIT);
+	FREE_ARRAY(Fixup, jc.fixups, jc.fixupCapacity, MEM_JIT);
+	if (code == MAP_FAILED){
+		FREE_ARRAY(int, entries, chunk->count + 1, MEM_JIT);
+		return false;
+	}
+	countMemory(MEM_JIT, 0, size); // the mapping bypasses reallocate
+	JitCode* jit = ALLOCATE(JitCode, 1, MEM_JIT);
+	jit->code = code;
+	jit->size = size;
+	jit->entries = entries;
+	chunk->jit = jit;
+	chunk->jitFailed = false;
+	return true;
+}
+bool jitCompile(PChunk chunk){
+	if (chunk->jit != NULL || chunk->jitFailed)
+		return chunk->jit != NULL;
+	chunk->jitFailed = true; // until proven otherwise
+	uint64_t start = monotonicNanos();
+	Phase outer = enterPhase(PHASE_JIT);
+	bool ok = compileChunk(chunk);
+	enterPhase(outer);
+	phases.nanos[PHASE_JIT] += monotonicNanos() - start;
+	return ok;
+}
+JitStatus jitEnter(CallFrame* frame){
+	PChunk chunk = &frame->function->chunk;
+	int offset = (int)(frame->ip - chunk->code);
+	int entry = chunk->jit->entries[offset];
+	if (entry < 0)
+		return JIT_EXIT;
+	int (*native)(CallFrame*, uint8_t*) = (int (*)(CallFrame*, uint8_t*))chunk->jit->code;
+	return (JitStatus)native(frame, chunk->jit->code + entry);
+}
+void jitRelease(JitCode* jit){
+	munmap(jit->code, jit->size);
+	free(jit->entries);
+	free(jit);
+}
+void jitFree(PChunk chunk){
+	if (chunk->jit == NULL)
+		return;
+	countMemory(MEM_JIT, chunk->jit->size + sizeof(int) * (chunk->count + 1) + sizeof(JitCode), 0);
+	jitRelease(chunk->jit);
+	chunk->jit = NULL;
+}
+#else
+bool jitCompile(PChunk chunk){
+	chunk->jitFailed = true;
+	return false;
+}
+JitStatus jitEnter(CallFrame* frame){
+	return JIT_EXIT;
+}
+void jitRelease(JitCode* jit){
+}
+void jitFree(PChunk chunk){
+}
+#endif
@@ -0,0 +1,30 @@
+#ifndef clox_jit_h
+#define clox_jit_h
+#include "common.h"
+#include "chunk.h"
+#include "vm.h"
+
+#if defined(ENABLE_JIT) && defined(__x86_64__) && !defined(DEBUG_TRACE_EXECUTION)
+#define JIT_SUPPORTED
+#endif
+#ifndef JIT_THRESHOLD
+#define JIT_THRESHOLD 1000 // calls or back edges before a chunk is compiled
+#endif
+
+typedef enum {
+	JIT_EXIT, // reached something only the interpreter runs, resume at frame->ip
+	JIT_ERROR, // a runtime error was reported
+	JIT_YIELD // out of budget at a back edge, frame->ip is the loop header
+} JitStatus;
+
+typedef struct _JitCode {
+	uint8_t* code; // executable mapping
+	size_t size;
+	int* entries; // native offset of every instruction, -1 inside operands
+} JitCode;
+
+bool jitCompile(PChunk);
+JitStatus jitEnter(CallFrame*);
+void jitFree(PChunk);
+void jitRelease(JitCode*); // uncounted, for a heap already taken off its vm
+#endif
@@ -8,16 +8,34 @@ void initLineInfo(PLineInfo arr){
 	arr->lines = NULL;
 }
 void writeLineInfo(PLineInfo array, int line, int offset) {
-  while (array->capacity < line) {
+  // runs at or past offset were left behind by a compiler rewind
+  while (array->count > 0 && array->lines[array->count - 1].offset >= offset)
+    array->count--;
+  if (array->count > 0 && array->lines[array->count - 1].line == line)
+    return;
+  if (array->capacity < array->count + 1) {
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
-    array->lines = GROW_ARRAY(int, array->lines,
-		oldCapacity, array->capacity);
+    array->lines = GROW_ARRAY(LineStart, array->lines,
+		oldCapacity, array->capacity, MEM_CHUNK);
   }
-  array->lines[line] = offset;
+  array->lines[array->count].offset = offset;
+  array->lines[array->count].line = line;
   array->count++;
 }
+int findLine(PLineInfo array, int offset) {
+  // last run starting at or before offset
+  int low = 0, high = array->count - 1;
+  while (low < high) {
+    int mid = (low + high + 1) / 2;
+    if (array->lines[mid].offset <= offset)
+      low = mid;
+    else
+      high = mid - 1;
+  }
+  return array->count == 0 ? 0 : array->lines[low].line;
+}
 void freeLineInfo(PLineInfo array) {
-  FREE_ARRAY(int, array->lines, array->capacity);
+  FREE_ARRAY(LineStart, array->lines, array->capacity, MEM_CHUNK);
   initLineInfo(array);
 }
\ No newline at end of file
@@ -1,14 +1,20 @@
 #ifndef clox_line_h
 #define clox_line_h
 
+typedef struct {
+	int offset; // first byte of a run of code from the same line
+	int line;
+} LineStart;
+
 typedef struct {
 	int capacity;
 	int count;
-	int* lines;
+	LineStart* lines; // by offset, lines are not monotonic (for loops)
 } LineInfo, *PLineInfo;
 
 void initLineInfo(PLineInfo);
 void writeLineInfo(PLineInfo, int, int);
+int findLine(PLineInfo, int);
 void freeLineInfo(PLineInfo);
 
 #endif
\ No newline at end of file
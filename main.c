@@ -6,18 +6,88 @@
 #include "memory.h"
 #include "debug.h"
 #include "vm.h"
+#include "compiler.h"
+#include "aot.h"
+#include "trace.h"
+#include "module.h"
+#include "output.h"
+#include "counters.h"
+static bool inputComplete(const char* source){
+	// more lines are needed while a bracket or a string is still open
+	int depth = 0;
+	initScanner(source);
+	for (;;){
+		Token token = scanToken();
+		switch (token.type){
+			case TOKEN_LEFT_PAREN: case TOKEN_LEFT_BRACE: case TOKEN_LEFT_BRACKET:
+				depth++;
+				break;
+			case TOKEN_RIGHT_PAREN: case TOKEN_RIGHT_BRACE: case TOKEN_RIGHT_BRACKET:
+				depth--;
+				break;
+			case TOKEN_ERROR:
+				if (strcmp(token.start, "Unterminated string.") == 0)
+					return false;
+				break;
+			case TOKEN_EOF:
+				return depth <= 0;
+			default:
+				break;
+		}
+	}
+}
+static double elapsed(uint64_t* since){
+	// milliseconds, since is moved up to now
+	uint64_t now = monotonicNanos();
+	double ms = (now - *since) / 1e6;
+	*since = now;
+	return ms;
+}
 static void repl(){
+	// one vm for the whole session, see prepareLine
+	initVM();
 	char line[1024];
+	char* input = NULL;
+	size_t length = 0, capacity = 0;
 	for (;;){
-		printf("> ");
-		if (!fgets(line, sizeof(line),stdin)){
+		printf(length == 0 ? "> " : "... ");
+		fflush(stdout);
+		bool more = fgets(line, sizeof(line), stdin) != NULL;
+		if (!more && length == 0){
 			printf("\n");
 			break;
 		}
-		if (strcmp(line,"exit\n") == 0)
+		if (more){
+			if (length == 0 && strcmp(line, "exit\n") == 0)
+				break;
+			size_t n = strlen(line);
+			if (length + n + 1 > capacity){
+				capacity = GROW_CAPACITY(length + n + 1);
+				input = realloc(input, capacity);
+				if (input == NULL){
+					fprintf(stderr, "Not enough memory for the input.\n");
+					exit(74);
+				}
+			}
+			memcpy(input + length, line, n + 1);
+			length += n;
+			// a line longer than the buffer comes in pieces
+			if (input[length - 1] != '\n' || !inputComplete(input))
+				continue;
+		}
+		uint64_t clock = monotonicNanos();
+		InterpretResult result = prepareLine(input);
+		double compileMs = elapsed(&clock);
+		if (result == INTERPRET_OK)
+			result = resume((Budget){ 0, 0 });
+		flushOutput(); // before the timing and the next prompt
+		double runMs = elapsed(&clock);
+		fprintf(stderr, "\t[compiled in %.3fms, ran in %.3fms]\n", compileMs, runMs);
+		length = 0;
+		if (!more)
 			break;
-		interpret(line);
 	}
+	free(input);
 }
 static char* readFile(const char* path){
 	FILE* file = fopen(path, "rb");
@@ -43,22 +113,163 @@ static char* readFile(const char* path){
 	return buffer;
 }
 static void runFile(const char* path){
+	uint64_t start = monotonicNanos();
 	char* source = readFile(path);
+	phases.nanos[PHASE_LOAD] += monotonicNanos() - start;
 	InterpretResult result = interpret(source);
-	free(source);
+	free(source); // string literals point into it until interpret returns
 	if (result == INTERPRET_COMPILE_ERROR) exit(65);
 	if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
-int main(int argc, char* argv[]){
+static void emitFile(const char* path, const char* outPath){
+	char* source = readFile(path);
 	initVM();
-	if (argc == 1){
+	PObjFunction script = compile(source);
+	if (script == NULL || !aotSupported(script)) exit(65);
+	FILE* out = fopen(outPath, "w");
+	if (out == NULL) {
+		fprintf(stderr, "Could not open file \"%s\".\n", outPath);
+		exit(74);
+	}
+	bool ok = aotEmit(script, out);
+	free(source); // the literals point into it
+	if (fclose(out) != 0 || !ok) {
+		fprintf(stderr, "Could not write file \"%s\".\n", outPath);
+		exit(74);
+	}
+}
+static void usage(){
+	fprintf(stderr, "Usage: clox [--no-jit] [--emit-c out.c] [--max-heap bytes[k|m|g]]\n"
+		"            [--memory-report out.json|-] [--stats=json[:out.json]]\n"
+		"            [--trace out.bin] [--module-path dir[:dir...]]\n"
+		"            [--flush line|size|exit] [--direct-write] [--sync-teardown]\n"
+		"            [--no-escape-analysis] [--counters[=opcodes]] [path]\n");
+	exit(64);
+}
+static size_t parseSize(const char* text){
+	char* end;
+	unsigned long long size = strtoull(text, &end, 10);
+	switch (*end){
+		case 'k': case 'K': size <<= 10; end++; break;
+		case 'm': case 'M': size <<= 20; end++; break;
+		case 'g': case 'G': size <<= 30; end++; break;
+	}
+	if (end == text || *end != '\0')
+		usage();
+	return (size_t)size;
+}
+static FlushPolicy parseFlush(const char* text){
+	if (strcmp(text, "line") == 0)
+		return FLUSH_LINE;
+	if (strcmp(text, "size") == 0)
+		return FLUSH_SIZE;
+	if (strcmp(text, "exit") == 0)
+		return FLUSH_EXIT;
+	usage();
+	return FLUSH_SIZE;
+}
+static const char* reportPath;
+static void memoryReport(){
+	// runs from atexit, so errors and exit codes get a report too
+	FILE* out = strcmp(reportPath, "-") == 0 ? stderr : fopen(reportPath, "w");
+	if (out == NULL){
+		fprintf(stderr, "Could not open file \"%s\".\n", reportPath);
+		return;
+	}
+	writeMemoryReport(out);
+	if (out != stderr)
+		fclose(out);
+}
+static const char* statsPath;
+static void statsReport(){
+	// atexit too, so a failed run still reports where its time went
+	FILE* out = strcmp(statsPath, "-") == 0 ? stderr : fopen(statsPath, "w");
+	if (out == NULL){
+		fprintf(stderr, "Could not open file \"%s\".\n", statsPath);
+		return;
+	}
+	writeStats(out);
+	if (out != stderr)
+		fclose(out);
+}
+int main(int argc, char* argv[]){
+	const char* path = NULL;
+	const char* emitPath = NULL;
+	const char* tracePath = NULL;
+	const char* flush = NULL;
+	bool direct = false;
+	const char* counters = NULL;
+	for (int i = 1; i < argc; i++){
+		if (strcmp(argv[i], "--no-jit") == 0)
+			vm.jitEnabled = false;
+		else if (strcmp(argv[i], "--emit-c") == 0 && i + 1 < argc)
+			emitPath = argv[++i];
+		else if (strcmp(argv[i], "--max-heap") == 0 && i + 1 < argc)
+			vm.memory.limit = parseSize(argv[++i]);
+		else if (strcmp(argv[i], "--memory-report") == 0 && i + 1 < argc)
+			reportPath = argv[++i];
+		else if (strcmp(argv[i], "--stats=json") == 0)
+			statsPath = "-";
+		else if (strncmp(argv[i], "--stats=json:", 13) == 0)
+			statsPath = argv[i] + 13;
+		else if (strcmp(argv[i], "--trace") == 0 && i + 1 < argc)
+			tracePath = argv[++i];
+		else if (strcmp(argv[i], "--module-path") == 0 && i + 1 < argc)
+			addModulePath(argv[++i]);
+		else if (strcmp(argv[i], "--flush") == 0 && i + 1 < argc)
+			flush = argv[++i];
+		else if (strcmp(argv[i], "--direct-write") == 0)
+			direct = true;
+		else if (strcmp(argv[i], "--sync-teardown") == 0)
+			setBackgroundTeardown(false);
+		else if (strcmp(argv[i], "--no-escape-analysis") == 0)
+			setEscapeAnalysis(false);
+		else if (strcmp(argv[i], "--counters") == 0 || strcmp(argv[i], "--counters=opcodes") == 0)
+			counters = argv[i];
+		else if (argv[i][0] == '-' || path != NULL)
+			usage();
+		else
+			path = argv[i];
+	}
+	const char* modulePath = getenv("LOXPATH"); // searched after --module-path
+	if (modulePath != NULL)
+		addModulePath(modulePath);
+	if (flush != NULL)
+		setFlushPolicy(parseFlush(flush));
+	if (direct)
+		setDirectOutput(true);
+	if (reportPath != NULL)
+		atexit(memoryReport);
+	if (counters != NULL && statsPath == NULL)
+		statsPath = "-"; // they are part of the stats
+	if (statsPath != NULL){
+		phases.enabled = true;
+		atexit(statsReport);
+	}
+	// registered last so it runs first: the reports see a settled process
+	// and no heap is still being released while exit runs
+	if (statsPath != NULL || reportPath != NULL)
+		atexit(finishTeardown);
+	if (counters != NULL && !startCounters(strcmp(counters, "--counters=opcodes") == 0))
+		fprintf(stderr, "No performance counters available, reporting timings only.\n");
+	if (tracePath != NULL){
+		if (!startTrace(tracePath)){
+			fprintf(stderr, "Could not open file \"%s\".\n", tracePath);
+			exit(74);
+		}
+		vm.jitEnabled = false; // native code does not go through the ring
+	}
+	if (emitPath != NULL){
+		if (path == NULL)
+			usage();
+		emitFile(path, emitPath);
+	} else if (path == NULL){
 		repl();
-	} else if (argc == 2){
-		runFile(argv[1]);
 	} else {
-		fprintf(stderr, "Usage: clox [path]\n");
-		exit(64);
+		runFile(path);
 	}
 	freeVM();
+	stopTrace();
+	stopCounters();
 	return 0;
 }
\ No newline at end of file
@@ -0,0 +1,100 @@
+#include "map.h"
+#include "vm.h"
+#include "memory.h"
+
+static bool checkKey(Value key){
+	// nil marks empty slots in a Table and NaN never equals itself
+	if (IS_NIL(key)){
+		runtimeError("Map keys can't be nil.");
+		return false;
+	}
+	if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)){
+		runtimeError("Map keys can't be NaN.");
+		return false;
+	}
+	return true;
+}
+static void put(PObjMap map, Value key, Value value){
+	if (tableSet(&map->table, &key, &value))
+		map->count++;
+}
+bool mapLiteral(int count){
+	Value* pairs = vm.stackTop - 2 * count;
+	for (int i = 0; i < count; i++)
+		if (!checkKey(pairs[2 * i]))
+			return false;
+	PObjMap map = newMap();
+	for (int i = 0; i < count; i++)
+		put(map, pairs[2 * i], pairs[2 * i + 1]);
+	vm.stackTop = pairs;
+	push(OBJ_VAL(map));
+	return true;
+}
+bool mapGet(){
+	// [map, key] -> [value], nil for a missing key
+	PObjMap map = AS_MAP(vm.stackTop[-2]);
+	Value value = NIL_VAL();
+	tableGet(&map->table, &vm.stackTop[-1], &value);
+	vm.stackTop--;
+	vm.stackTop[-1] = value;
+	return true;
+}
+bool mapSet(){
+	// [map, key, value] -> [value]
+	PObjMap map = AS_MAP(vm.stackTop[-3]);
+	Value key = vm.stackTop[-2];
+	Value value = vm.stackTop[-1];
+	if (!checkKey(key))
+		return false;
+	put(map, key, value);
+	vm.stackTop -= 2;
+	vm.stackTop[-1] = value;
+	return checkMemoryLimit();
+}
+bool mapHas(){
+	// key in map: [key, map] -> [bool]
+	if (!IS_MAP(vm.stackTop[-1])){
+		runtimeError("Right operand of 'in' must be a map.");
+		return false;
+	}
+	PObjMap map = AS_MAP(vm.stackTop[-1]);
+	bool found = tableFind(&map->table, &vm.stackTop[-2]) != NULL;
+	vm.stackTop--;
+	vm.stackTop[-1] = BOOL_VAL(found);
+	return true;
+}
+bool mapDelete(){
+	// delete map[key]: [map, key] -> [bool], whether the key was there
+	if (!IS_MAP(vm.stackTop[-2])){
+		runtimeError("Can only delete from maps.");
+		return false;
+	}
+	PObjMap map = AS_MAP(vm.stackTop[-2]);
+	bool found = tableDelete(&map->table, &vm.stackTop[-1]);
+	if (found)
+		map->count--;
+	vm.stackTop--;
+	vm.stackTop[-1] = BOOL_VAL(found);
+	return true;
+}
+bool nextNative(Value* args, Value* result){
+	// next(map, nil) is the first key, next(map, key) the one after it
+	// and nil ends the walk. keys come in slot order, a set that adds a
+	// key can rehash and restart it
+	if (!IS_MAP(args[0])){
+		runtimeError("next() expects a map.");
+		return false;
+	}
+	PTable table = &AS_MAP(args[0])->table;
+	PEntry entry = NULL;
+	if (!IS_NIL(args[1])){
+		entry = tableFind(table, &args[1]);
+		if (entry == NULL){
+			runtimeError("next() key is not in the map.");
+			return false;
+		}
+	}
+	entry = tableNext(table, entry);
+	*result = entry == NULL ? NIL_VAL() : entry->key;
+	return true;
+}
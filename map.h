@@ -0,0 +1,15 @@
+#ifndef clox_map_h
+#define clox_map_h
+#include "common.h"
+#include "value.h"
+
+// maps: a Table per object. like the array instructions these work on
+// vm.stackTop and return false after reporting a runtime error
+bool mapLiteral(int);
+bool mapGet();
+bool mapSet();
+bool mapHas();
+bool mapDelete();
+
+bool nextNative(Value*, Value*);
+#endif
@@ -1,31 +1,312 @@
+#define _POSIX_C_SOURCE 200809L // pthreads
+
+#include <pthread.h>
 #include <stdlib.h>
 #include "memory.h"
+#include "object.h"
+#include "vm.h"
+#include "jit.h"
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize){
+static void countChange(MemoryCounter* counter, size_t oldSize, size_t newSize){
+	counter->live += newSize - oldSize; // wraps back for frees
+	if (counter->live > counter->peak)
+		counter->peak = counter->live;
+}
+void countMemory(MemoryCategory category, size_t oldSize, size_t newSize){
+	countChange(&vm.memory.total, oldSize, newSize);
+	countChange(&vm.memory.categories[category], oldSize, newSize);
+}
+void* reallocate(void* pointer, size_t oldSize, size_t newSize, MemoryCategory category){
+	countMemory(category, oldSize, newSize);
+	if (pointer == NULL && newSize != 0)
+		vm.memory.blocksAllocated++;
 	if (newSize == 0){
 		free(pointer);
 		return NULL;
 	}
 	void* result = realloc(pointer, newSize);
-	if (result == NULL) 
+	if (result == NULL){
+		// nothing sensible to unwind to from here, the limit below is the
+		// way to stop a script before this happens
+		fprintf(stderr, "Out of memory.\n");
 		exit(1);
+	}
 	return result;
 }
-static void freeObj(PObj obj){
+bool checkMemoryLimit(){
+	// called by the interpreter after instructions that can allocate
+	if (vm.memory.limit == 0 || vm.memory.total.live <= vm.memory.limit)
+		return true;
+	runtimeError("Out of memory, heap limit of %zu bytes exceeded.", vm.memory.limit);
+	return false;
+}
+static void newSlab(SizeClass* sizeClass){
+	Slab* slab = (Slab*)reallocate(NULL, 0, SLAB_SIZE, MEM_OBJECTS);
+	slab->next = vm.slabs;
+	vm.slabs = slab;
+	// the header takes a whole step so blocks stay aligned
+	sizeClass->next = (uint8_t*)slab + SIZE_CLASS_STEP;
+	sizeClass->end = (uint8_t*)slab + SLAB_SIZE;
+}
+void* slabAllocate(size_t size, ObjType type){
+	countChange(&vm.memory.types[type], 0, size);
+	vm.memory.objects[type]++;
+	vm.memory.objectsAllocated++;
+	vm.memory.allocated[type]++;
+	if (size > SLAB_OBJECT_MAX)
+		return reallocate(NULL, 0, size, MEM_OBJECTS);
+	int index = (int)((size + SIZE_CLASS_STEP - 1) / SIZE_CLASS_STEP) - 1;
+	size_t blockSize = (size_t)(index + 1) * SIZE_CLASS_STEP;
+	SizeClass* sizeClass = &vm.sizeClasses[index];
+	if (sizeClass->free != NULL){
+		FreeBlock* block = sizeClass->free;
+		sizeClass->free = block->next;
+		return block;
+	}
+	if (sizeClass->next == NULL || sizeClass->next + blockSize > sizeClass->end)
+		newSlab(sizeClass);
+	void* block = sizeClass->next;
+	sizeClass->next += blockSize;
+	return block;
+}
+void slabFree(void* pointer, size_t size, ObjType type){
+	countChange(&vm.memory.types[type], size, 0);
+	vm.memory.objects[type]--;
+	if (size > SLAB_OBJECT_MAX){
+		reallocate(pointer, size, 0, MEM_OBJECTS);
+		return;
+	}
+	SizeClass* sizeClass = &vm.sizeClasses[(size + SIZE_CLASS_STEP - 1) / SIZE_CLASS_STEP - 1];
+	FreeBlock* block = (FreeBlock*)pointer;
+	block->next = sizeClass->free;
+	sizeClass->free = block;
+}
+void countObjects(ObjType type, size_t count, size_t bytes){
+	countChange(&vm.memory.types[type], 0, bytes);
+	vm.memory.objects[type] += count;
+	vm.memory.objectsAllocated += count;
+	vm.memory.allocated[type] += count;
+}
+size_t objectSize(PObj obj){
+	switch (obj->type){
+		case OBJ_STRING: {
+			PObjString string = (PObjString)obj;
+			return string->chars == INLINE_CHARS(string) ? sizeof(ObjString) + string->length + 1 : sizeof(ObjString);
+		}
+		case OBJ_FUNCTION: return sizeof(ObjFunction);
+		case OBJ_FIBER: return sizeof(ObjFiber);
+		case OBJ_NATIVE: return sizeof(ObjNative);
+		case OBJ_ARRAY: return sizeof(ObjArray);
+		case OBJ_MAP: return sizeof(ObjMap);
+		case OBJ_CLASS: return sizeof(ObjClass);
+		case OBJ_INSTANCE: return sizeof(ObjInstance);
+		case OBJ_SHAPE: return sizeof(ObjShape);
+		case OBJ_BOUND_METHOD: return sizeof(ObjBoundMethod);
+		case OBJ_CLOSURE:
+			return sizeof(ObjClosure) + sizeof(PObjUpvalue) * ((PObjClosure)obj)->upvalueCount;
+		case OBJ_UPVALUE: return sizeof(ObjUpvalue);
+	}
+	return 0;
+}
+typedef struct _Heap {
+	struct _Heap* next; // waiting for the sweeper
+	PObj objects;
+	Slab* slabs;
+	uint8_t* image;
+	size_t imageSize;
+} Heap; // taken off a vm at teardown, see freeObjects
+
+static bool inImage(Heap* heap, void* pointer){
+	uintptr_t at = (uintptr_t)pointer;
+	return at >= (uintptr_t)heap->image && at < (uintptr_t)heap->image + heap->imageSize;
+}
+static void releaseObj(PObj obj, Heap* heap){
+	// plain free(), the counters were settled when the heap was taken off
+	// the vm. an object restored from a snapshot goes with the image, only
+	// what was allocated after the clone is its own
+	bool imaged = inImage(heap, obj);
 	switch (obj->type){
 		case OBJ_STRING: {
-			PObjString str = (PObjString)obj;
-			FREE_CONST(sizeof(ObjString) + str->length + 1, obj);
+			// characters taken over from a released source
+			PObjString string = (PObjString)obj;
+			if (!imaged && !string->borrowed && string->chars != INLINE_CHARS(string))
+				free(string->chars);
+			break;
+		}
+		case OBJ_NATIVE:
+			break;
+		case OBJ_FUNCTION: {
+			PChunk chunk = &((PObjFunction)obj)->chunk;
+			if (chunk->jit != NULL)
+				jitRelease(chunk->jit);
+			if (imaged)
+				break;
+			if (!chunk->borrowed){
+				free(chunk->code);
+				free(chunk->lineInfo.lines);
+				free(((PObjFunction)obj)->captures);
+			}
+			free(chunk->loops);
+			free(chunk->caches);
+			free(chunk->constants.values);
+			break;
+		}
+		case OBJ_FIBER:
+			free(((PObjFiber)obj)->frames);
+			free(((PObjFiber)obj)->stack);
+			break;
+		case OBJ_ARRAY:
+			if (!imaged)
+				free(((PObjArray)obj)->values);
+			break;
+		case OBJ_MAP:
+			free(((PObjMap)obj)->table.entries);
+			break;
+		case OBJ_CLASS:
+			free(((PObjClass)obj)->methods.entries);
+			break;
+		case OBJ_SHAPE:
+			free(((PObjShape)obj)->transitions.entries);
+			break;
+		case OBJ_INSTANCE: {
+			// fields that outgrew the image were moved out of it
+			Value* fields = ((PObjInstance)obj)->fields;
+			if (!inImage(heap, fields))
+				free(fields);
 			break;
 		}
+		case OBJ_BOUND_METHOD:
+		case OBJ_CLOSURE:
+		case OBJ_UPVALUE:
+			break;
 	}
+	if (!imaged && objectSize(obj) > SLAB_OBJECT_MAX)
+		free(obj);
 }
-void freeObjects(){
-	PObj obj = vm.objects;
-	PObj next;
-	while (obj != NULL){
-		next = obj->next;
-		freeObj(obj);
+static void releaseHeap(Heap* heap){
+	for (PObj obj = heap->objects; obj != NULL;){
+		PObj next = obj->next;
+		releaseObj(obj, heap);
 		obj = next;
 	}
+	while (heap->slabs != NULL){
+		Slab* next = heap->slabs->next;
+		free(heap->slabs);
+		heap->slabs = next;
+	}
+	free(heap->image);
+}
+
+// one sweeper thread for the process, started by the first teardown
+static pthread_mutex_t sweepLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sweepWork = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t sweepDone = PTHREAD_COND_INITIALIZER;
+static Heap* sweepQueue = NULL;
+static bool sweeping = false; // a heap is being released right now
+static bool sweeperStarted = false;
+static bool backgroundTeardown = true;
+
+static void* sweeper(void* unused){
+	(void)unused;
+	pthread_mutex_lock(&sweepLock);
+	for (;;){
+		while (sweepQueue == NULL){
+			sweeping = false;
+			pthread_cond_broadcast(&sweepDone);
+			pthread_cond_wait(&sweepWork, &sweepLock);
+		}
+		Heap* heap = sweepQueue;
+		sweepQueue = heap->next;
+		sweeping = true;
+		pthread_mutex_unlock(&sweepLock);
+		releaseHeap(heap);
+		free(heap);
+		pthread_mutex_lock(&sweepLock);
+	}
+	return NULL;
+}
+static bool queueHeap(Heap* heap){
+	// false when there is no sweeper, the caller releases the heap itself
+	Heap* queued = malloc(sizeof(Heap));
+	if (queued == NULL)
+		return false;
+	*queued = *heap;
+	pthread_mutex_lock(&sweepLock);
+	if (!sweeperStarted){
+		pthread_t thread;
+		sweeperStarted = pthread_create(&thread, NULL, sweeper, NULL) == 0;
+		if (sweeperStarted)
+			pthread_detach(thread);
+	}
+	if (sweeperStarted){
+		queued->next = sweepQueue;
+		sweepQueue = queued;
+		pthread_cond_signal(&sweepWork);
+	}
+	pthread_mutex_unlock(&sweepLock);
+	if (!sweeperStarted)
+		free(queued);
+	return sweeperStarted;
+}
+void setBackgroundTeardown(bool background){
+	backgroundTeardown = background;
+}
+void finishTeardown(){
+	pthread_mutex_lock(&sweepLock);
+	while (sweepQueue != NULL || sweeping)
+		pthread_cond_wait(&sweepDone, &sweepLock);
+	pthread_mutex_unlock(&sweepLock);
+}
+static void settleCounters(){
+	// freeVM frees the tables first, everything the vm still counts
+	// belongs to the heap
+	vm.memory.total.live = 0;
+	for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+		vm.memory.categories[i].live = 0;
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++){
+		vm.memory.types[i].live = 0;
+		vm.memory.objects[i] = 0;
+	}
+}
+void freeObjects(){
+	// the heap goes all at once: the counters drop to zero right here and
+	// the memory is released on the sweeper thread, so teardown costs the
+	// caller next to nothing however many objects there are
+	Heap heap = { NULL, vm.objects, vm.slabs, vm.image, vm.imageSize };
+	vm.objects = NULL;
+	vm.slabs = NULL;
+	vm.image = NULL;
+	vm.imageSize = 0;
+	for (int i = 0; i < SIZE_CLASS_COUNT; i++){
+		vm.sizeClasses[i].free = NULL;
+		vm.sizeClasses[i].next = NULL;
+		vm.sizeClasses[i].end = NULL;
+	}
+	settleCounters();
+	if (heap.objects == NULL && heap.slabs == NULL && heap.image == NULL)
+		return;
+	if (!backgroundTeardown || !queueHeap(&heap))
+		releaseHeap(&heap);
+}
+static void writeCounter(FILE* out, const char* name, MemoryCounter* counter, const char* after){
+	fprintf(out, "\"%s\": {\"live\": %zu, \"peak\": %zu}%s", name, counter->live, counter->peak, after);
+}
+void writeMemoryReport(FILE* out){
+	static const char* categoryNames[MEM_CATEGORY_COUNT] = {
+		"objects", "chunk", "constants", "table", "stack", "jit", "compiler"
+	};
+	static const char* typeNames[OBJ_TYPE_COUNT] = {
+		"string", "function", "fiber", "native", "array", "map", "class", "instance", "shape", "bound_method",
+		"closure", "upvalue"
+	};
+	fprintf(out, "{\"limit\": %zu, ", vm.memory.limit);
+	writeCounter(out, "total", &vm.memory.total, ",\n");
+	fputs(" \"categories\": {", out);
+	for (int i = 0; i < MEM_CATEGORY_COUNT; i++)
+		writeCounter(out, categoryNames[i], &vm.memory.categories[i], i + 1 < MEM_CATEGORY_COUNT ? ", " : "},\n");
+	fputs(" \"types\": {", out);
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+		fprintf(out, "\"%s\": {\"live\": %zu, \"peak\": %zu, \"count\": %zu}%s", typeNames[i],
+			vm.memory.types[i].live, vm.memory.types[i].peak, vm.memory.objects[i],
+			i + 1 < OBJ_TYPE_COUNT ? ", " : "}}\n");
 }
\ No newline at end of file
@@ -2,24 +2,81 @@
 #define clox_memory_h
 #include "common.h"
 #include "value.h"
-#include "vm.h"
 
 #define GROW_CAPACITY(capacity) \
 		((capacity) < 8 ? 8 : (capacity) * 2)
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
+#define GROW_ARRAY(type, pointer, oldCount, newCount, category) \
 		(type*)reallocate(pointer,sizeof(type) * (oldCount), \
-			sizeof(type) * (newCount))
-#define FREE_ARRAY(type, pointer, oldCount) \
-		reallocate(pointer,sizeof(type) * (oldCount), 0)
+			sizeof(type) * (newCount), category)
+#define FREE_ARRAY(type, pointer, oldCount, category) \
+		reallocate(pointer,sizeof(type) * (oldCount), 0, category)
 		
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(type, count, category) \
+    (type*)reallocate(NULL, 0, sizeof(type) * (count), category)
 
 #define ALLOCATE_OBJ(type, objectType) \
 	(type*)allocateObject(sizeof(type),objectType)
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
-#define FREE_CONST(size, pointer) reallocate(pointer,size,0)
+#define FREE(type, pointer, category) reallocate(pointer, sizeof(type), 0, category)
+#define FREE_CONST(size, pointer, category) reallocate(pointer,size,0,category)
 
-void* reallocate(void*, size_t, size_t);
-void freeObjects();
+// every byte goes through reallocate with the subsystem it belongs to
+typedef enum {
+	MEM_OBJECTS, // slabs and large objects, split by ObjType in MemoryStats.types
+	MEM_CHUNK, // code, line info, loop counters
+	MEM_CONSTANTS,
+	MEM_TABLE,
+	MEM_STACK,
+	MEM_JIT,
+	MEM_COMPILER, // scratch memory of the backends
+	MEM_CATEGORY_COUNT
+} MemoryCategory;
+
+typedef struct {
+	size_t live;
+	size_t peak;
+} MemoryCounter;
+
+typedef struct {
+	MemoryCounter total;
+	MemoryCounter categories[MEM_CATEGORY_COUNT];
+	MemoryCounter types[OBJ_TYPE_COUNT]; // requested object sizes
+	size_t objects[OBJ_TYPE_COUNT]; // live object count
+	size_t objectsAllocated; // ever, freed ones included
+	size_t allocated[OBJ_TYPE_COUNT]; // the same by type
+	size_t blocksAllocated; // by reallocate from nothing, slabs and large objects too
+	size_t limit; // bytes, 0 for none
+} MemoryStats;
+
+// objects up to SLAB_OBJECT_MAX bytes are carved out of SLAB_SIZE pages,
+// one size class per page, and handed back all at once by freeObjects
+#define SLAB_SIZE (64 * 1024)
+#define SIZE_CLASS_STEP 16 // also the alignment of every object
+#define SIZE_CLASS_COUNT 16
+#define SLAB_OBJECT_MAX (SIZE_CLASS_STEP * SIZE_CLASS_COUNT)
+
+typedef struct _Slab {
+	struct _Slab* next;
+} Slab;
+typedef struct _FreeBlock {
+	struct _FreeBlock* next;
+} FreeBlock;
+typedef struct {
+	FreeBlock* free; // blocks given back by slabFree
+	uint8_t* next; // untouched part of the newest slab
+	uint8_t* end;
+} SizeClass;
+
+void* reallocate(void*, size_t, size_t, MemoryCategory);
+void countMemory(MemoryCategory, size_t, size_t);
+void* slabAllocate(size_t, ObjType);
+void slabFree(void*, size_t, ObjType);
+void countObjects(ObjType, size_t, size_t); // count objects and bytes that came in a heap image
+size_t objectSize(PObj);
+void freeObjects(); // only freeVM calls it
+// teardown hands the heap to a sweeper thread unless told otherwise.
+// finishTeardown waits until every heap handed over so far is released
+void setBackgroundTeardown(bool);
+void finishTeardown();
+bool checkMemoryLimit();
+void writeMemoryReport(FILE*);
 #endif
\ No newline at end of file
@@ -0,0 +1,271 @@
+#include "module.h"
+#include "vm.h"
+#include "memory.h"
+#include "compiler.h"
+
+typedef struct {
+	Value value; // numbers, bools, nil and short strings are kept as they are
+	char* chars; // a heap string, NULL otherwise
+	int length;
+	int function; // index into Module.functions, -1 otherwise
+} FrozenConstant;
+
+typedef struct {
+	char* name; // NULL for the module body
+	int arity;
+	int slots;
+	int cost;
+	uint8_t* code;
+	int count;
+	LineInfo lineInfo;
+	LoopCounter* loops; // starts and costs, every vm counts its own hits
+	int loopCount;
+	int cacheCount; // inline caches start out empty in every vm
+	Capture* captures; // borrowed like the code
+	int captureCount;
+	FrozenConstant* constants;
+	int constantCount;
+} FrozenFunction;
+
+typedef struct _Module {
+	struct _Module* next;
+	char* name;
+	FrozenFunction* functions; // the body first
+	int functionCount;
+} Module;
+
+static Module* modules = NULL; // process wide, only ever prepended to
+static char** paths = NULL;
+static int pathCount = 0;
+
+static void* cacheAllocate(size_t size){
+	// the cache outlives every vm, so it is not counted against any of them
+	void* block = malloc(size == 0 ? 1 : size);
+	if (block == NULL){
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return block;
+}
+static char* cacheString(const char* chars, int length){
+	char* copy = cacheAllocate(length + 1);
+	memcpy(copy, chars, length);
+	copy[length] = '\0';
+	return copy;
+}
+void addModulePath(const char* list){
+	while (*list != '\0'){
+		const char* end = strchr(list, ':');
+		int length = end == NULL ? (int)strlen(list) : (int)(end - list);
+		if (length > 0){
+			char** grown = realloc(paths, sizeof(char*) * (pathCount + 1));
+			if (grown == NULL){
+				fprintf(stderr, "Out of memory.\n");
+				exit(1);
+			}
+			paths = grown;
+			paths[pathCount++] = cacheString(list, length);
+		}
+		list += length + (end != NULL);
+	}
+}
+static char* readModule(const char* name){
+	// first hit on the search path, the current directory when there is none
+	int count = pathCount == 0 ? 1 : pathCount;
+	for (int i = 0; i < count; i++){
+		const char* dir = pathCount == 0 ? "." : paths[i];
+		size_t length = strlen(dir) + strlen(name) + sizeof("/.lox");
+		char* path = cacheAllocate(length);
+		snprintf(path, length, "%s/%s.lox", dir, name);
+		FILE* file = fopen(path, "rb");
+		free(path);
+		if (file == NULL)
+			continue;
+		fseek(file, 0L, SEEK_END);
+		size_t size = ftell(file);
+		rewind(file);
+		char* source = cacheAllocate(size + 1);
+		size = fread(source, 1, size, file);
+		source[size] = '\0';
+		fclose(file);
+		return source;
+	}
+	return NULL;
+}
+
+typedef struct {
+	PObjFunction* functions;
+	int count;
+	int capacity;
+} FunctionList;
+static void collect(FunctionList* list, PObjFunction function){
+	if (list->count == list->capacity){
+		int oldCapacity = list->capacity;
+		list->capacity = GROW_CAPACITY(oldCapacity);
+		list->functions = GROW_ARRAY(PObjFunction, list->functions, oldCapacity,
+			list->capacity, MEM_COMPILER);
+	}
+	list->functions[list->count++] = function;
+	PValueArray constants = &function->chunk.constants;
+	for (int i = 0; i < constants->count; i++)
+		if (IS_FUNCTION(constants->values[i]))
+			collect(list, AS_FUNCTION(constants->values[i]));
+}
+static int indexOf(FunctionList* list, PObjFunction function){
+	for (int i = 0; i < list->count; i++)
+		if (list->functions[i] == function)
+			return i;
+	return -1;
+}
+static void freeze(FrozenFunction* frozen, PObjFunction function, FunctionList* list){
+	PChunk chunk = &function->chunk;
+	frozen->name = function->name == NULL ? NULL :
+		cacheString(function->name->chars, function->name->length);
+	frozen->arity = function->arity;
+	frozen->slots = function->slots;
+	frozen->cost = chunk->cost;
+	frozen->count = chunk->count;
+	frozen->code = cacheAllocate(chunk->count);
+	memcpy(frozen->code, chunk->code, chunk->count);
+	frozen->lineInfo.count = frozen->lineInfo.capacity = chunk->lineInfo.count;
+	frozen->lineInfo.lines = cacheAllocate(sizeof(LineStart) * chunk->lineInfo.count);
+	memcpy(frozen->lineInfo.lines, chunk->lineInfo.lines, sizeof(LineStart) * chunk->lineInfo.count);
+	frozen->loopCount = chunk->loopCount;
+	frozen->loops = cacheAllocate(sizeof(LoopCounter) * chunk->loopCount);
+	for (int i = 0; i < chunk->loopCount; i++){
+		frozen->loops[i] = chunk->loops[i];
+		frozen->loops[i].hits = 0;
+	}
+	frozen->cacheCount = chunk->cacheCount;
+	frozen->captureCount = function->captureCount;
+	frozen->captures = NULL;
+	if (function->captureCount > 0){
+		frozen->captures = cacheAllocate(sizeof(Capture) * function->captureCount);
+		memcpy(frozen->captures, function->captures, sizeof(Capture) * function->captureCount);
+	}
+	frozen->constantCount = chunk->constants.count;
+	frozen->constants = cacheAllocate(sizeof(FrozenConstant) * chunk->constants.count);
+	for (int i = 0; i < chunk->constants.count; i++){
+		Value value = chunk->constants.values[i];
+		FrozenConstant* constant = &frozen->constants[i];
+		constant->value = value;
+		constant->chars = NULL;
+		constant->function = -1;
+		if (IS_FUNCTION(value)){
+			constant->function = indexOf(list, AS_FUNCTION(value));
+		} else if (IS_OBJ(value) && IS_STRING(value)){
+			constant->length = AS_STRING(value)->length;
+			constant->chars = cacheString(AS_CSTRING(value), constant->length);
+		}
+	}
+}
+static Module* compileModule(const char* name, const char* source){
+	// in a vm of its own, so none of the compiler's objects end up in the
+	// importing one
+	VM scratch = { .jitEnabled = false };
+	swapVM(&scratch);
+	initVM();
+	int ids = functionCount; // compile() starts over, the importer's carry on
+	PObjFunction body = compile(source);
+	functionCount = ids;
+	Module* module = NULL;
+	if (body != NULL){
+		FunctionList list = { NULL, 0, 0 };
+		collect(&list, body);
+		module = cacheAllocate(sizeof(Module));
+		module->name = cacheString(name, (int)strlen(name));
+		module->functionCount = list.count;
+		module->functions = cacheAllocate(sizeof(FrozenFunction) * list.count);
+		for (int i = 0; i < list.count; i++)
+			freeze(&module->functions[i], list.functions[i], &list);
+		FREE_ARRAY(PObjFunction, list.functions, list.capacity, MEM_COMPILER);
+	}
+	freeVM();
+	swapVM(&scratch);
+	return module;
+}
+static PObjFunction instantiate(Module* module){
+	PObjFunction* functions = ALLOCATE(PObjFunction, module->functionCount, MEM_COMPILER);
+	for (int i = 0; i < module->functionCount; i++){
+		FrozenFunction* frozen = &module->functions[i];
+		PObjFunction function = functions[i] = newFunction();
+		function->id = ++functionCount; // after the importer's own, for traces
+		function->arity = frozen->arity;
+		function->slots = frozen->slots;
+		function->name = frozen->name == NULL ? copyString(module->name, (int)strlen(module->name)) :
+			copyString(frozen->name, (int)strlen(frozen->name));
+		PChunk chunk = &function->chunk;
+		chunk->borrowed = true;
+		chunk->code = frozen->code;
+		chunk->count = chunk->capacity = frozen->count;
+		chunk->lineInfo = frozen->lineInfo;
+		chunk->cost = frozen->cost;
+		function->captures = frozen->captures;
+		function->captureCount = function->captureCapacity = frozen->captureCount;
+		if (frozen->loopCount > 0){
+			chunk->loops = ALLOCATE(LoopCounter, frozen->loopCount, MEM_CHUNK);
+			chunk->loopCount = chunk->loopCapacity = frozen->loopCount;
+			memcpy(chunk->loops, frozen->loops, sizeof(LoopCounter) * frozen->loopCount);
+		}
+		if (frozen->cacheCount > 0){
+			chunk->caches = ALLOCATE(InlineCache, frozen->cacheCount, MEM_CHUNK);
+			chunk->cacheCount = chunk->cacheCapacity = frozen->cacheCount;
+			memset(chunk->caches, 0, sizeof(InlineCache) * frozen->cacheCount);
+		}
+	}
+	for (int i = 0; i < module->functionCount; i++){
+		FrozenFunction* frozen = &module->functions[i];
+		for (int j = 0; j < frozen->constantCount; j++){
+			FrozenConstant* constant = &frozen->constants[j];
+			Value value = constant->value;
+			if (constant->function >= 0)
+				value = OBJ_VAL(functions[constant->function]);
+			else if (constant->chars != NULL) // the cache is never released
+				value = OBJ_VAL(borrowString(constant->chars, constant->length));
+			addConstant(&functions[i]->chunk, value);
+		}
+	}
+	PObjFunction body = functions[0];
+	FREE_ARRAY(PObjFunction, functions, module->functionCount, MEM_COMPILER);
+	return body;
+}
+bool importModule(){
+	Value name = vm.stackTop[-1];
+	if (!IS_STRING(name)){
+		runtimeError("Module name must be a string.");
+		return false;
+	}
+	Value imported;
+	if (tableGet(&vm.modules, &name, &imported)){
+		vm.stackTop[-1] = NIL_VAL();
+		return true;
+	}
+	// a literal name points into its source and isn't terminated
+	char* chars = cacheString(stringChars(&name), stringLength(&name));
+	Module* module = modules;
+	while (module != NULL && strcmp(module->name, chars) != 0)
+		module = module->next;
+	if (module == NULL){
+		char* source = readModule(chars);
+		if (source == NULL){
+			runtimeError("Could not find module '%s'.", chars);
+			free(chars);
+			return false;
+		}
+		module = compileModule(chars, source);
+		free(source);
+		if (module == NULL){
+			runtimeError("Could not compile module '%s'.", chars);
+			free(chars);
+			return false;
+		}
+		module->next = modules;
+		modules = module;
+	}
+	free(chars);
+	imported = BOOL_VAL(true);
+	tableSet(&vm.modules, &name, &imported);
+	PObjFunction body = instantiate(module);
+	vm.stackTop[-1] = OBJ_VAL(body);
+	return call(body, 0);
+}
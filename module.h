@@ -0,0 +1,16 @@
+#ifndef clox_module_h
+#define clox_module_h
+#include "common.h"
+#include "value.h"
+#include "object.h"
+
+// import "name"; runs name.lox from the search path, once per vm. each
+// module is compiled once per process into a cache that lives outside
+// every vm's heap and never changes after it is added. a vm borrows the
+// cached bytecode and line info and only builds its own function objects
+// and constants, strings have to be interned in its own table. like the
+// compiler and the global vm, the cache and the search path are not
+// guarded: a process imports from one thread only
+void addModulePath(const char*); // one directory or a ':' separated list
+bool importModule(); // [name] -> [module body frame] or [nil] when imported already
+#endif
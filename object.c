@@ -0,0 +1,98 @@
+#include "memory.h"
+#include "object.h"
+
+PObjFunction newFunction(){
+	PObjFunction function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+	function->arity = 0;
+	function->slots = 0;
+	function->name = NULL;
+	function->id = 0;
+	function->native = NULL;
+	function->owner = NULL;
+	function->captures = NULL;
+	function->captureCount = 0;
+	function->captureCapacity = 0;
+	initChunk(&function->chunk);
+	return function;
+}
+PObjFiber newFiber(){
+	PObjFiber fiber = ALLOCATE_OBJ(ObjFiber, OBJ_FIBER);
+	fiber->stack = ALLOCATE(Value, FIBER_STACK_MIN, MEM_STACK);
+	fiber->stackTop = fiber->stack;
+	fiber->stackCapacity = FIBER_STACK_MIN;
+	fiber->frames = ALLOCATE(CallFrame, FIBER_FRAMES_MIN, MEM_STACK);
+	fiber->frameCount = 0;
+	fiber->frameCapacity = FIBER_FRAMES_MIN;
+	fiber->state = FIBER_SUSPENDED;
+	fiber->resumer = NULL;
+	fiber->next = NULL;
+	fiber->openUpvalues = NULL;
+	return fiber;
+}
+PObjNative newNative(int arity, NativeFn function){
+	PObjNative native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+	native->arity = arity;
+	native->function = function;
+	return native;
+}
+PObjArray newArray(int count){
+	PObjArray array = ALLOCATE_OBJ(ObjArray, OBJ_ARRAY);
+	array->count = count;
+	array->values = ALLOCATE(double, count, MEM_OBJECTS);
+	for (int i = 0; i < count; i++)
+		array->values[i] = 0;
+	return array;
+}
+PObjMap newMap(){
+	PObjMap map = ALLOCATE_OBJ(ObjMap, OBJ_MAP);
+	initTable(&map->table);
+	map->count = 0;
+	return map;
+}
+PObjClass newClass(PObjString name){
+	PObjClass klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+	klass->name = name;
+	klass->superclass = NULL;
+	initTable(&klass->methods);
+	klass->initializer = NULL;
+	klass->fields = 0;
+	klass->shape = newShape(klass, NULL, NIL_VAL());
+	return klass;
+}
+PObjShape newShape(PObjClass klass, PObjShape parent, Value name){
+	PObjShape shape = ALLOCATE_OBJ(ObjShape, OBJ_SHAPE);
+	shape->klass = klass;
+	shape->parent = parent;
+	shape->name = name;
+	shape->count = parent == NULL ? 0 : parent->count + 1;
+	initTable(&shape->transitions);
+	return shape;
+}
+PObjInstance newInstance(PObjClass klass){
+	PObjInstance instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+	instance->shape = klass->shape;
+	instance->capacity = klass->fields;
+	instance->fields = klass->fields == 0 ? NULL : ALLOCATE(Value, klass->fields, MEM_OBJECTS);
+	return instance;
+}
+PObjBoundMethod newBoundMethod(Value receiver, PObjFunction method){
+	PObjBoundMethod bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+	bound->receiver = receiver;
+	bound->method = method;
+	return bound;
+}
+PObjClosure newClosure(PObjFunction function){
+	int count = function->captureCount;
+	PObjClosure closure = (PObjClosure)allocateObject(
+		sizeof(ObjClosure) + sizeof(PObjUpvalue) * count, OBJ_CLOSURE);
+	closure->function = function;
+	closure->upvalueCount = count;
+	return closure;
+}
+PObjUpvalue newUpvalue(Value* slot){
+	PObjUpvalue upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+	upvalue->location = slot;
+	upvalue->closed = NIL_VAL();
+	upvalue->next = NULL;
+	return upvalue;
+}
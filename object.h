@@ -0,0 +1,170 @@
+#ifndef clox_object_h
+#define clox_object_h
+#include "common.h"
+#include "value.h"
+#include "chunk.h"
+#include "table.h"
+
+// a variable of an enclosing function that a closure captures, as the
+// frame creating the closure reaches it: link and index as for OP_OUTER_GET
+typedef struct {
+	uint8_t link;
+	uint16_t index;
+} Capture;
+
+typedef struct _ObjFunction {
+	Obj obj;
+	int arity;
+	int slots; // most locals alive at once, slot 0 included
+	Chunk chunk;
+	PObjString name; // NULL for the top level script
+	int id; // order of compilation, 0 for the script. traces name functions by it
+	int (*native)(void); // body compiled ahead of time, see aot.h
+	struct _ObjClass* owner; // class a method was declared in, super starts above it
+	Capture* captures; // one per upvalue, only escaping closures have them
+	int captureCount;
+	int captureCapacity;
+} ObjFunction, *PObjFunction;
+
+#define FRAMES_MAX 256
+#define FIBER_FRAMES_MIN 8 // doubled up to FRAMES_MAX, see reserveFrame
+#define FIBER_STACK_MIN (UINT8_MAX + 1) // enough for the first frame
+// stack a frame may use. a wide frame gets the usual room for temporaries
+// on top of its locals
+#define FRAME_STACK(function) \
+	((function)->slots <= UINT8_MAX + 1 ? UINT8_MAX + 1 : (function)->slots + UINT8_MAX + 1)
+typedef struct {
+	PObjFunction function;
+	uint8_t* ip;
+	Value* slots; // first stack slot the function can use, arguments are already there
+	int link; // frame of the enclosing function for a nested one, -1 otherwise
+} CallFrame;
+
+typedef enum {
+	FIBER_SUSPENDED, // not started yet or yielded to its resumer
+	FIBER_READY, // waiting in the scheduler's queue
+	FIBER_RUNNING, // running, or waiting for a fiber it resumed
+	FIBER_DONE
+} FiberState;
+
+typedef struct _ObjFiber {
+	Obj obj;
+	CallFrame* frames; // grows on calls like the stack
+	int frameCount;
+	int frameCapacity;
+	Value* stack; // grows on calls, see reserveStack
+	Value* stackTop;
+	int stackCapacity;
+	FiberState state;
+	struct _ObjFiber* resumer; // gets control back on yield, NULL when scheduled
+	struct _ObjFiber* next; // in the ready queue
+	struct _ObjUpvalue* openUpvalues; // pointing into the stack, highest slot first
+} ObjFiber, *PObjFiber;
+
+// a builtin. it reads its arguments from args and reports runtime errors
+// itself, false means one was reported
+typedef bool (*NativeFn)(Value* args, Value* result);
+typedef struct {
+	Obj obj;
+	int arity;
+	NativeFn function;
+} ObjNative, *PObjNative;
+
+typedef struct {
+	Obj obj;
+	int count;
+	double* values; // unboxed and contiguous, so the bulk natives can vectorize
+} ObjArray, *PObjArray;
+
+typedef struct {
+	Obj obj;
+	Table table;
+	int count; // the table's count includes tombstones
+} ObjMap, *PObjMap;
+
+// instances keep their fields in a flat array. which name sits at which
+// index is described by a shape shared with every instance that got the
+// same fields in the same order: adding a field follows (or creates) a
+// transition to the next shape. shapes never change once created
+typedef struct _ObjShape {
+	Obj obj;
+	struct _ObjClass* klass; // every class has a root shape of its own
+	struct _ObjShape* parent; // NULL for the root
+	Value name; // of the field this shape adds to its parent
+	int count; // fields, the newest one is at count - 1
+	Table transitions; // field name -> shape with that field added
+} ObjShape, *PObjShape;
+
+typedef struct _ObjClass {
+	Obj obj;
+	PObjString name;
+	struct _ObjClass* superclass;
+	Table methods; // name -> function, inherited ones copied in
+	PObjFunction initializer; // init, NULL when there is none
+	PObjShape shape; // of a new instance, no fields
+	int fields; // most any instance has had, new ones start with room for that many
+} ObjClass, *PObjClass;
+
+typedef struct {
+	Obj obj;
+	PObjShape shape;
+	Value* fields; // in the order the shape added them
+	int capacity;
+} ObjInstance, *PObjInstance;
+
+typedef struct {
+	Obj obj;
+	Value receiver;
+	PObjFunction method;
+} ObjBoundMethod, *PObjBoundMethod;
+
+// a captured variable. it stays in its frame's stack slot while the frame
+// lives and moves into closed when the variable goes out of scope
+typedef struct _ObjUpvalue {
+	Obj obj;
+	Value* location; // the stack slot while open, &closed after
+	Value closed;
+	struct _ObjUpvalue* next; // in the fiber's open list
+} ObjUpvalue, *PObjUpvalue;
+
+// a function that can outlive the frames it captures from. nested functions
+// that never escape are called with a link to the enclosing frame instead
+// and reach its locals in place, see closure.h
+typedef struct {
+	Obj obj;
+	PObjFunction function;
+	int upvalueCount;
+	PObjUpvalue upvalues[]; // for function->captures
+} ObjClosure, *PObjClosure;
+
+#define IS_FUNCTION(value)		isObjType(value,OBJ_FUNCTION)
+#define AS_FUNCTION(value)		((PObjFunction)AS_OBJ(value))
+#define IS_FIBER(value)		isObjType(value,OBJ_FIBER)
+#define AS_FIBER(value)		((PObjFiber)AS_OBJ(value))
+#define IS_NATIVE(value)		isObjType(value,OBJ_NATIVE)
+#define AS_NATIVE(value)		((PObjNative)AS_OBJ(value))
+#define IS_ARRAY(value)		isObjType(value,OBJ_ARRAY)
+#define AS_ARRAY(value)		((PObjArray)AS_OBJ(value))
+#define IS_MAP(value)		isObjType(value,OBJ_MAP)
+#define AS_MAP(value)		((PObjMap)AS_OBJ(value))
+#define IS_CLASS(value)		isObjType(value,OBJ_CLASS)
+#define AS_CLASS(value)		((PObjClass)AS_OBJ(value))
+#define IS_INSTANCE(value)		isObjType(value,OBJ_INSTANCE)
+#define AS_INSTANCE(value)		((PObjInstance)AS_OBJ(value))
+#define IS_BOUND_METHOD(value)		isObjType(value,OBJ_BOUND_METHOD)
+#define AS_BOUND_METHOD(value)		((PObjBoundMethod)AS_OBJ(value))
+#define IS_CLOSURE(value)		isObjType(value,OBJ_CLOSURE)
+#define AS_CLOSURE(value)		((PObjClosure)AS_OBJ(value))
+
+PObjFunction newFunction();
+PObjFiber newFiber();
+PObjNative newNative(int, NativeFn);
+PObjArray newArray(int); // zero filled
+PObjMap newMap();
+PObjClass newClass(PObjString);
+PObjShape newShape(PObjClass, PObjShape, Value); // root shape when the parent is NULL
+PObjInstance newInstance(PObjClass);
+PObjBoundMethod newBoundMethod(Value, PObjFunction);
+PObjClosure newClosure(PObjFunction); // upvalues left for the caller
+PObjUpvalue newUpvalue(Value*);
+#endif
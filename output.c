@@ -0,0 +1,383 @@
+#define _POSIX_C_SOURCE 200809L // isatty
+
+#include <errno.h>
+#include <math.h>
+#include <unistd.h>
+#include "output.h"
+
+typedef struct {
+	char* chars;
+	int count;
+	int capacity;
+	FlushPolicy policy;
+	bool direct;
+	bool started;
+	bool configured; // by setFlushPolicy, else the policy follows stdout
+} Output;
+
+static Output output;
+
+static void startOutput(){
+	if (!output.configured)
+		output.policy = isatty(STDOUT_FILENO) ? FLUSH_LINE : FLUSH_SIZE;
+	output.capacity = OUTPUT_BUFFER;
+	output.chars = malloc(output.capacity);
+	if (output.chars == NULL){
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	output.started = true;
+	atexit(flushOutput); // hosts that never flush lose nothing either
+}
+void setFlushPolicy(FlushPolicy policy){
+	flushOutput();
+	output.policy = policy;
+	output.configured = true;
+}
+void setDirectOutput(bool direct){
+	flushOutput();
+	output.direct = direct;
+}
+static void emit(const char* chars, int count){
+	if (!output.direct){
+		fwrite(chars, 1, count, stdout);
+		fflush(stdout);
+		return;
+	}
+	fflush(stdout); // whatever went through stdio was written first
+	while (count > 0){
+		ssize_t written = write(STDOUT_FILENO, chars, count);
+		if (written < 0){
+			if (errno == EINTR)
+				continue;
+			return; // a closed pipe, nobody is reading anymore
+		}
+		chars += written;
+		count -= (int)written;
+	}
+}
+void flushOutput(){
+	if (output.count == 0)
+		return;
+	emit(output.chars, output.count);
+	output.count = 0;
+}
+void writeOutput(const char* chars, int count){
+	if (!output.started)
+		startOutput();
+	if (output.count + count > output.capacity){
+		if (output.policy == FLUSH_EXIT){
+			while (output.count + count > output.capacity)
+				output.capacity *= 2;
+			char* grown = realloc(output.chars, output.capacity);
+			if (grown == NULL){
+				fprintf(stderr, "Out of memory.\n");
+				exit(1);
+			}
+			output.chars = grown;
+		} else {
+			flushOutput();
+			if (count > output.capacity){ // would not fit anyway
+				emit(chars, count);
+				return;
+			}
+		}
+	}
+	memcpy(output.chars + output.count, chars, count);
+	output.count += count;
+}
+void writeText(const char* text){
+	writeOutput(text, (int)strlen(text));
+}
+void printLine(Value value){
+	printValue(value);
+	writeOutput("\n", 1);
+	if (output.policy == FLUSH_LINE)
+		flushOutput();
+}
+
+// grisu3 (Loitsch, "Printing floating-point numbers quickly and accurately
+// with integers"). it gives the shortest digits or says it can't be sure,
+// about one double in two hundred, and those take the slow exact path
+typedef struct {
+	uint64_t f;
+	int e;
+} DiyFp; // f * 2^e
+
+#define SIGNIFICAND_BITS 52
+#define HIDDEN_BIT ((uint64_t)1 << SIGNIFICAND_BITS)
+#define EXPONENT_BIAS (0x3FF + SIGNIFICAND_BITS)
+
+// 10^k for k = -348, -340, ..., 340, normalized
+static const DiyFp cachedPowers[] = {
+	{ 0xfa8fd5a0081c0288u, -1220 }, { 0xbaaee17fa23ebf76u, -1193 }, { 0x8b16fb203055ac76u, -1166 },
+	{ 0xcf42894a5dce35eau, -1140 }, { 0x9a6bb0aa55653b2du, -1113 }, { 0xe61acf033d1a45dfu, -1087 },
+	{ 0xab70fe17c79ac6cau, -1060 }, { 0xff77b1fcbebcdc4fu, -1034 }, { 0xbe5691ef416bd60cu, -1007 },
+	{ 0x8dd01fad907ffc3cu, -980 }, { 0xd3515c2831559a83u, -954 }, { 0x9d71ac8fada6c9b5u, -927 },
+	{ 0xea9c227723ee8bcbu, -901 }, { 0xaecc49914078536du, -874 }, { 0x823c12795db6ce57u, -847 },
+	{ 0xc21094364dfb5637u, -821 }, { 0x9096ea6f3848984fu, -794 }, { 0xd77485cb25823ac7u, -768 },
+	{ 0xa086cfcd97bf97f4u, -741 }, { 0xef340a98172aace5u, -715 }, { 0xb23867fb2a35b28eu, -688 },
+	{ 0x84c8d4dfd2c63f3bu, -661 }, { 0xc5dd44271ad3cdbau, -635 }, { 0x936b9fcebb25c996u, -608 },
+	{ 0xdbac6c247d62a584u, -582 }, { 0xa3ab66580d5fdaf6u, -555 }, { 0xf3e2f893dec3f126u, -529 },
+	{ 0xb5b5ada8aaff80b8u, -502 }, { 0x87625f056c7c4a8bu, -475 }, { 0xc9bcff6034c13053u, -449 },
+	{ 0x964e858c91ba2655u, -422 }, { 0xdff9772470297ebdu, -396 }, { 0xa6dfbd9fb8e5b88fu, -369 },
+	{ 0xf8a95fcf88747d94u, -343 }, { 0xb94470938fa89bcfu, -316 }, { 0x8a08f0f8bf0f156bu, -289 },
+	{ 0xcdb02555653131b6u, -263 }, { 0x993fe2c6d07b7facu, -236 }, { 0xe45c10c42a2b3b06u, -210 },
+	{ 0xaa242499697392d3u, -183 }, { 0xfd87b5f28300ca0eu, -157 }, { 0xbce5086492111aebu, -130 },
+	{ 0x8cbccc096f5088ccu, -103 }, { 0xd1b71758e219652cu, -77 }, { 0x9c40000000000000u, -50 },
+	{ 0xe8d4a51000000000u, -24 }, { 0xad78ebc5ac620000u, 3 }, { 0x813f3978f8940984u, 30 },
+	{ 0xc097ce7bc90715b3u, 56 }, { 0x8f7e32ce7bea5c70u, 83 }, { 0xd5d238a4abe98068u, 109 },
+	{ 0x9f4f2726179a2245u, 136 }, { 0xed63a231d4c4fb27u, 162 }, { 0xb0de65388cc8ada8u, 189 },
+	{ 0x83c7088e1aab65dbu, 216 }, { 0xc45d1df942711d9au, 242 }, { 0x924d692ca61be758u, 269 },
+	{ 0xda01ee641a708deau, 295 }, { 0xa26da3999aef774au, 322 }, { 0xf209787bb47d6b85u, 348 },
+	{ 0xb454e4a179dd1877u, 375 }, { 0x865b86925b9bc5c2u, 402 }, { 0xc83553c5c8965d3du, 428 },
+	{ 0x952ab45cfa97a0b3u, 455 }, { 0xde469fbd99a05fe3u, 481 }, { 0xa59bc234db398c25u, 508 },
+	{ 0xf6c69a72a3989f5cu, 534 }, { 0xb7dcbf5354e9beceu, 561 }, { 0x88fcf317f22241e2u, 588 },
+	{ 0xcc20ce9bd35c78a5u, 614 }, { 0x98165af37b2153dfu, 641 }, { 0xe2a0b5dc971f303au, 667 },
+	{ 0xa8d9d1535ce3b396u, 694 }, { 0xfb9b7cd9a4a7443cu, 720 }, { 0xbb764c4ca7a44410u, 747 },
+	{ 0x8bab8eefb6409c1au, 774 }, { 0xd01fef10a657842cu, 800 }, { 0x9b10a4e5e9913129u, 827 },
+	{ 0xe7109bfba19c0c9du, 853 }, { 0xac2820d9623bf429u, 880 }, { 0x80444b5e7aa7cf85u, 907 },
+	{ 0xbf21e44003acdd2du, 933 }, { 0x8e679c2f5e44ff8fu, 960 }, { 0xd433179d9c8cb841u, 986 },
+	{ 0x9e19db92b4e31ba9u, 1013 }, { 0xeb96bf6ebadf77d9u, 1039 }, { 0xaf87023b9bf0ee6bu, 1066 },
+};
+static const uint32_t powersOf10[] = {
+	1, 10, 100, 1000, 10000, 100000, 1000000, 10000000, 100000000, 1000000000
+};
+
+static DiyFp multiply(DiyFp a, DiyFp b){
+	// the high 64 bits of the product, rounded
+	const uint64_t mask = 0xFFFFFFFFu;
+	uint64_t ah = a.f >> 32, al = a.f & mask, bh = b.f >> 32, bl = b.f & mask;
+	uint64_t hh = ah * bh, lh = al * bh, hl = ah * bl, ll = al * bl;
+	uint64_t middle = (ll >> 32) + (hl & mask) + (lh & mask) + ((uint64_t)1 << 31);
+	return (DiyFp){ hh + (hl >> 32) + (lh >> 32) + (middle >> 32), a.e + b.e + 64 };
+}
+static DiyFp normalize(DiyFp x){
+	while (!(x.f & ((uint64_t)1 << 63))){
+		x.f <<= 1;
+		x.e--;
+	}
+	return x;
+}
+static void boundaries(double value, DiyFp* v, DiyFp* minus, DiyFp* plus){
+	// v and the midpoints to its neighbours, all with plus' exponent
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	int biased = (int)((bits >> SIGNIFICAND_BITS) & 0x7FF);
+	uint64_t significand = bits & (HIDDEN_BIT - 1);
+	if (biased != 0)
+		*v = (DiyFp){ significand + HIDDEN_BIT, biased - EXPONENT_BIAS };
+	else
+		*v = (DiyFp){ significand, 1 - EXPONENT_BIAS };
+	*plus = normalize((DiyFp){ (v->f << 1) + 1, v->e - 1 });
+	// the gap below is half as wide at a power of two, unless the double
+	// below is subnormal
+	if (v->f == HIDDEN_BIT && biased > 1)
+		*minus = (DiyFp){ (v->f << 2) - 1, v->e - 2 };
+	else
+		*minus = (DiyFp){ (v->f << 1) - 1, v->e - 1 };
+	minus->f <<= minus->e - plus->e;
+	minus->e = plus->e;
+	*v = normalize(*v);
+}
+static DiyFp cachedPower(int e, int* k){
+	// a power of ten that brings the product's exponent into [-60, -32]
+	double dk = (-61 - e) * 0.30102999566398114 + 347;
+	int index = (int)dk;
+	if (dk - index > 0.0)
+		index++;
+	index = (index >> 3) + 1;
+	*k = -(-348 + index * 8);
+	return cachedPowers[index];
+}
+static bool roundWeed(char* digits, int length, uint64_t distance, uint64_t unsafe,
+		uint64_t rest, uint64_t tenKappa, uint64_t unit){
+	// steps the last digit down while that gets closer to the exact value.
+	// every bound is off by up to unit, false when that leaves it open
+	// whether the digits are the closest ones or read back at all
+	uint64_t small = distance - unit, big = distance + unit;
+	while (rest < small && unsafe - rest >= tenKappa &&
+			(rest + tenKappa < small || small - rest >= rest + tenKappa - small)){
+		digits[length - 1]--;
+		rest += tenKappa;
+	}
+	if (rest < big && unsafe - rest >= tenKappa &&
+			(rest + tenKappa < big || big - rest > rest + tenKappa - big))
+		return false;
+	return 2 * unit <= rest && rest <= unsafe - 4 * unit;
+}
+static int countDigits(uint32_t n){
+	int count = 1;
+	while (count < 10 && n >= powersOf10[count])
+		count++;
+	return count;
+}
+static int generateDigits(DiyFp w, DiyFp low, DiyFp high, char* digits, int* k){
+	// digits of the shortest number in (low, high) closest to w, 0 when the
+	// rounding errors of the scaled boundaries leave that open
+	uint64_t unit = 1;
+	DiyFp tooLow = { low.f - unit, low.e }, tooHigh = { high.f + unit, high.e };
+	uint64_t unsafe = tooHigh.f - tooLow.f;
+	DiyFp one = { (uint64_t)1 << -w.e, w.e };
+	uint32_t integral = (uint32_t)(tooHigh.f >> -one.e);
+	uint64_t fraction = tooHigh.f & (one.f - 1);
+	int kappa = countDigits(integral);
+	int length = 0;
+	while (kappa > 0){
+		uint32_t digit = integral / powersOf10[kappa - 1];
+		integral %= powersOf10[kappa - 1];
+		if (digit != 0 || length != 0)
+			digits[length++] = (char)('0' + digit);
+		kappa--;
+		uint64_t rest = ((uint64_t)integral << -one.e) + fraction;
+		if (rest < unsafe){
+			*k += kappa;
+			return roundWeed(digits, length, tooHigh.f - w.f, unsafe, rest,
+				(uint64_t)powersOf10[kappa] << -one.e, unit) ? length : 0;
+		}
+	}
+	for (;;){
+		fraction *= 10;
+		unit *= 10;
+		unsafe *= 10;
+		char digit = (char)(fraction >> -one.e);
+		if (digit != 0 || length != 0)
+			digits[length++] = (char)('0' + digit);
+		fraction &= one.f - 1;
+		kappa--;
+		if (fraction < unsafe){
+			*k += kappa;
+			return roundWeed(digits, length, (tooHigh.f - w.f) * unit, unsafe, fraction,
+				one.f, unit) ? length : 0;
+		}
+	}
+}
+static int formatInteger(uint64_t n, char* out){
+	char digits[20];
+	int length = 0;
+	do {
+		digits[length++] = (char)('0' + n % 10);
+		n /= 10;
+	} while (n != 0);
+	for (int i = 0; i < length; i++)
+		out[i] = digits[length - 1 - i];
+	return length;
+}
+static bool readsBack(uint64_t n, int k, double value){
+	char text[48];
+	snprintf(text, sizeof(text), "%llue%d", (unsigned long long)n, k);
+	return strtod(text, NULL) == value;
+}
+static bool nearestDigits(double value, int precision, uint64_t* n, int* k){
+	// the precision digits printf rounds to, or one of their two neighbours,
+	// are the only ones of that length that can read back
+	char text[32];
+	snprintf(text, sizeof(text), "%.*e", precision - 1, value); // d.ddde+x
+	uint64_t nearest = (uint64_t)(text[0] - '0');
+	const char* c = text + (precision > 1 ? 2 : 1);
+	for (int i = 1; i < precision; i++)
+		nearest = nearest * 10 + (uint64_t)(*c++ - '0');
+	*k = atoi(c + 1) - (precision - 1);
+	for (int step = 0; step < 3; step++){
+		*n = nearest + (step == 2) - (step == 1);
+		if (readsBack(*n, *k, value))
+			return true;
+	}
+	return false;
+}
+static int exactDigits(double value, char* digits, int* k){
+	// slow but exact. when some digits read back so do all longer ones, so
+	// the shortest length is found by bisection, 17 always reads back
+	int shortest = 17, tooShort = 0;
+	uint64_t n, found = 0;
+	int exponent;
+	while (shortest - tooShort > 1){
+		int precision = (shortest + tooShort) / 2;
+		if (nearestDigits(value, precision, &n, &exponent)){
+			shortest = precision;
+			found = n;
+			*k = exponent;
+		} else {
+			tooShort = precision;
+		}
+	}
+	if (shortest == 17)
+		nearestDigits(value, shortest, &found, k);
+	n = found;
+	while (n % 10 == 0){
+		n /= 10;
+		(*k)++;
+	}
+	return formatInteger(n, digits);
+}
+static int writeExponent(int exponent, char* out){
+	int length = 0;
+	out[length++] = 'e';
+	out[length++] = exponent < 0 ? '-' : '+';
+	if (exponent < 0)
+		exponent = -exponent;
+	if (exponent >= 100)
+		out[length++] = (char)('0' + exponent / 100);
+	if (exponent >= 10)
+		out[length++] = (char)('0' + exponent / 10 % 10);
+	out[length++] = (char)('0' + exponent % 10);
+	return length;
+}
+static int placePoint(char* digits, int length, int k){
+	// digits * 10^k, written out the way javascript does
+	int point = length + k; // digits before the decimal point
+	if (k >= 0 && point <= 21){
+		memset(digits + length, '0', k); // 1234e2 -> 123400
+		return point;
+	}
+	if (point > 0 && point <= 21){
+		memmove(digits + point + 1, digits + point, length - point); // 1234e-2 -> 12.34
+		digits[point] = '.';
+		return length + 1;
+	}
+	if (point > -6 && point <= 0){
+		int shift = 2 - point; // 1234e-6 -> 0.001234
+		memmove(digits + shift, digits, length);
+		digits[0] = '0';
+		digits[1] = '.';
+		memset(digits + 2, '0', shift - 2);
+		return length + shift;
+	}
+	if (length == 1) // 1e30
+		return 1 + writeExponent(point - 1, digits + 1);
+	memmove(digits + 2, digits + 1, length - 1); // 1234e30 -> 1.234e+33
+	digits[1] = '.';
+	return length + 1 + writeExponent(point - 1, digits + length + 1);
+}
+int formatNumber(double value, char* out){
+	int length = 0;
+	if (value != value){
+		memcpy(out, "nan", 4);
+		return 3;
+	}
+	if (signbit(value)){
+		out[length++] = '-';
+		value = -value;
+	}
+	if (value == 0){
+		out[length++] = '0';
+	} else if (isinf(value)){
+		memcpy(out + length, "inf", 3);
+		length += 3;
+	} else if (value < 9007199254740992.0 && value == (double)(uint64_t)value){
+		// integers are most of what scripts print, and exact
+		length += formatInteger((uint64_t)value, out + length);
+	} else {
+		DiyFp v, minus, plus;
+		boundaries(value, &v, &minus, &plus);
+		int k;
+		DiyFp power = cachedPower(plus.e, &k);
+		int digits = generateDigits(multiply(v, power), multiply(minus, power),
+			multiply(plus, power), out + length, &k);
+		if (digits == 0)
+			digits = exactDigits(value, out + length, &k);
+		length += placePoint(out + length, digits, k);
+	}
+	out[length] = '\0';
+	return length;
+}
@@ -0,0 +1,29 @@
+#ifndef clox_output_h
+#define clox_output_h
+#include "common.h"
+#include "value.h"
+
+// what scripts print goes through one buffer of its own instead of stdio.
+// it outlives every vm and is flushed at exit, anything else writing to
+// stdout calls flushOutput() first so the two stay in order
+typedef enum {
+	FLUSH_LINE, // after every print, the default on a terminal
+	FLUSH_SIZE, // when the buffer is full, the default otherwise
+	FLUSH_EXIT // only at exit or flushOutput(), the buffer grows until then
+} FlushPolicy;
+
+#ifndef OUTPUT_BUFFER
+#define OUTPUT_BUFFER (64 * 1024)
+#endif
+#define NUMBER_CHARS 32 // the longest formatNumber() result and the terminator
+
+void setFlushPolicy(FlushPolicy);
+void setDirectOutput(bool); // skip stdio, the buffer goes to write(2) on fd 1
+void writeOutput(const char*, int);
+void writeText(const char*);
+void printLine(Value); // the print statement
+void flushOutput();
+// the shortest digits that read back as the same double (grisu3), in
+// plain notation from 1e-6 up to 1e21 and with an exponent outside that
+int formatNumber(double, char*);
+#endif
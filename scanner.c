@@ -3,11 +3,6 @@
 #include "common.h"
 #include "scanner.h"
 
-typedef struct {
-	const char* start;
-	const char* current;
-	int line;
-} Scanner;
 Scanner scanner;
 
 void initScanner(const char* source){
@@ -122,22 +117,46 @@ static TokenType identifierType(){
 	switch (scanner.start[0]) {
 		case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
 		case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
+		case 'd': return checkKeyword(1, 5, "elete", TOKEN_DELETE);
 		case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
 		case 'f':
 			if (scanner.current - scanner.start > 1) {
 				switch (scanner.start[1]) {
 					case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
+					case 'i': return checkKeyword(2, 3, "ber", TOKEN_FIBER);
 					case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
 					case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
 				}
 			}
 			break;		
-		case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
+		case 'i':
+			if (scanner.current - scanner.start > 1) {
+				switch (scanner.start[1]) {
+					case 'f': return checkKeyword(2, 0, "", TOKEN_IF);
+					case 'm': return checkKeyword(2, 4, "port", TOKEN_IMPORT);
+					case 'n': return checkKeyword(2, 0, "", TOKEN_IN);
+				}
+			}
+			break;
 		case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
 		case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
 		case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-		case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-		case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
+		case 'r':
+			if (scanner.current - scanner.start > 2 && scanner.start[1] == 'e') {
+				switch (scanner.start[2]) {
+					case 's': return checkKeyword(3, 3, "ume", TOKEN_RESUME);
+					case 't': return checkKeyword(3, 3, "urn", TOKEN_RETURN);
+				}
+			}
+			break;
+		case 's':
+			if (scanner.current - scanner.start > 1) {
+				switch (scanner.start[1]) {
+					case 'p': return checkKeyword(2, 3, "awn", TOKEN_SPAWN);
+					case 'u': return checkKeyword(2, 3, "per", TOKEN_SUPER);
+				}
+			}
+			break;
 		case 't':
 			if (scanner.current - scanner.start > 1) {
 				switch (scanner.start[1]) {
@@ -148,6 +167,7 @@ static TokenType identifierType(){
 			break;
 		case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
 		case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+		case 'y': return checkKeyword(1, 4, "ield", TOKEN_YIELD);
 	}
 	return TOKEN_IDENTIFIER;
 }
@@ -171,8 +191,11 @@ Token scanToken(){
 		case ')': return makeToken(TOKEN_RIGHT_PAREN);
 		case '{': return makeToken(TOKEN_LEFT_BRACE);
 		case '}': return makeToken(TOKEN_RIGHT_BRACE);
+		case '[': return makeToken(TOKEN_LEFT_BRACKET);
+		case ']': return makeToken(TOKEN_RIGHT_BRACKET);
 		case ';': return makeToken(TOKEN_SEMICOLON);
 		case ',': return makeToken(TOKEN_COMMA);
+		case ':': return makeToken(TOKEN_COLON);
 		case '.': return makeToken(TOKEN_DOT);
 		case '-': return makeToken(TOKEN_MINUS);
 		case '+': return makeToken(TOKEN_PLUS);
@@ -195,3 +218,10 @@ Token scanToken(){
 	}
 	return errorToken("Unexpected character.");
 }
+int countTokens(const char* source){
+	initScanner(source);
+	int count = 0;
+	while (scanToken().type != TOKEN_EOF)
+		count++;
+	return count;
+}
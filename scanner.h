@@ -4,7 +4,8 @@ typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   // One or two character tokens.
   TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -14,10 +15,10 @@ typedef enum {
   // Literals.
   TOKEN_IDENTIFIER, TOKEN_STRING, TOKEN_STRING_COMPLEX, TOKEN_NUMBER,
   // Keywords.
-  TOKEN_AND, TOKEN_CLASS, TOKEN_ELSE, TOKEN_FALSE,
-  TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
-  TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
-  TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+  TOKEN_AND, TOKEN_CLASS, TOKEN_DELETE, TOKEN_ELSE, TOKEN_FALSE, TOKEN_FIBER,
+  TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_IMPORT, TOKEN_IN, TOKEN_NIL, TOKEN_OR,
+  TOKEN_PRINT, TOKEN_RESUME, TOKEN_RETURN, TOKEN_SPAWN, TOKEN_SUPER, TOKEN_THIS,
+  TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE, TOKEN_YIELD,
   TOKEN_ERROR,
   TOKEN_EOF
 } TokenType;
@@ -27,6 +28,13 @@ typedef struct {
 	int length;
 	int line;
 } Token;
+typedef struct {
+	const char* start;
+	const char* current;
+	int line;
+} Scanner;
+extern Scanner scanner; // plain struct so the compiler can rewind it
 Token scanToken();
+int countTokens(const char*); // scans the whole source, for the stats
 void initScanner(const char*);
 #endif
\ No newline at end of file
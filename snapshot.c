@@ -0,0 +1,412 @@
+#include "snapshot.h"
+#include "memory.h"
+#include "jit.h"
+
+typedef struct {
+	Entry* entries; // object pointers are image offsets
+	int count;
+	int capacity;
+	bool identity; // has keys hashed by address, every clone rehashes them
+	size_t owner; // offset of the table in the image, for tables of objects
+} TableImage;
+
+struct _Snapshot {
+	uint8_t* image; // every object but the main fiber, pointers as offsets
+	size_t size;
+	size_t first; // head of the object list
+	size_t* relocations; // offsets of the pointers in the image
+	int relocationCount;
+	int relocationCapacity;
+	uint8_t* text; // bytecode, line info and captures, shared by every clone
+	TableImage strings;
+	TableImage globals;
+	TableImage modules;
+	TableImage* tables; // of maps, classes and shapes
+	int tableCount;
+	int tableCapacity;
+	size_t objects[OBJ_TYPE_COUNT];
+	size_t typeBytes[OBJ_TYPE_COUNT];
+};
+
+static PSnapshot taking; // the snapshot being taken
+static Table offsets; // object -> offset in the image, while it is taken
+
+static void* grow(void* pointer, size_t size){
+	// a snapshot outlives the vm it was taken from, so none of it is
+	// counted against a vm
+	void* block = realloc(pointer, size == 0 ? 1 : size);
+	if (block == NULL){
+		fprintf(stderr, "Out of memory.\n");
+		exit(1);
+	}
+	return block;
+}
+static size_t align(size_t size){
+	return (size + SIZE_CLASS_STEP - 1) / SIZE_CLASS_STEP * SIZE_CLASS_STEP;
+}
+static size_t ownedSize(PObj obj){
+	// what the object owns is laid out right behind it
+	switch (obj->type){
+		case OBJ_STRING: {
+			PObjString string = (PObjString)obj;
+			return string->chars == INLINE_CHARS(string) ? 0 : align(string->length + 1);
+		}
+		case OBJ_FUNCTION: {
+			PChunk chunk = &((PObjFunction)obj)->chunk;
+			return align(sizeof(Value) * chunk->constants.count) + align(sizeof(LoopCounter) * chunk->loopCount) +
+				align(sizeof(InlineCache) * chunk->cacheCount);
+		}
+		case OBJ_ARRAY:
+			return align(sizeof(double) * ((PObjArray)obj)->count);
+		case OBJ_INSTANCE:
+			return align(sizeof(Value) * ((PObjInstance)obj)->shape->count);
+		default:
+			return 0;
+	}
+}
+static size_t textSize(PObj obj){
+	if (obj->type != OBJ_FUNCTION || ((PObjFunction)obj)->chunk.borrowed)
+		return 0; // module code is in the process wide cache already
+	PChunk chunk = &((PObjFunction)obj)->chunk;
+	return align(chunk->count) + align(sizeof(LineStart) * chunk->lineInfo.count) +
+		align(sizeof(Capture) * ((PObjFunction)obj)->captureCount);
+}
+static size_t offsetOf(PObj obj){
+	Value key = OBJ_VAL(obj);
+	Value offset;
+	tableGet(&offsets, &key, &offset);
+	return (size_t)AS_NUMBER(offset);
+}
+static void relocate(size_t at){
+	if (taking->relocationCount == taking->relocationCapacity){
+		taking->relocationCapacity = GROW_CAPACITY(taking->relocationCapacity);
+		taking->relocations = grow(taking->relocations, sizeof(size_t) * taking->relocationCapacity);
+	}
+	taking->relocations[taking->relocationCount++] = at;
+}
+static void pointTo(size_t at, size_t target){
+	uintptr_t pointer = target;
+	memcpy(taking->image + at, &pointer, sizeof(pointer));
+	relocate(at);
+}
+static void freezePointer(size_t at, void* target){
+	// the copy still holds the live pointer, NULL stays as it is
+	if (target != NULL)
+		pointTo(at, offsetOf((PObj)target));
+}
+static Value frozenValue(Value value){
+	if (IS_OBJ(value))
+		value.as.obj = (PObj)(uintptr_t)offsetOf(AS_OBJ(value));
+	return value;
+}
+static void putValue(size_t at, Value value){
+	value = frozenValue(value);
+	memcpy(taking->image + at, &value, sizeof(Value));
+	if (IS_OBJ(value))
+		relocate(at + offsetof(Value, as.obj));
+}
+static void freezeTable(TableImage* frozen, PTable table, size_t owner){
+	frozen->count = table->count;
+	frozen->capacity = table->capacity;
+	frozen->identity = false;
+	frozen->owner = owner;
+	frozen->entries = table->capacity == 0 ? NULL : grow(NULL, sizeof(Entry) * table->capacity);
+	for (int i = 0; i < table->capacity; i++){
+		Entry entry = table->entries[i];
+		if (IS_OBJ(entry.key) && !IS_STRING(entry.key))
+			frozen->identity = true;
+		entry.key = frozenValue(entry.key);
+		entry.value = frozenValue(entry.value);
+		frozen->entries[i] = entry;
+	}
+}
+static void freezeOwnedTable(PTable table, size_t at){
+	if (taking->tableCount == taking->tableCapacity){
+		taking->tableCapacity = GROW_CAPACITY(taking->tableCapacity);
+		taking->tables = grow(taking->tables, sizeof(TableImage) * taking->tableCapacity);
+	}
+	freezeTable(&taking->tables[taking->tableCount++], table, at);
+	initTable((PTable)(taking->image + at)); // the entries are copied out for every clone
+}
+static void freezeCaches(PChunk chunk, size_t at){
+	// warm caches stay warm, everything they point at is in the image
+	memcpy(taking->image + at, chunk->caches, sizeof(InlineCache) * chunk->cacheCount);
+	for (int i = 0; i < chunk->cacheCount; i++){
+		for (int j = 0; j < chunk->caches[i].count; j++){
+			CacheWay* way = &chunk->caches[i].ways[j];
+			size_t wayAt = at + sizeof(InlineCache) * i + offsetof(InlineCache, ways) + sizeof(CacheWay) * j;
+			freezePointer(wayAt + offsetof(CacheWay, shape), way->shape);
+			freezePointer(wayAt + offsetof(CacheWay, next), way->next);
+			freezePointer(wayAt + offsetof(CacheWay, method), way->method);
+		}
+	}
+}
+static size_t freezeFunction(PObjFunction function, size_t at, size_t owned, size_t text){
+	PObjFunction copy = (PObjFunction)(taking->image + at);
+	PChunk chunk = &copy->chunk;
+	freezePointer(at + offsetof(ObjFunction, name), function->name);
+	freezePointer(at + offsetof(ObjFunction, owner), function->owner);
+	if (!chunk->borrowed){
+		chunk->code = taking->text + text;
+		memcpy(chunk->code, function->chunk.code, chunk->count);
+		text += align(chunk->count);
+		chunk->lineInfo.lines = (LineStart*)(taking->text + text);
+		memcpy(chunk->lineInfo.lines, function->chunk.lineInfo.lines, sizeof(LineStart) * chunk->lineInfo.count);
+		text += align(sizeof(LineStart) * chunk->lineInfo.count);
+		copy->captures = NULL;
+		if (copy->captureCount > 0){
+			copy->captures = (Capture*)(taking->text + text);
+			memcpy(copy->captures, function->captures, sizeof(Capture) * copy->captureCount);
+			text += align(sizeof(Capture) * copy->captureCount);
+		}
+		chunk->borrowed = true;
+	}
+	copy->captureCapacity = copy->captureCount;
+	chunk->capacity = chunk->count;
+	chunk->lineInfo.capacity = chunk->lineInfo.count;
+	chunk->jit = NULL;
+	chunk->jitFailed = false;
+	// whatever got hot in the warm vm is compiled again on its first call
+	// or back edge in a clone, native code is not shared
+	if (chunk->calls >= JIT_THRESHOLD)
+		chunk->calls = JIT_THRESHOLD - 1;
+	chunk->constants.capacity = chunk->constants.count;
+	chunk->constants.values = NULL;
+	if (chunk->constants.count > 0){
+		pointTo(at + offsetof(ObjFunction, chunk.constants.values), owned);
+		for (int i = 0; i < chunk->constants.count; i++)
+			putValue(owned + sizeof(Value) * i, function->chunk.constants.values[i]);
+		owned += align(sizeof(Value) * chunk->constants.count);
+	}
+	chunk->loopCapacity = chunk->loopCount;
+	chunk->loops = NULL;
+	if (chunk->loopCount > 0){
+		pointTo(at + offsetof(ObjFunction, chunk.loops), owned);
+		LoopCounter* loops = (LoopCounter*)(taking->image + owned);
+		memcpy(loops, function->chunk.loops, sizeof(LoopCounter) * chunk->loopCount);
+		for (int i = 0; i < chunk->loopCount; i++)
+			if (loops[i].hits >= JIT_THRESHOLD)
+				loops[i].hits = JIT_THRESHOLD - 1;
+		owned += align(sizeof(LoopCounter) * chunk->loopCount);
+	}
+	chunk->cacheCapacity = chunk->cacheCount;
+	chunk->caches = NULL;
+	if (chunk->cacheCount > 0){
+		pointTo(at + offsetof(ObjFunction, chunk.caches), owned);
+		freezeCaches(&function->chunk, owned);
+	}
+	return text;
+}
+static size_t freezeObject(PObj obj, size_t at, size_t text){
+	size_t size = objectSize(obj);
+	memcpy(taking->image + at, obj, size);
+	((PObj)(taking->image + at))->next = NULL;
+	taking->objects[obj->type]++;
+	taking->typeBytes[obj->type] += size;
+	size_t owned = at + align(size);
+	switch (obj->type){
+		case OBJ_STRING: {
+			// a borrowed string brings its characters, the source stays behind
+			PObjString string = (PObjString)obj;
+			if (string->chars == INLINE_CHARS(string)){
+				pointTo(at + offsetof(ObjString, chars), at + sizeof(ObjString));
+				break;
+			}
+			pointTo(at + offsetof(ObjString, chars), owned);
+			memcpy(taking->image + owned, string->chars, string->length);
+			((PObjString)(taking->image + at))->borrowed = false;
+			break;
+		}
+		case OBJ_FUNCTION:
+			return freezeFunction((PObjFunction)obj, at, owned, text);
+		case OBJ_FIBER: {
+			// only finished ones get here, nothing in them is needed again
+			PObjFiber copy = (PObjFiber)(taking->image + at);
+			copy->frames = NULL;
+			copy->frameCount = copy->frameCapacity = 0;
+			copy->stack = copy->stackTop = NULL;
+			copy->stackCapacity = 0;
+			copy->resumer = copy->next = NULL;
+			copy->openUpvalues = NULL;
+			break;
+		}
+		case OBJ_ARRAY: {
+			PObjArray array = (PObjArray)obj;
+			((PObjArray)(taking->image + at))->values = NULL;
+			if (array->count > 0){
+				pointTo(at + offsetof(ObjArray, values), owned);
+				memcpy(taking->image + owned, array->values, sizeof(double) * array->count);
+			}
+			break;
+		}
+		case OBJ_MAP:
+			freezeOwnedTable(&((PObjMap)obj)->table, at + offsetof(ObjMap, table));
+			break;
+		case OBJ_CLASS: {
+			PObjClass klass = (PObjClass)obj;
+			freezePointer(at + offsetof(ObjClass, name), klass->name);
+			freezePointer(at + offsetof(ObjClass, superclass), klass->superclass);
+			freezePointer(at + offsetof(ObjClass, initializer), klass->initializer);
+			freezePointer(at + offsetof(ObjClass, shape), klass->shape);
+			freezeOwnedTable(&klass->methods, at + offsetof(ObjClass, methods));
+			break;
+		}
+		case OBJ_SHAPE: {
+			PObjShape shape = (PObjShape)obj;
+			freezePointer(at + offsetof(ObjShape, klass), shape->klass);
+			freezePointer(at + offsetof(ObjShape, parent), shape->parent);
+			putValue(at + offsetof(ObjShape, name), shape->name);
+			freezeOwnedTable(&shape->transitions, at + offsetof(ObjShape, transitions));
+			break;
+		}
+		case OBJ_INSTANCE: {
+			// fields inline, no spare capacity
+			PObjInstance instance = (PObjInstance)obj;
+			PObjInstance copy = (PObjInstance)(taking->image + at);
+			freezePointer(at + offsetof(ObjInstance, shape), instance->shape);
+			copy->fields = NULL;
+			copy->capacity = instance->shape->count;
+			if (copy->capacity > 0){
+				pointTo(at + offsetof(ObjInstance, fields), owned);
+				for (int i = 0; i < copy->capacity; i++)
+					putValue(owned + sizeof(Value) * i, instance->fields[i]);
+			}
+			break;
+		}
+		case OBJ_BOUND_METHOD: {
+			PObjBoundMethod bound = (PObjBoundMethod)obj;
+			putValue(at + offsetof(ObjBoundMethod, receiver), bound->receiver);
+			freezePointer(at + offsetof(ObjBoundMethod, method), bound->method);
+			break;
+		}
+		case OBJ_CLOSURE: {
+			PObjClosure closure = (PObjClosure)obj;
+			freezePointer(at + offsetof(ObjClosure, function), closure->function);
+			for (int i = 0; i < closure->upvalueCount; i++)
+				freezePointer(at + offsetof(ObjClosure, upvalues) + sizeof(PObjUpvalue) * i, closure->upvalues[i]);
+			break;
+		}
+		case OBJ_UPVALUE: {
+			// an idle vm has closed every upvalue, the value comes along
+			PObjUpvalue upvalue = (PObjUpvalue)obj;
+			pointTo(at + offsetof(ObjUpvalue, location), at + offsetof(ObjUpvalue, closed));
+			putValue(at + offsetof(ObjUpvalue, closed), upvalue->closed);
+			((PObjUpvalue)(taking->image + at))->next = NULL;
+			break;
+		}
+		default:
+			break;
+	}
+	return text;
+}
+static bool canSnapshot(){
+	if (vm.fiber != vm.mainFiber || vm.frameCount != 0 || vm.ready != NULL){
+		fprintf(stderr, "Can only snapshot an idle VM.\n");
+		return false;
+	}
+	for (PObj obj = vm.objects; obj != NULL; obj = obj->next)
+		if (obj->type == OBJ_FIBER && obj != (PObj)vm.mainFiber && ((PObjFiber)obj)->state != FIBER_DONE){
+			fprintf(stderr, "Can't snapshot a VM with unfinished fibers.\n");
+			return false;
+		}
+	return true;
+}
+PSnapshot snapshotVM(){
+	if (!canSnapshot())
+		return NULL;
+	taking = grow(NULL, sizeof(Snapshot));
+	memset(taking, 0, sizeof(Snapshot));
+	// the main fiber is left out, every clone starts one of its own
+	initTable(&offsets);
+	size_t size = 0, text = 0;
+	for (PObj obj = vm.objects; obj != NULL; obj = obj->next){
+		if (obj == (PObj)vm.mainFiber)
+			continue;
+		Value key = OBJ_VAL(obj);
+		Value offset = NUMBER_VAL((double)size);
+		tableSet(&offsets, &key, &offset);
+		size += align(objectSize(obj)) + ownedSize(obj);
+		text += textSize(obj);
+	}
+	taking->size = size;
+	taking->image = grow(NULL, size);
+	memset(taking->image, 0, size); // padding too, so images compare equal
+	taking->text = grow(NULL, text);
+	size_t previous = 0;
+	bool first = true;
+	text = 0;
+	for (PObj obj = vm.objects; obj != NULL; obj = obj->next){
+		if (obj == (PObj)vm.mainFiber)
+			continue;
+		size_t at = offsetOf(obj);
+		text = freezeObject(obj, at, text);
+		if (first)
+			taking->first = at;
+		else
+			pointTo(previous + offsetof(Obj, next), at);
+		previous = at;
+		first = false;
+	}
+	freezeTable(&taking->strings, &vm.strings, 0);
+	freezeTable(&taking->globals, &vm.globals, 0);
+	freezeTable(&taking->modules, &vm.modules, 0);
+	freeTable(&offsets);
+	return taking;
+}
+static void thaw(PValue value, uintptr_t base){
+	if (IS_OBJ(*value))
+		value->as.obj = (PObj)((uintptr_t)value->as.obj + base);
+}
+static void restoreTable(PTable table, TableImage* frozen, uintptr_t base){
+	initTable(table);
+	if (frozen->capacity == 0)
+		return;
+	if (frozen->identity){
+		for (int i = 0; i < frozen->capacity; i++){
+			Entry entry = frozen->entries[i];
+			if (IS_NIL(entry.key))
+				continue;
+			thaw(&entry.key, base);
+			thaw(&entry.value, base);
+			tableSet(table, &entry.key, &entry.value);
+		}
+		return;
+	}
+	table->entries = ALLOCATE(Entry, frozen->capacity, MEM_TABLE);
+	memcpy(table->entries, frozen->entries, sizeof(Entry) * frozen->capacity);
+	table->count = frozen->count;
+	table->capacity = frozen->capacity;
+	for (int i = 0; i < table->capacity; i++){
+		thaw(&table->entries[i].key, base);
+		thaw(&table->entries[i].value, base);
+	}
+}
+void restoreImage(PSnapshot snapshot){
+	uint8_t* image = ALLOCATE(uint8_t, snapshot->size, MEM_OBJECTS);
+	memcpy(image, snapshot->image, snapshot->size);
+	uintptr_t base = (uintptr_t)image;
+	for (int i = 0; i < snapshot->relocationCount; i++)
+		*(uintptr_t*)(image + snapshot->relocations[i]) += base;
+	vm.image = image;
+	vm.imageSize = snapshot->size;
+	vm.objects = snapshot->size == 0 ? NULL : (PObj)(image + snapshot->first);
+	for (int i = 0; i < OBJ_TYPE_COUNT; i++)
+		countObjects((ObjType)i, snapshot->objects[i], snapshot->typeBytes[i]);
+	restoreTable(&vm.strings, &snapshot->strings, base);
+	restoreTable(&vm.globals, &snapshot->globals, base);
+	restoreTable(&vm.modules, &snapshot->modules, base);
+	for (int i = 0; i < snapshot->tableCount; i++)
+		restoreTable((PTable)(image + snapshot->tables[i].owner), &snapshot->tables[i], base);
+}
+void freeSnapshot(PSnapshot snapshot){
+	free(snapshot->image);
+	free(snapshot->relocations);
+	free(snapshot->text);
+	free(snapshot->strings.entries);
+	free(snapshot->globals.entries);
+	free(snapshot->modules.entries);
+	for (int i = 0; i < snapshot->tableCount; i++)
+		free(snapshot->tables[i].entries);
+	free(snapshot->tables);
+	free(snapshot);
+}
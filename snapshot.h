@@ -0,0 +1,18 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+#include "common.h"
+#include "vm.h"
+
+// a warm vm frozen into one relocatable heap image: every object laid out
+// back to back with its pointers stored as offsets, plus the list of where
+// those pointers are. a clone is one allocation, a memcpy and a pass over
+// that list. bytecode and line info are shared by every clone, the tables
+// are copied out because they grow. a snapshot lives outside every vm's
+// heap and has to outlive its clones
+typedef struct _Snapshot Snapshot, *PSnapshot;
+
+PSnapshot snapshotVM(); // of the current vm, which has to be idle. NULL when it is not
+void cloneVM(PSnapshot); // takes the place of initVM, freeVM as usual
+void freeSnapshot(PSnapshot);
+void restoreImage(PSnapshot); // the objects and tables of a clone, see cloneVM
+#endif
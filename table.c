@@ -12,9 +12,18 @@ void initTable(PTable table){
 	table->entries = NULL;
 }
 void freeTable(PTable table){
-	FREE_ARRAY(Entry, table->entries, table->capacity);
+	FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE);
 	initTable(table);
 }
+static inline bool sameKey(PValue a, PValue b){
+	// interned strings and other objects are equal exactly when they are
+	// the same object, no need to go through valuesEqual
+	if (a->type != b->type)
+		return false;
+	if (a->type == OBJ)
+		return a->as.obj == b->as.obj;
+	return valuesEqual(a, b);
+}
 PEntry findEntry(PEntry entries, int capc, PValue key){
 	PEntry entry;
 	PEntry tombstone = NULL;
@@ -31,7 +40,7 @@ PEntry findEntry(PEntry entries, int capc, PValue key){
 					tombstone = entry;
 			}
 			
-		} else if (valuesEqual(key,&entry->key)){
+		} else if (sameKey(key,&entry->key)){
 			return entry;
 		}
 		idx = (idx + 1) % capc;
@@ -40,7 +49,7 @@ PEntry findEntry(PEntry entries, int capc, PValue key){
 static void adjustCapacity(PTable table, int capc) {
 	// indexes are modulo capacity, so we need to do something more complicated 
 	// than just realloc when capacity changes 
-	Entry* entries = malloc(sizeof(Entry) * capc);
+	Entry* entries = ALLOCATE(Entry, capc, MEM_TABLE);
 	for (int i = 0; i < capc; i++) {
 		entries[i].key = NIL_VAL();
 		entries[i].value = NIL_VAL();
@@ -55,7 +64,7 @@ static void adjustCapacity(PTable table, int capc) {
 		dest->value = src->value;	
 		table->count++; 
 	}
-	free(table->entries);
+	FREE_ARRAY(Entry, table->entries, table->capacity, MEM_TABLE);
 	table->entries = entries;
 	table->capacity = capc;
 }
@@ -92,6 +101,20 @@ bool tableDelete(PTable table, PValue key){
 	entry->value = BOOL_VAL(true);
 	return true;
 }
+PEntry tableFind(PTable table, PValue key){
+	if (table->count == 0)
+		return NULL;
+	PEntry entry = findEntry(table->entries,table->capacity,key);
+	return IS_NIL(entry->key) ? NULL : entry;
+}
+PEntry tableNext(PTable table, PEntry entry){
+	// a straight walk over the entry array
+	PEntry end = table->entries + table->capacity;
+	for (entry = entry == NULL ? table->entries : entry + 1; entry < end; entry++)
+		if (!IS_NIL(entry->key))
+			return entry;
+	return NULL;
+}
 void tableCopy(PTable src, PTable dst){
 	for (int i = 0; i < src->capacity; i++){
 		PEntry entry = &src->entries[i];
@@ -23,6 +23,8 @@ void freeTable(PTable);
 bool tableSet(PTable,PValue,PValue);
 bool tableGet(PTable,PValue,PValue);
 bool tableDelete(PTable, PValue);
+PEntry tableFind(PTable, PValue); // NULL when the key is not there
+PEntry tableNext(PTable, PEntry); // live entries in slot order, start from NULL
 void tableCopy(PTable src, PTable dst);
 
 #endif
\ No newline at end of file
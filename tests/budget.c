@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 200809L // dup2
+
+#include <unistd.h>
+#include "output.h"
+#include "vm.h"
+
+// a host multiplexing scripts the way vm.h describes it: each tenant is
+// prepare()d in a VM of its own and swapVM()ed in around resume() with a
+// small budget. make budgettest builds and runs it, it fails when a tenant
+// yields at the wrong points or prints the wrong thing in between
+#define TENANTS 3
+#define MAX_STEPS 16
+
+typedef struct {
+	const char* source;
+	Budget budget;
+	// what each resume() prints, the last one returns INTERPRET_OK
+	const char* steps[MAX_STEPS];
+} Tenant;
+
+static const Tenant tenants[TENANTS] = {
+	// straight-line code is charged when the script frame starts
+	{ "print 1; print 2; print 3; print 4;", { 1, 0 },
+		{ "", "1\n2\n3\n4\n" } },
+	// and every call when it starts
+	{ "fun f(n){ print n; } f(1); f(2); f(3);", { 1, 0 },
+		{ "", "", "1\n", "2\n", "3\n" } },
+	// loops per iteration, the total stays the same however it is split
+	{ "var i = 0; while (i < 30) { i = i + 1; } print i;", { 100, 0 },
+		{ "", "", "30\n" } },
+};
+
+static FILE* capture;
+static long captured;
+
+static char* takeOutput(){
+	// what the scripts printed since the last call
+	static char text[256];
+	flushOutput();
+	fflush(stdout);
+	fseek(capture, 0, SEEK_END);
+	long end = ftell(capture);
+	fseek(capture, captured, SEEK_SET);
+	size_t length = fread(text, 1, (size_t)(end - captured), capture);
+	text[length] = '\0';
+	captured = end;
+	return text;
+}
+int main(){
+	capture = tmpfile();
+	if (capture == NULL || dup2(fileno(capture), STDOUT_FILENO) < 0){
+		perror("budget");
+		return 1;
+	}
+	static VM vms[TENANTS];
+	for (int i = 0; i < TENANTS; i++){
+		initVM();
+		if (prepare(tenants[i].source) != INTERPRET_OK){
+			fprintf(stderr, "tenant %d does not compile\n", i);
+			return 1;
+		}
+		swapVM(&vms[i]); // the fresh one takes its place for the next tenant
+	}
+	int step[TENANTS] = { 0 };
+	bool done[TENANTS] = { false };
+	int failures = 0, running = TENANTS;
+	while (running > 0){
+		// round robin, one budget each
+		for (int i = 0; i < TENANTS; i++){
+			if (done[i])
+				continue;
+			swapVM(&vms[i]);
+			InterpretResult result = resume(tenants[i].budget);
+			swapVM(&vms[i]);
+			const char* got = takeOutput();
+			const char* expected = tenants[i].steps[step[i]];
+			bool last = step[i] + 1 == MAX_STEPS || tenants[i].steps[step[i] + 1] == NULL;
+			InterpretResult want = last ? INTERPRET_OK : INTERPRET_YIELD;
+			if (expected == NULL || strcmp(got, expected) != 0 || result != want){
+				fprintf(stderr, "tenant %d, resume %d: got %d \"%s\", expected %d \"%s\"\n",
+					i, step[i] + 1, result, got, want, expected == NULL ? "" : expected);
+				failures++;
+				result = INTERPRET_OK; // no point in going on with it
+			}
+			step[i]++;
+			if (result != INTERPRET_YIELD){
+				done[i] = true;
+				running--;
+				swapVM(&vms[i]);
+				freeVM();
+				swapVM(&vms[i]);
+			}
+		}
+	}
+	fprintf(stderr, "%d tenants, %d failed resumes\n", TENANTS, failures);
+	return failures == 0 ? 0 : 1;
+}
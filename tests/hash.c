@@ -0,0 +1,116 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
+
+#include <math.h>
+#include <time.h>
+#include "value.h"
+
+// quality and speed of calcHash, next to the byte-wise fnv-1a it replaced.
+// make hashtest builds and runs it, it fails when the distribution or the
+// avalanche is off. the throughput is only reported
+#define KEYS (1 << 20) // sequential keys, into as many buckets
+#define AVALANCHE_KEYS 100000
+#define AVALANCHE_BYTES 16
+#define CHI_LIMIT 0.05 // chi2 / N of a random hash is 1 within about 0.003
+#define BIAS_LIMIT 0.05
+
+typedef uint32_t (*HashFn)(const void*, int);
+
+static uint32_t fnv1a(const void* key, int len){
+	// the old one, sign extension of char and all
+	const char* chars = (const char*)key;
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < len; i++){
+		hash ^= chars[i];
+		hash *= 16777619;
+	}
+	return hash;
+}
+static uint64_t state = 0x853c49e6748fea9bull;
+static uint64_t next(){
+	// xorshift64*, the keys are the same on every run
+	state ^= state >> 12;
+	state ^= state << 25;
+	state ^= state >> 27;
+	return state * 0x2545F4914F6CDD1Dull;
+}
+static double now(){
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+static double chiSquared(HashFn hash){
+	// "key0", "key1", ... as a table of the same capacity places them,
+	// divided by the bucket count
+	uint32_t* buckets = calloc(KEYS, sizeof(uint32_t));
+	char key[16];
+	for (int i = 0; i < KEYS; i++){
+		int length = snprintf(key, sizeof(key), "key%d", i);
+		buckets[hash(key, length) % KEYS]++;
+	}
+	double chi = 0;
+	for (int i = 0; i < KEYS; i++)
+		chi += ((double)buckets[i] - 1) * ((double)buckets[i] - 1);
+	free(buckets);
+	return chi / KEYS;
+}
+static double worstBias(HashFn hash){
+	// every input bit flipped against every output bit: a perfect hash
+	// flips each output bit half the time. bias is |2p - 1| of the worst pair
+	static uint32_t flips[AVALANCHE_BYTES * 8][32];
+	memset(flips, 0, sizeof(flips));
+	uint8_t key[AVALANCHE_BYTES];
+	for (int n = 0; n < AVALANCHE_KEYS; n++){
+		for (int i = 0; i < AVALANCHE_BYTES; i++)
+			key[i] = (uint8_t)next();
+		uint32_t base = hash(key, AVALANCHE_BYTES);
+		for (int bit = 0; bit < AVALANCHE_BYTES * 8; bit++){
+			key[bit / 8] ^= (uint8_t)(1 << bit % 8);
+			uint32_t changed = base ^ hash(key, AVALANCHE_BYTES);
+			key[bit / 8] ^= (uint8_t)(1 << bit % 8);
+			for (int out = 0; out < 32; out++)
+				flips[bit][out] += (changed >> out) & 1;
+		}
+	}
+	double worst = 0;
+	for (int bit = 0; bit < AVALANCHE_BYTES * 8; bit++)
+		for (int out = 0; out < 32; out++){
+			double bias = fabs(2.0 * flips[bit][out] / AVALANCHE_KEYS - 1);
+			if (bias > worst)
+				worst = bias;
+		}
+	return worst;
+}
+static double throughput(HashFn function, int length){
+	// GB/s over about 256 MB of keys that stay in cache. both are called
+	// through a pointer, the old one would be inlined here otherwise
+	HashFn volatile hash = function;
+	uint8_t* key = malloc(length);
+	for (int i = 0; i < length; i++)
+		key[i] = (uint8_t)next();
+	long rounds = (256l << 20) / length;
+	volatile uint32_t sink = 0;
+	double start = now();
+	for (long i = 0; i < rounds; i++){
+		key[0] = (uint8_t)i; // no hoisting it out of the loop
+		sink += hash(key, length);
+	}
+	double seconds = now() - start;
+	free(key);
+	return (double)rounds * length / seconds / 1e9;
+}
+int main(){
+	seedHash();
+	double chi = chiSquared(calcHash);
+	double bias = worstBias(calcHash);
+	printf("chi2/N of %d keys: %.3f (fnv-1a %.3f)\n", KEYS, chi, chiSquared(fnv1a));
+	printf("worst avalanche bias over %d byte keys: %.3f (fnv-1a %.3f)\n",
+		AVALANCHE_BYTES, bias, worstBias(fnv1a));
+	static const int lengths[] = { 16, 256, 64 * 1024 };
+	for (int i = 0; i < 3; i++)
+		printf("%d bytes: %.2f GB/s (fnv-1a %.2f)\n", lengths[i],
+			throughput(calcHash, lengths[i]), throughput(fnv1a, lengths[i]));
+	bool ok = fabs(chi - 1) <= CHI_LIMIT && bias <= BIAS_LIMIT;
+	if (!ok)
+		printf("hash quality out of bounds\n");
+	return ok ? 0 : 1;
+}
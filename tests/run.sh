@@ -0,0 +1,148 @@
+#!/bin/sh
+# runs every tests/*.lox four ways and compares stdout, stderr and the exit
+# code with its .expect file: the interpreter, the interpreter with --no-jit,
+# a build that jits every function on its first call, and the native program
+# --emit-c makes of it. programs --emit-c does not support skip that run.
+# without arguments the command line options and the repl are checked too,
+# by exit status and the shape of what they print
+#   RUNTIME="..." tests/run.sh [-u] [test.lox...]
+# -u writes what the interpreter does as the new expectation. make test
+# passes RUNTIME, the sources the native programs are linked with
+cd "$(dirname "$0")/.." || exit 1
+update=false
+if [ "$1" = "-u" ]; then
+	update=true
+	shift
+fi
+options=false
+if [ $# -eq 0 ]; then
+	options=true
+	set -- tests/*.lox
+fi
+work=$(mktemp -d) || exit 1
+trap 'rm -rf "$work"' EXIT
+
+# stdout, stderr and the exit status of a command as one text
+transcript(){
+	"$@" > "$work/stdout" 2> "$work/stderr"
+	status=$?
+	cat "$work/stdout"
+	echo "-- stderr"
+	cat "$work/stderr"
+	echo "-- exit $status"
+}
+native(){
+	./a.out --emit-c "$work/native.c" "$1" || return
+	if ! gcc -std=c99 -O2 -I. "$work/native.c" "$work"/runtime/*.o -pthread \
+			-o "$work/native" > "$work/cc" 2>&1; then
+		cat "$work/cc" >&2
+		return 1
+	fi
+	"$work/native"
+}
+
+if $update; then
+	for test in "$@"; do
+		transcript ./a.out "$test" > "${test%.lox}.expect"
+	done
+	exit 0
+fi
+
+echo "building the jit-everything interpreter and the runtime for --emit-c"
+gcc -std=c99 -DJIT_THRESHOLD=1 main.c $RUNTIME -pthread -o "$work/jit1" || exit 1
+mkdir "$work/runtime"
+for source in $RUNTIME; do
+	gcc -std=c99 -O2 -I. -c "$source" -o "$work/runtime/${source%.c}.o" || exit 1
+done
+
+passed=0
+failed=0
+skipped=0
+check(){ # test, mode, command...
+	test=$1
+	mode=$2
+	shift 2
+	transcript "$@" > "$work/got"
+	if [ "$mode" = "emit-c" ] && grep -q "not supported by --emit-c" "$work/got"; then
+		skipped=$((skipped + 1))
+	elif diff -u "${test%.lox}.expect" "$work/got" > "$work/diff"; then
+		passed=$((passed + 1))
+	else
+		echo "FAIL $test ($mode)"
+		cat "$work/diff"
+		failed=$((failed + 1))
+	fi
+}
+for test in "$@"; do
+	check "$test" interpreter ./a.out "$test"
+	check "$test" no-jit ./a.out --no-jit "$test"
+	check "$test" jit-threshold-1 "$work/jit1" "$test"
+	check "$test" emit-c native "$test"
+done
+
+option(){ # name, exit status, stdout pattern, stderr pattern, command...
+	name=$1
+	status=$2
+	out=$3
+	err=$4
+	shift 4
+	"$@" > "$work/stdout" 2> "$work/stderr"
+	got=$?
+	if [ $got -eq "$status" ] && { [ -z "$out" ] || grep -Eq "$out" "$work/stdout"; } &&
+			{ [ -z "$err" ] || grep -Eq "$err" "$work/stderr"; }; then
+		passed=$((passed + 1))
+	else
+		echo "FAIL $name: exit $got, expected $status, stdout /$out/, stderr /$err/"
+		head -n 5 "$work/stdout" "$work/stderr"
+		failed=$((failed + 1))
+	fi
+}
+if $options; then
+	option usage 64 '' '^Usage: clox' ./a.out --flush sometimes tests/basics.lox
+
+	# the ring is dumped on the runtime error, tracedump reads it back
+	gcc -std=c99 tracedump.c $RUNTIME -pthread -o "$work/tracedump" || exit 1
+	option trace 70 '' '^Operands must be numbers' ./a.out --trace "$work/trace.bin" tests/err_add.lox
+	option tracedump 0 '^script +\[line +2\] number +.0029 OP_ADD$' '' \
+		"$work/tracedump" "$work/trace.bin" tests/err_add.lox
+
+	option stats 0 '' '^\{"nanoseconds": \{"load": [0-9]+, .*"teardown": [0-9]+\},$' \
+		./a.out --stats=json tests/basics.lox
+	option stats-file 0 '"charged_instructions": [1-9]' '' \
+		sh -c './a.out --stats=json:"$1" tests/basics.lox > /dev/null && cat "$1"' sh "$work/stats.json"
+	# counters may be unavailable here, the stats say so either way
+	option counters 0 '' '"counters": \{' ./a.out --counters tests/basics.lox
+	option counters-opcodes 0 '' '"counters": \{' ./a.out --counters=opcodes tests/basics.lox
+
+	echo 'var big = array(1000000);' > "$work/big.lox"
+	option max-heap 70 '' 'heap limit of 1048576 bytes exceeded' ./a.out --max-heap 1m "$work/big.lox"
+	option memory-report 0 '' '^\{"limit": 0, "total": \{"live": 0, "peak": [1-9]' \
+		./a.out --memory-report - tests/basics.lox
+	# the report is written on error exits too
+	option memory-report-limit 70 '' '^\{"limit": 1048576, ' \
+		./a.out --max-heap 1m --memory-report - "$work/big.lox"
+
+	# every way of writing the output gives the same output
+	for flush in line size exit; do
+		check tests/strings.lox "flush $flush" ./a.out --flush $flush tests/strings.lox
+		check tests/err_add.lox "flush $flush" ./a.out --flush $flush tests/err_add.lox
+	done
+	check tests/strings.lox direct-write ./a.out --direct-write tests/strings.lox
+	check tests/strings.lox "direct-write, flush exit" ./a.out --direct-write --flush exit tests/strings.lox
+
+	mkdir "$work/modules"
+	printf 'fun twice(x){ return 2 * x; }\nprint "greet loaded";\n' > "$work/modules/greet.lox"
+	printf 'import "greet";\nimport "greet";\nprint twice(21);\n' > "$work/main.lox"
+	option module-path 0 '^42$' '' ./a.out --module-path "$work/none:$work/modules" "$work/main.lox"
+	option LOXPATH 0 '^greet loaded$' '' env LOXPATH="$work/modules" ./a.out "$work/main.lox"
+	option module-missing 70 '' "^Could not find module 'greet'" ./a.out "$work/main.lox"
+
+	# the session goes on after an error, and open brackets ask for more lines
+	printf 'var a = 1;\nprint a + nil;\nfun f(){\n  return a + 1;\n}\nprint f();\n' > "$work/repl.lox"
+	option repl 0 '\.\.\. \.\.\. > 2$' '^Operands must be numbers' ./a.out < "$work/repl.lox"
+	option repl-timing 0 '' '^	\[compiled in [0-9.]+ms, ran in [0-9.]+ms\]$' ./a.out < "$work/repl.lox"
+	printf 'print 1;\nexit\nprint 2;\n' > "$work/exit.lox"
+	option repl-exit 0 '^> 1$' '' ./a.out < "$work/exit.lox"
+fi
+echo "$passed passed, $failed failed, $skipped skipped by --emit-c"
+[ $failed -eq 0 ]
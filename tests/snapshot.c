@@ -0,0 +1,106 @@
+#define _POSIX_C_SOURCE 200809L // dup2
+
+#include <unistd.h>
+#include "output.h"
+#include "snapshot.h"
+
+// a host that warms one vm up with a prelude, snapshots it and serves
+// requests from clones of it. make snapshottest builds and runs it, it
+// fails when a clone prints anything but what a fresh run of prelude and
+// request would, or sees what an earlier clone did to its heap
+#define CLONES 8
+
+static const char* prelude =
+	"class Point {\n"
+	"  init(x, y) { this.x = x; this.y = y; }\n"
+	"  len2() { return this.x * this.x + this.y * this.y; }\n"
+	"}\n"
+	"fun makeCounter(){\n"
+	"  var n = 0;\n"
+	"  fun inc(){ n = n + 1; return n; }\n"
+	"  return inc;\n"
+	"}\n"
+	"var counter = makeCounter();\n"
+	"var origin = Point(3, 4);\n"
+	"var names = {\"a\": \"alpha\", \"b\": \"beta\"};\n"
+	"var squares = array(4);\n"
+	"for (var i = 0; i < 4; i = i + 1) squares[i] = i * i;\n"
+	"counter();\n";
+
+// every request changes what it finds, so a clone sharing anything with
+// the ones before it prints something else
+static const char* request =
+	"print counter();\n"
+	"print origin.len2();\n"
+	"origin.x = origin.x + 1;\n"
+	"print names[\"a\"] + names[\"b\"];\n"
+	"names[\"a\"] = \"changed\";\n"
+	"print sum(squares);\n"
+	"squares[0] = squares[0] + 100;\n"
+	"print Point(1, 2).len2();\n";
+static const char* expected = "2\n25\nalphabeta\n14\n5\n";
+
+static FILE* capture;
+static long captured;
+
+static char* takeOutput(){
+	// what the scripts printed since the last call
+	static char text[256];
+	flushOutput();
+	fflush(stdout);
+	fseek(capture, 0, SEEK_END);
+	long end = ftell(capture);
+	fseek(capture, captured, SEEK_SET);
+	size_t length = fread(text, 1, (size_t)(end - captured), capture);
+	text[length] = '\0';
+	captured = end;
+	return text;
+}
+static bool serve(int clone){
+	InterpretResult result = prepare(request);
+	if (result == INTERPRET_OK)
+		result = resume((Budget){ 0, 0 });
+	const char* got = takeOutput();
+	if (result == INTERPRET_OK && strcmp(got, expected) == 0)
+		return true;
+	fprintf(stderr, "clone %d: got %d \"%s\", expected \"%s\"\n", clone, result, got, expected);
+	return false;
+}
+int main(){
+	capture = tmpfile();
+	if (capture == NULL || dup2(fileno(capture), STDOUT_FILENO) < 0){
+		perror("snapshot");
+		return 1;
+	}
+	initVM();
+	if (prepare(prelude) != INTERPRET_OK || resume((Budget){ 0, 0 }) != INTERPRET_OK){
+		fprintf(stderr, "the prelude failed\n");
+		return 1;
+	}
+	PSnapshot snapshot = snapshotVM();
+	if (snapshot == NULL){
+		fprintf(stderr, "no snapshot of an idle vm\n");
+		return 1;
+	}
+	freeVM(); // the snapshot does not need the vm it came from
+	int failures = 0;
+	for (int i = 0; i < CLONES; i++){
+		cloneVM(snapshot);
+		failures += !serve(i);
+		freeVM();
+	}
+	// clones alive side by side don't share anything either
+	static VM other;
+	cloneVM(snapshot);
+	swapVM(&other);
+	cloneVM(snapshot);
+	failures += !serve(CLONES);
+	swapVM(&other);
+	failures += !serve(CLONES + 1);
+	freeVM();
+	swapVM(&other);
+	freeVM();
+	freeSnapshot(snapshot);
+	fprintf(stderr, "%d clones, %d failed\n", CLONES + 2, failures);
+	return failures == 0 ? 0 : 1;
+}
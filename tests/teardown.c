@@ -0,0 +1,97 @@
+#define _POSIX_C_SOURCE 200809L // dup2, clock_gettime
+
+#include <malloc.h>
+#include <time.h>
+#include <unistd.h>
+#include "memory.h"
+#include "output.h"
+#include "vm.h"
+
+// vms with large heaps torn down back to back, so the sweeper thread has a
+// queue to work through, then once more on the calling thread. make
+// teardowntest builds and runs it, it fails when a run prints the wrong
+// thing, a torn-down vm still counts memory, or finishTeardown() returns
+// before the heaps are back with malloc. the times are only reported
+#define ROUNDS 4
+#define LEAK_LIMIT (1 << 20) // bytes still in use after the last teardown
+
+// instances, strings, a map and a function hot enough to be jitted
+static const char* script =
+	"class Node { init(next, id){ this.next = next; this.id = id; this.tag = {\"id\": id}; } }\n"
+	"fun build(head, id){ return Node(head, id); }\n"
+	"var byId = {};\n"
+	"var head = nil;\n"
+	"for (var i = 0; i < 200000; i = i + 1){ head = build(head, i); byId[i] = head; }\n"
+	"var n = 0;\n"
+	"for (var node = head; node != nil; node = node.next) n = n + node.tag[\"id\"];\n"
+	"print n;\n"
+	"print len(byId);\n";
+static const char* expected = "19999900000\n200000\n";
+
+static FILE* capture;
+static long captured;
+
+static char* takeOutput(){
+	// what the script printed since the last call
+	static char text[256];
+	flushOutput();
+	fflush(stdout);
+	fseek(capture, 0, SEEK_END);
+	long end = ftell(capture);
+	fseek(capture, captured, SEEK_SET);
+	size_t length = fread(text, 1, (size_t)(end - captured), capture);
+	text[length] = '\0';
+	captured = end;
+	return text;
+}
+static double now(){
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return time.tv_sec + time.tv_nsec * 1e-9;
+}
+static bool runOnce(double* teardownMs){
+	initVM();
+	InterpretResult result = prepare(script);
+	if (result == INTERPRET_OK)
+		result = resume((Budget){ 0, 0 });
+	const char* got = takeOutput();
+	size_t peak = vm.memory.total.peak;
+	double start = now();
+	freeVM();
+	*teardownMs = (now() - start) * 1e3;
+	bool ok = result == INTERPRET_OK && strcmp(got, expected) == 0 && vm.memory.total.live == 0;
+	if (!ok)
+		fprintf(stderr, "got %d \"%s\", expected \"%s\", %zu bytes still counted\n",
+			result, got, expected, vm.memory.total.live);
+	else
+		fprintf(stderr, "%zu MB heap torn down in %.2fms\n", peak >> 20, *teardownMs);
+	return ok;
+}
+int main(){
+	capture = tmpfile();
+	if (capture == NULL || dup2(fileno(capture), STDOUT_FILENO) < 0){
+		perror("teardown");
+		return 1;
+	}
+	writeOutput("", 0); // the output buffer is allocated before the baseline
+	size_t baseline = mallinfo2().uordblks;
+	int failures = 0;
+	double background = 0, ms;
+	for (int i = 0; i < ROUNDS; i++){
+		failures += !runOnce(&ms);
+		background += ms;
+	}
+	double start = now();
+	finishTeardown();
+	fprintf(stderr, "waited %.2fms for the sweeper\n", (now() - start) * 1e3);
+	size_t inUse = mallinfo2().uordblks;
+	if (inUse > baseline + LEAK_LIMIT){
+		fprintf(stderr, "%zu bytes still in use after finishTeardown\n", inUse - baseline);
+		failures++;
+	}
+	setBackgroundTeardown(false);
+	failures += !runOnce(&ms);
+	fprintf(stderr, "teardown %.2fms on the sweeper, %.2fms on the calling thread\n",
+		background / ROUNDS, ms);
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,56 @@
+#define _POSIX_C_SOURCE 200809L // sigaction, pwrite
+
+#include "trace.h"
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+TraceRing* traceRing = NULL;
+
+static void onSignal(int signal){
+	(void)signal;
+	dumpTrace(); // only write(2) underneath, fine in a handler
+}
+bool startTrace(const char* path){
+	// the file is opened up front so a dump never has to allocate or open
+	int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0)
+		return false;
+	traceRing = calloc(1, sizeof(TraceRing)); // not the vm's, survives freeVM
+	if (traceRing == NULL){
+		close(fd);
+		return false;
+	}
+	memcpy(traceRing->header.magic, TRACE_MAGIC, sizeof(traceRing->header.magic));
+	traceRing->header.capacity = TRACE_ENTRIES;
+	traceRing->header.entrySize = sizeof(TraceEntry);
+	traceRing->fd = fd;
+	struct sigaction action;
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = onSignal;
+	sigemptyset(&action.sa_mask);
+	action.sa_flags = SA_RESTART;
+	sigaction(SIGUSR1, &action, NULL);
+	return true;
+}
+void dumpTrace(){
+	// overwrites the previous dump, the last one tells what happened
+	if (traceRing == NULL)
+		return;
+	size_t size = offsetof(TraceRing, fd);
+	const char* data = (const char*)&traceRing->header;
+	for (size_t done = 0; done < size;){
+		ssize_t n = pwrite(traceRing->fd, data + done, size - done, (off_t)done);
+		if (n <= 0)
+			return;
+		done += (size_t)n;
+	}
+}
+void stopTrace(){
+	if (traceRing == NULL)
+		return;
+	signal(SIGUSR1, SIG_DFL);
+	close(traceRing->fd);
+	free(traceRing);
+	traceRing = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef clox_trace_h
+#define clox_trace_h
+#include "common.h"
+#include "value.h"
+#include "object.h"
+
+// binary execution trace: while on, every instruction the interpreter runs
+// goes into a ring buffer that is written out on a runtime error or a
+// SIGUSR1. tracedump turns a dump back into text using the same source
+#ifndef TRACE_ENTRIES
+#define TRACE_ENTRIES 4096 // power of two
+#endif
+
+typedef struct {
+	uint32_t offset; // of the instruction in its chunk
+	uint16_t function; // ObjFunction.id, 0 is the script, see TRACE_NO_FUNCTION
+	uint8_t opcode;
+	uint8_t tag; // top of stack before the instruction, see TRACE_TAG
+} TraceEntry;
+
+typedef struct {
+	char magic[8]; // TRACE_MAGIC
+	uint32_t capacity; // entries in the ring
+	uint32_t entrySize;
+	uint64_t count; // ever recorded, entry i sits at i % capacity
+} TraceHeader;
+#define TRACE_MAGIC "LOXTRACE"
+
+typedef struct {
+	TraceHeader header; // the dump is the header followed by the ring
+	TraceEntry entries[TRACE_ENTRIES];
+	int fd;
+} TraceRing;
+
+extern TraceRing* traceRing; // NULL while tracing is off
+
+// value types first, objects after them by ObjType
+#define TRACE_TAG(value) \
+	((value).type == OBJ ? SHORT_STRING + 1 + AS_OBJ(value)->type : (value).type)
+// ids that do not fit into an entry are all recorded as this one
+#define TRACE_NO_FUNCTION UINT16_MAX
+// before the instruction at frame->ip runs
+#define TRACE_RECORD(frame, top) \
+	do { \
+	  TraceEntry* entry = &traceRing->entries[traceRing->header.count++ & (TRACE_ENTRIES - 1)]; \
+	  entry->offset = (uint32_t)((frame)->ip - (frame)->function->chunk.code); \
+	  entry->function = (frame)->function->id < TRACE_NO_FUNCTION ? \
+		(uint16_t)(frame)->function->id : TRACE_NO_FUNCTION; \
+	  entry->opcode = *(frame)->ip; \
+	  entry->tag = (uint8_t)TRACE_TAG(top); \
+	} while (false)
+
+bool startTrace(const char*);
+void dumpTrace();
+void stopTrace();
+#endif
@@ -0,0 +1,112 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "common.h"
+#include "chunk.h"
+#include "debug.h"
+#include "vm.h"
+#include "compiler.h"
+#include "trace.h"
+
+// decodes a dump written by clox --trace. the script is compiled again,
+// which gives the same functions with the same ids, and every entry is
+// checked against the bytecode it claims to be
+
+static PObjFunction functions[TRACE_NO_FUNCTION]; // by id, as the entries store it
+
+static void fail(const char* fmt, const char* path){
+	fprintf(stderr, fmt, path);
+	fputs("\n", stderr);
+	exit(74);
+}
+static char* readFile(const char* path, size_t* size){
+	FILE* file = fopen(path, "rb");
+	if (file == NULL)
+		fail("Could not open file \"%s\".", path);
+	fseek(file, 0L, SEEK_END);
+	*size = ftell(file);
+	rewind(file);
+	char* buffer = (char*)malloc(*size + 1);
+	if (buffer == NULL || fread(buffer, 1, *size, file) < *size)
+		fail("Could not read file \"%s\".", path);
+	buffer[*size] = '\0';
+	fclose(file);
+	return buffer;
+}
+static void collect(PObjFunction function){
+	if (function->id < TRACE_NO_FUNCTION) // the rest are traced without an id
+		functions[function->id] = function;
+	ValueArray* constants = &function->chunk.constants;
+	for (int i = 0; i < constants->count; i++)
+		if (IS_FUNCTION(constants->values[i]))
+			collect(AS_FUNCTION(constants->values[i]));
+}
+static const char* tagName(uint8_t tag){
+	switch (tag){
+		case BOOL: return "bool";
+		case NIL: return "nil";
+		case NUMBER: return "number";
+		case SHORT_STRING: return "string";
+	}
+	switch (tag - SHORT_STRING - 1){
+		case OBJ_STRING: return "string";
+		case OBJ_FUNCTION: return "function";
+		case OBJ_FIBER: return "fiber";
+		case OBJ_NATIVE: return "native";
+		case OBJ_ARRAY: return "array";
+		case OBJ_MAP: return "map";
+		case OBJ_CLASS: return "class";
+		case OBJ_INSTANCE: return "instance";
+		case OBJ_SHAPE: return "shape";
+		case OBJ_BOUND_METHOD: return "bound_method";
+		case OBJ_CLOSURE: return "closure";
+		case OBJ_UPVALUE: return "upvalue";
+	}
+	return "?";
+}
+int main(int argc, char* argv[]){
+	if (argc != 3){
+		fprintf(stderr, "Usage: tracedump trace.bin script.lox\n");
+		exit(64);
+	}
+	size_t size;
+	char* dump = readFile(argv[1], &size);
+	TraceHeader header;
+	if (size < sizeof(header))
+		fail("\"%s\" is not a trace.", argv[1]);
+	memcpy(&header, dump, sizeof(header));
+	if (memcmp(header.magic, TRACE_MAGIC, sizeof(header.magic)) != 0 ||
+		header.entrySize != sizeof(TraceEntry) || header.capacity == 0 ||
+		size < sizeof(header) + (size_t)header.capacity * sizeof(TraceEntry))
+		fail("\"%s\" is not a trace from this build.", argv[1]);
+	TraceEntry* entries = (TraceEntry*)(dump + sizeof(header));
+
+	char* source = readFile(argv[2], &size);
+	initVM();
+	PObjFunction script = compile(source);
+	if (script == NULL)
+		exit(65);
+	collect(script);
+
+	uint64_t first = header.count > header.capacity ? header.count - header.capacity : 0;
+	printf("last %llu of %llu instructions, oldest first\n",
+		(unsigned long long)(header.count - first), (unsigned long long)header.count);
+	for (uint64_t i = first; i < header.count; i++){
+		TraceEntry entry = entries[i % header.capacity];
+		PObjFunction function = entry.function < TRACE_NO_FUNCTION ? functions[entry.function] : NULL;
+		if (function == NULL || entry.offset >= (uint32_t)function->chunk.count ||
+			function->chunk.code[entry.offset] != entry.opcode){
+			printf("%-12s          %-8s\t%04u ?? not in this source (opcode %u)\n",
+				"?", tagName(entry.tag), entry.offset, entry.opcode);
+			continue;
+		}
+		PObjString name = function->name;
+		printf("%-12.*s [line %3d] %-8s", name == NULL ? 6 : name->length, name == NULL ? "script" : name->chars,
+			getLine(&function->chunk, (int)entry.offset), tagName(entry.tag));
+		disassembleInstruction(&function->chunk, (int)entry.offset);
+	}
+	freeVM();
+	free(source);
+	free(dump);
+	return 0;
+}
@@ -1,7 +1,11 @@
 
 #include "memory.h"
 #include "value.h"
+#include "object.h"
 #include "common.h"
+#include "vm.h"
+#include "output.h"
+#include <time.h>
 
 void initValueArray(PValueArray arr){
 	arr->capacity = 0;
@@ -13,12 +17,12 @@ void writeValueArray(PValueArray array, Value value) {
     int oldCapacity = array->capacity;
     array->capacity = GROW_CAPACITY(oldCapacity);
     array->values = GROW_ARRAY(Value, array->values,
-		oldCapacity, array->capacity);
+		oldCapacity, array->capacity, MEM_CONSTANTS);
   }
   array->values[array->count++] = value;
 }
 void freeValueArray(PValueArray array) {
-  FREE_ARRAY(Value, array->values, array->capacity);
+  FREE_ARRAY(Value, array->values, array->capacity, MEM_CONSTANTS);
   initValueArray(array);
 }
 Value getValueArrayIndex(PValueArray array, int index){
@@ -32,18 +36,25 @@ void writeValueArrayIndex(PValueArray array, Value value, int index){
 	array->values[index] = value;
 }
 
+static void printNumber(double number){
+	char chars[NUMBER_CHARS];
+	writeOutput(chars, formatNumber(number, chars));
+}
 void printValue(Value value){
+	// into the output buffer, see output.h
 	switch(value.type){
 		case NUMBER:
-			printf("%g",AS_NUMBER(value));
+			printNumber(AS_NUMBER(value));
 			break;
 		case BOOL:
-			printf(AS_BOOL(value) ? "true" : "false");
+			writeText(AS_BOOL(value) ? "true" : "false");
 			break;
 		case NIL:
-			printf("null"); break;		
+			writeOutput("null", 4); break;
 		case OBJ:
 			printObject(value);break;
+		case SHORT_STRING:
+			writeText(value.as.chars); break;
 	}
 }
 bool valuesEqual(PValue _a, PValue _b) {
@@ -55,20 +66,23 @@ bool valuesEqual(PValue _a, PValue _b) {
     case NIL:    return true;
     case NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
 	case OBJ: return AS_OBJ(a) == AS_OBJ(b); // thanks to string interneding
+	case SHORT_STRING: return memcmp(a.as.chars, b.as.chars, sizeof(a.as.chars)) == 0;
     default:
       return false; 
   }
 }
 PObj allocateObject(size_t size, ObjType type){
-	PObj obj = (PObj)reallocate(NULL,0,size);
+	PObj obj = (PObj)slabAllocate(size, type);
 	obj->type = type;
 	obj->next = vm.objects;
 	vm.objects = obj;
 	return obj;
 }
 PObjString allocateObjStr(int size){
-	PObj obj = allocateObject(sizeof(ObjString) + size + 16, OBJ_STRING); 
-	return (PObjString)obj;
+	PObjString str = (PObjString)allocateObject(sizeof(ObjString) + size, OBJ_STRING);
+	str->chars = INLINE_CHARS(str);
+	str->borrowed = false;
+	return str;
 }
 static PObjString tableFindString(PTable table,const char* start, int len, uint32_t hash){
 	if (table->count == 0)
@@ -84,7 +98,7 @@ static PObjString tableFindString(PTable table,const char* start, int len, uint3
 				return NULL;
 			}
 		}else if (key->length == len && 
-			key->hash == hash && memcmp(&(key->chars[0]), start,len) == 0){
+			key->hash == hash && memcmp(key->chars, start,len) == 0){
 			return key;
 		}
 		idx = (idx + 1) % table->capacity;
@@ -106,58 +120,261 @@ PObjString copyString(const char* start, int len){
 	tableSet(&vm.strings,&strValue,&nil);
 	return str;
 }
+PObjString borrowString(const char* start, int len){
+	// interned like any other string, so equality stays a pointer compare
+	uint32_t hash = calcHash((void*)start,len);
+	PObjString interned = tableFindString(&vm.strings,start,len,hash);
+	if (interned != NULL){
+		return interned;
+	}
+	PObjString str = (PObjString)allocateObject(sizeof(ObjString), OBJ_STRING);
+	str->length = len;
+	str->chars = (char*)start;
+	str->borrowed = true;
+	str->hash = hash;
+	Value strValue = OBJ_VAL(str);
+	Value nil = NIL_VAL();
+	tableSet(&vm.strings,&strValue,&nil);
+	return str;
+}
+void releaseSource(const char* source, size_t length){
+	// every string is in the string table, so that is where the borrowers are
+	for (int i = 0; i < vm.strings.capacity; i++){
+		Value key = vm.strings.entries[i].key;
+		if (!IS_OBJ(key))
+			continue;
+		PObjString str = AS_STRING(key);
+		if (!str->borrowed || str->chars < source || str->chars >= source + length)
+			continue;
+		char* chars = ALLOCATE(char, str->length + 1, MEM_OBJECTS);
+		memcpy(chars, str->chars, str->length);
+		chars[str->length] = '\0';
+		str->chars = chars;
+		str->borrowed = false;
+	}
+}
+Value stringValue(const char* start, int len){
+	if (len > SHORT_STRING_MAX)
+		return OBJ_VAL(copyString(start, len));
+	Value value = {SHORT_STRING, {.number = 0}}; // zeroes the padding too
+	memcpy(value.as.chars, start, len);
+	return value;
+}
+Value borrowedValue(const char* start, int len){
+	if (len > SHORT_STRING_MAX)
+		return OBJ_VAL(borrowString(start, len));
+	return stringValue(start, len);
+}
 void printObject(Value value){
 	switch (OBJ_TYPE(value)){
 		case OBJ_STRING:
-			printf("%s", AS_CSTRING(value));
+			writeOutput(AS_CSTRING(value), AS_STRING(value)->length);
+			break;
+		case OBJ_FUNCTION: {
+			PObjFunction function = AS_FUNCTION(value);
+			if (function->name == NULL){
+				writeText("<script>");
+			} else {
+				writeText("<fn ");
+				writeOutput(function->name->chars, function->name->length);
+				writeText(">");
+			}
+			break;
+		}
+		case OBJ_FIBER:
+			writeText("<fiber>");
+			break;
+		case OBJ_NATIVE:
+			writeText("<native fn>");
+			break;
+		case OBJ_ARRAY: {
+			PObjArray array = AS_ARRAY(value);
+			writeText("[");
+			for (int i = 0; i < array->count; i++){
+				if (i != 0)
+					writeText(", ");
+				printNumber(array->values[i]);
+			}
+			writeText("]");
+			break;
+		}
+		case OBJ_MAP: {
+			PTable table = &AS_MAP(value)->table;
+			bool first = true;
+			writeText("{");
+			for (PEntry entry = tableNext(table, NULL); entry != NULL; entry = tableNext(table, entry)){
+				if (!first)
+					writeText(", ");
+				first = false;
+				printValue(entry->key);
+				writeText(": ");
+				printValue(entry->value);
+			}
+			writeText("}");
+			break;
+		}
+		case OBJ_CLASS: {
+			PObjString name = AS_CLASS(value)->name;
+			writeOutput(name->chars, name->length);
+			break;
+		}
+		case OBJ_INSTANCE: {
+			PObjString name = AS_INSTANCE(value)->shape->klass->name;
+			writeOutput(name->chars, name->length);
+			writeText(" instance");
+			break;
+		}
+		case OBJ_SHAPE:
+			writeText("<shape>");
+			break;
+		case OBJ_BOUND_METHOD:
+			printObject(OBJ_VAL(AS_BOUND_METHOD(value)->method));
+			break;
+		case OBJ_CLOSURE:
+			printObject(OBJ_VAL(AS_CLOSURE(value)->function));
+			break;
+		case OBJ_UPVALUE:
+			writeText("<upvalue>");
 			break;
 	}
 }
-PObjString concat(Value a, Value b){
-	PObjString str_a = AS_STRING(a);
-	PObjString str_b = AS_STRING(b);
-	int total_len = str_a->length + str_b->length;
+Value concat(Value a, Value b){
+	int len_a = stringLength(&a);
+	int len_b = stringLength(&b);
+	int total_len = len_a + len_b;
+	if (total_len <= SHORT_STRING_MAX){
+		Value value = {SHORT_STRING, {.number = 0}};
+		memcpy(value.as.chars, stringChars(&a), len_a);
+		memcpy(value.as.chars + len_a, stringChars(&b), len_b);
+		return value;
+	}
 	PObjString result = allocateObjStr(total_len+1);
 	result->length = total_len;
-	memcpy(&(result->chars[0]),&(str_a->chars[0]),str_a->length);
-	memcpy(&(result->chars[0]) + str_a->length,&(str_b->chars[0]), str_b->length);
+	memcpy(result->chars,stringChars(&a),len_a);
+	memcpy(result->chars + len_a,stringChars(&b), len_b);
 	result->chars[total_len] = '\0';
-	uint32_t hash = calcHash((void*)&(result->chars[0]),result->length);
-	PObjString interned = tableFindString(&vm.strings,&(result->chars[0]),result->length,hash);
+	uint32_t hash = calcHash((void*)result->chars,result->length);
+	PObjString interned = tableFindString(&vm.strings,result->chars,result->length,hash);
 	if (interned != NULL){
-		free(result);
-		return interned;
+		vm.objects = result->obj.next; // it was just linked in at the head
+		slabFree(result, sizeof(ObjString) + total_len + 1, OBJ_STRING);
+		return OBJ_VAL(interned);
 	}
 	result->hash = hash;
 	Value value = OBJ_VAL(result);
 	Value nil = NIL_VAL();
 	tableSet(&vm.strings,&value,&nil);
-	return result;
+	return value;
+}
+// string hashing follows xxh64: four independent lanes over 32 byte
+// blocks, then words, then the tail, and a final avalanche. the seed is
+// random per process so nobody can precompute colliding keys
+#define PRIME1 0x9E3779B185EBCA87ull
+#define PRIME2 0xC2B2AE3D27D4EB4Full
+#define PRIME3 0x165667B19E3779F9ull
+#define PRIME4 0x85EBCA77C2B2AE63ull
+#define PRIME5 0x27D4EB2F165667C5ull
+static uint64_t hashSeed;
+static bool hashSeeded = false;
+void seedHash(){
+	if (hashSeeded)
+		return;
+	FILE* random = fopen("/dev/urandom", "rb");
+	if (random == NULL || fread(&hashSeed, sizeof(hashSeed), 1, random) != 1)
+		hashSeed = (uint64_t)time(NULL) ^ ((uint64_t)clock() << 32) ^ (uint64_t)(uintptr_t)&hashSeed;
+	if (random != NULL)
+		fclose(random);
+	hashSeeded = true;
+}
+static inline uint64_t rotl64(uint64_t x, int r){
+	return (x << r) | (x >> (64 - r));
+}
+static inline uint64_t read64(const uint8_t* p){
+	uint64_t word;
+	memcpy(&word, p, sizeof(word)); // unaligned, compiles to one load
+	return word;
+}
+static inline uint64_t round64(uint64_t acc, uint64_t input){
+	acc += input * PRIME2;
+	return rotl64(acc, 31) * PRIME1;
+}
+static inline uint64_t mergeRound(uint64_t acc, uint64_t lane){
+	acc ^= round64(0, lane);
+	return acc * PRIME1 + PRIME4;
+}
+static inline uint32_t avalanche(uint64_t h){
+	h ^= h >> 33;
+	h *= PRIME2;
+	h ^= h >> 29;
+	h *= PRIME3;
+	h ^= h >> 32;
+	return (uint32_t)h;
 }
 uint32_t calcHash(const void* key, int len){
-	char* chkey = (char*)key;
-	uint32_t hash = 2166136261u;
-	for (int i = 0; i < len; i++){
-		hash ^= chkey[i];
-		hash *= 16777619;
+	const uint8_t* p = (const uint8_t*)key;
+	const uint8_t* end = p + len;
+	uint64_t h;
+	if (len >= 32){
+		uint64_t v1 = hashSeed + PRIME1 + PRIME2;
+		uint64_t v2 = hashSeed + PRIME2;
+		uint64_t v3 = hashSeed;
+		uint64_t v4 = hashSeed - PRIME1;
+		do {
+			v1 = round64(v1, read64(p));
+			v2 = round64(v2, read64(p + 8));
+			v3 = round64(v3, read64(p + 16));
+			v4 = round64(v4, read64(p + 24));
+			p += 32;
+		} while (p + 32 <= end);
+		h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+		h = mergeRound(h, v1);
+		h = mergeRound(h, v2);
+		h = mergeRound(h, v3);
+		h = mergeRound(h, v4);
+	} else {
+		h = hashSeed + PRIME5;
+	}
+	h += (uint64_t)len;
+	for (; p + 8 <= end; p += 8){
+		h ^= round64(0, read64(p));
+		h = rotl64(h, 27) * PRIME1 + PRIME4;
 	}
-	return hash;
+	if (p + 4 <= end){
+		uint32_t word;
+		memcpy(&word, p, sizeof(word));
+		h ^= (uint64_t)word * PRIME1;
+		h = rotl64(h, 23) * PRIME2 + PRIME3;
+		p += 4;
+	}
+	for (; p < end; p++){
+		h ^= *p * PRIME5;
+		h = rotl64(h, 11) * PRIME1;
+	}
+	return avalanche(h);
+}
+static uint32_t hashWord(uint64_t word){
+	// one mixing round for keys that fit a machine word
+	return avalanche(round64(hashSeed + PRIME5 + 8, word));
 }
 uint32_t calcHashGeneric(PValue key){
 	switch(key->type){
-		case BOOL: {
-			bool actual = AS_BOOL(*key);
-			return calcHash((void*)&actual,sizeof(bool));
-		}
+		case BOOL:
+			return hashWord(AS_BOOL(*key) ? 1 : 0);
 		case NUMBER: {
 			double actual = AS_NUMBER(*key);
-			return calcHash((void*)&actual,sizeof(double));
+			if (actual == 0)
+				actual = 0; // -0 == 0, so they must hash the same
+			uint64_t bits;
+			memcpy(&bits, &actual, sizeof(bits));
+			return hashWord(bits);
 		}
+		case SHORT_STRING: // the zero padded chars are one word
+			return hashWord(read64((const uint8_t*)key->as.chars));
 		case OBJ: {
-			if (IS_STRING(*key)){
-				PObjString str = AS_STRING(*key);
-				return calcHash((void*)&str->chars[0],str->length);
-			}
+			if (IS_STRING(*key))
+				return AS_STRING(*key)->hash; // cached when it was interned
+			// any other object is its own identity
+			return hashWord((uint64_t)(uintptr_t)AS_OBJ(*key));
 		}
 		default: {
 			return 0;
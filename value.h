@@ -3,34 +3,57 @@
 #include "common.h"
 
 typedef enum {
-	OBJ_STRING
+	OBJ_STRING,
+	OBJ_FUNCTION,
+	OBJ_FIBER,
+	OBJ_NATIVE,
+	OBJ_ARRAY,
+	OBJ_MAP,
+	OBJ_CLASS,
+	OBJ_INSTANCE,
+	OBJ_SHAPE,
+	OBJ_BOUND_METHOD,
+	OBJ_CLOSURE,
+	OBJ_UPVALUE
 } ObjType;
+#define OBJ_TYPE_COUNT (OBJ_UPVALUE + 1)
 
 typedef struct _Obj{
 	ObjType type;
 	struct _Obj* next;
 } Obj, *PObj;
 
+// the characters follow the object, except for a borrowed string: those
+// point into a source buffer that outlives it, see borrowString
 typedef struct {
 	Obj obj;
 	uint32_t hash;
 	int length;
-	char chars[];
-} __attribute__((packed, aligned(1))) ObjString, *PObjString;
+	char* chars; // not terminated while borrowed
+	bool borrowed;
+} ObjString, *PObjString;
+#define INLINE_CHARS(string) ((char*)((PObjString)(string) + 1))
 
 typedef enum {
 	BOOL,
 	NIL,
 	NUMBER,
-	OBJ
+	OBJ,
+	SHORT_STRING // no heap object, the characters live in the value itself
 } ValueType;
 
+// strings up to this length are always SHORT_STRING and longer ones always
+// ObjString, so each string has a single representation and equality
+// never has to compare across the two
+#define SHORT_STRING_MAX 7 // plus the terminator fills the payload
+
 typedef struct _Value{
 	ValueType type;
 	union {
 		bool boolean;
 		double number;
 		PObj obj;
+		char chars[SHORT_STRING_MAX + 1]; // zero padded
 	} as;
 } Value, *PValue;
 
@@ -55,13 +78,35 @@ static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && OBJ_TYPE(value) == type;
 } // not a macro because a macro just copies text, which means value will get evaluated twice
 
-#define IS_STRING(value) 		isObjType(value,OBJ_STRING)
-#define AS_STRING(value)       ((PObjString)AS_OBJ(value))
+static inline bool isString(Value value) {
+  return value.type == SHORT_STRING || isObjType(value, OBJ_STRING);
+}
+
+#define IS_SHORT_STRING(value)	((value).type == SHORT_STRING)
+#define IS_STRING(value) 		isString(value)
+#define AS_STRING(value)       ((PObjString)AS_OBJ(value)) // heap strings only
 #define AS_CSTRING(value)      (((PObjString)AS_OBJ(value))->chars)
 
+// work on either representation
+static inline const char* stringChars(PValue value) {
+  return IS_SHORT_STRING(*value) ? value->as.chars : AS_CSTRING(*value);
+}
+static inline int stringLength(PValue value) {
+  return IS_SHORT_STRING(*value) ? (int)strlen(value->as.chars) : AS_STRING(*value)->length;
+}
+
+PObj allocateObject(size_t, ObjType);
 PObjString copyString(const char*, int);
+Value stringValue(const char*, int);
+// literals point into the source instead of being copied. whoever lets go
+// of a source while the vm lives calls releaseSource() first, the strings
+// still borrowing from it get characters of their own
+PObjString borrowString(const char*, int);
+Value borrowedValue(const char*, int); // stringValue for chars that stay put
+void releaseSource(const char*, size_t);
 void printObject(Value);
-PObjString concat(Value, Value);
+Value concat(Value, Value);
+void seedHash();
 uint32_t calcHash(const void*, int);
 uint32_t calcHashGeneric(PValue);
 
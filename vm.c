@@ -1,51 +1,144 @@
+#define _POSIX_C_SOURCE 200809L // clock_gettime
 
 #include "common.h"
 #include "vm.h"
 #include "debug.h"
 #include "compiler.h"
 #include "memory.h"
+#include "jit.h"
+#include "array.h"
+#include "map.h"
+#include "trace.h"
+#include "counters.h"
+#include "module.h"
+#include "snapshot.h"
+#include "output.h"
+#include "class.h"
+#include "closure.h"
 #include <stdarg.h>
 #include <stdio.h>
 #include <time.h>
-VM vm;
+#define FUEL_QUANTUM 10000
+VM vm = { .jitEnabled = true }; // a no-op where the jit is not supported
+PhaseStats phases;
 
 static void resetStack(){
-	vm.stack.count = 0;
+	closeUpvalues(vm.stack); // closures made before the error keep working
+	vm.stackTop = vm.stack;
+	vm.frameCount = 0;
 }
-static void runtimeError(const char* fmt,...){
+void runtimeError(const char* fmt,...){
+	flushOutput(); // what the script printed so far comes first
 	va_list args;
 	va_start(args,fmt);
 	vfprintf(stderr,fmt,args);
 	va_end(args);
 	fputs("\n",stderr);
-	int offset = vm.ip - vm.chunk->code - 1; //ip points at next instruction 
-	int line = getLine(vm.chunk,offset);
-	fprintf(stderr, "[Line %d] in script\n",line);
+	for (int i = vm.frameCount - 1; i >= 0; i--){
+		CallFrame* frame = &vm.frames[i];
+		PObjFunction function = frame->function;
+		int offset = frame->ip - function->chunk.code - 1; //ip points at next instruction 
+		int line = getLine(&function->chunk,offset);
+		fprintf(stderr, "[Line %d] in ",line);
+		if (function->name == NULL)
+			fprintf(stderr, "script\n");
+		else
+			fprintf(stderr, "%.*s()\n", function->name->length, function->name->chars);
+	}
+	dumpTrace();
 	resetStack();
 }
+static void switchFiber(PObjFiber fiber){
+	// only pointers change hands, both stacks stay where they are
+	if (vm.fiber != NULL){
+		vm.fiber->frameCount = vm.frameCount;
+		vm.fiber->stackTop = vm.stackTop;
+	}
+	vm.fiber = fiber;
+	vm.frames = fiber->frames;
+	vm.frameCount = fiber->frameCount;
+	vm.stack = fiber->stack;
+	vm.stackTop = fiber->stackTop;
+	fiber->state = FIBER_RUNNING;
+}
+static void schedule(PObjFiber fiber){
+	fiber->state = FIBER_READY;
+	fiber->next = NULL;
+	if (vm.readyTail == NULL)
+		vm.ready = fiber;
+	else
+		vm.readyTail->next = fiber;
+	vm.readyTail = fiber;
+}
+static PObjFiber nextReady(){
+	PObjFiber fiber = vm.ready;
+	vm.ready = fiber->next;
+	if (vm.ready == NULL)
+		vm.readyTail = NULL;
+	return fiber;
+}
+static void defineNative(const char* name, int arity, NativeFn function){
+	Value key = stringValue(name, (int)strlen(name));
+	Value native = OBJ_VAL(newNative(arity, function));
+	tableSet(&vm.globals, &key, &native);
+}
+static void startVM(){
+	// what a fresh vm and a clone both start with
+	vm.fiber = NULL;
+	vm.ready = vm.readyTail = NULL;
+	vm.mainFiber = newFiber();
+	switchFiber(vm.mainFiber); // the script runs in the main fiber
+	vm.script = NULL;
+	vm.line = 1;
+	vm.entryCost = 0;
+}
 void initVM(){
-	initValueArray(&vm.stack);
-	resetStack();
+	seedHash(); // once per process, interned strings keep their hash
 	vm.objects = NULL;
 	initTable(&vm.strings);
 	initTable(&vm.globals);
+	initTable(&vm.modules);
+	startVM();
+	defineNative("array", 1, arrayNative);
+	defineNative("len", 1, lenNative);
+	defineNative("sum", 1, sumNative);
+	defineNative("dot", 2, dotNative);
+	defineNative("scale", 2, scaleNative);
+	defineNative("add", 2, addNative);
+	defineNative("min", 1, minNative);
+	defineNative("max", 1, maxNative);
+	defineNative("sort", 1, sortNative);
+	defineNative("next", 2, nextNative);
+}
+void cloneVM(PSnapshot snapshot){
+	// the natives come along with the globals
+	restoreImage(snapshot);
+	startVM();
 }
-
 void freeVM(){
-	freeValueArray(&vm.stack);
-	freeObjects();
+	uint64_t start = monotonicNanos();
 	freeTable(&vm.strings);
+	freeTable(&vm.globals);
+	freeTable(&vm.modules);
+	freeObjects(); // the stacks belong to the fibers
+	vm.fiber = vm.mainFiber = NULL;
+	vm.script = NULL;
+	vm.frames = NULL;
+	vm.frameCount = 0;
+	vm.stack = vm.stackTop = NULL;
+	vm.ready = vm.readyTail = NULL;
+	phases.nanos[PHASE_TEARDOWN] += monotonicNanos() - start;
 }
 void push(Value value){
-	writeValueArray(&vm.stack, value);
+	*vm.stackTop++ = value;
 }
 Value pop(){
-	return vm.stack.values[(vm.stack.count--) - 1]; 
+	return *--vm.stackTop;
 }
 static Value peek(int delta){
-	return vm.stack.values[vm.stack.count - 1 - delta];
+	return vm.stackTop[-1 - delta];
 }
-static bool ToBoolean(Value value){
+bool ToBoolean(Value value){
 	switch(value.type){
 		case BOOL:
 			return AS_BOOL(value);
@@ -57,30 +150,407 @@ static bool ToBoolean(Value value){
 			return false;
 	}
 }
-InterpretResult interpret(const char* source){
-	Chunk chunk;
-	initChunk(&chunk);
-	clock_t time;
-	time = clock();
-	if (!compile(source, &chunk)){
-		freeChunk(&chunk);
+static void reserveStack(int base, PObjFunction function){
+	// a frame starting at stack[base] uses at most FRAME_STACK slots.
+	// fibers start small, so the stack grows here and everything pointing
+	// into it is rebased. the interpreter and the jit reload their pointers
+	// after a call, generated code does the same
+	PObjFiber fiber = vm.fiber;
+	int needed = base + FRAME_STACK(function);
+	if (needed <= fiber->stackCapacity)
+		return;
+	int capacity = fiber->stackCapacity;
+	while (capacity < needed)
+		capacity *= 2;
+	Value* stack = ALLOCATE(Value, capacity, MEM_STACK);
+	memcpy(stack, vm.stack, sizeof(Value) * (vm.stackTop - vm.stack));
+	for (int i = 0; i < vm.frameCount; i++)
+		vm.frames[i].slots = stack + (vm.frames[i].slots - vm.stack);
+	for (PObjUpvalue upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = upvalue->next)
+		upvalue->location = stack + (upvalue->location - vm.stack);
+	vm.stackTop = stack + (vm.stackTop - vm.stack);
+	FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity, MEM_STACK);
+	fiber->stack = vm.stack = stack;
+	fiber->stackCapacity = capacity;
+}
+static void reserveFrame(){
+	// the frames move when they grow, so a CallFrame* is fetched again
+	// after anything that can call
+	PObjFiber fiber = vm.fiber;
+	if (vm.frameCount < fiber->frameCapacity)
+		return;
+	int capacity = fiber->frameCapacity * 2; // FRAMES_MAX is a power of two
+	fiber->frames = vm.frames = GROW_ARRAY(CallFrame, fiber->frames, fiber->frameCapacity, capacity, MEM_STACK);
+	fiber->frameCapacity = capacity;
+}
+bool call(PObjFunction function, int argCount){
+	if (argCount != function->arity){
+		runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+		return false;
+	}
+	if (vm.frameCount == FRAMES_MAX){
+		runtimeError("Stack overflow.");
+		return false;
+	}
+	int base = (int)(vm.stackTop - vm.stack) - argCount - 1; // arguments stay where they were pushed
+	reserveStack(base, function);
+	reserveFrame();
+	CallFrame* frame = &vm.frames[vm.frameCount++];
+	frame->function = function;
+	frame->ip = function->chunk.code;
+	frame->slots = vm.stack + base;
+	frame->link = -1;
+	if (++function->chunk.calls == JIT_THRESHOLD && vm.jitEnabled)
+		jitCompile(&function->chunk);
+	return true;
+}
+static bool callNative(PObjNative native, int argCount){
+	// runs to completion right here, no frame is pushed
+	if (argCount != native->arity){
+		runtimeError("Expected %d arguments but got %d.", native->arity, argCount);
+		return false;
+	}
+	Value result;
+	if (!native->function(vm.stackTop - argCount, &result))
+		return false;
+	vm.stackTop -= argCount + 1;
+	push(result);
+	return true;
+}
+bool callValue(Value callee, int argCount){
+	if (IS_FUNCTION(callee))
+		return call(AS_FUNCTION(callee), argCount);
+	if (IS_CLOSURE(callee))
+		return call(AS_CLOSURE(callee)->function, argCount); // finds itself in slot 0
+	if (IS_NATIVE(callee))
+		return callNative(AS_NATIVE(callee), argCount);
+	if (IS_BOUND_METHOD(callee))
+		return callBoundMethod(AS_BOUND_METHOD(callee), argCount);
+	if (IS_CLASS(callee))
+		return callClass(AS_CLASS(callee), argCount);
+	runtimeError("Can only call functions.");
+	return false;
+}
+bool tailCall(CallFrame* frame, Value callee, int argCount){
+	// the callee takes over the caller's frame, so a chain of tail calls
+	// runs in constant space
+	PObjFunction function;
+	if (IS_FUNCTION(callee))
+		function = AS_FUNCTION(callee);
+	else if (IS_CLOSURE(callee))
+		function = AS_CLOSURE(callee)->function;
+	else
+		return callValue(callee, argCount);
+	if (argCount != function->arity){
+		runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+		return false;
+	}
+	closeUpvalues(frame->slots); // the caller's locals are about to be overwritten
+	reserveStack((int)(frame->slots - vm.stack), function); // frame is rebased, not moved
+	Value* args = vm.stackTop - argCount - 1;
+	memmove(frame->slots, args, sizeof(Value) * (argCount + 1));
+	vm.stackTop = frame->slots + argCount + 1;
+	frame->function = function;
+	frame->ip = function->chunk.code;
+	frame->link = -1;
+	if (++function->chunk.calls == JIT_THRESHOLD && vm.jitEnabled)
+		jitCompile(&function->chunk);
+	return true;
+}
+static bool startFiber(int argCount, bool scheduled){
+	// fiber f(x): the callee and its arguments move to a new stack and the
+	// call begins there the first time the fiber runs
+	Value callee = peek(argCount);
+	if (!IS_FUNCTION(callee) && !IS_CLOSURE(callee)){
+		runtimeError("Can only call functions.");
+		return false;
+	}
+	PObjFunction function = IS_CLOSURE(callee) ? AS_CLOSURE(callee)->function : AS_FUNCTION(callee);
+	if (argCount != function->arity){
+		runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+		return false;
+	}
+	PObjFiber fiber = newFiber();
+	if (FRAME_STACK(function) > fiber->stackCapacity){
+		FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity, MEM_STACK);
+		fiber->stackCapacity = FRAME_STACK(function);
+		fiber->stack = ALLOCATE(Value, fiber->stackCapacity, MEM_STACK);
+	}
+	memcpy(fiber->stack, vm.stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+	fiber->stackTop = fiber->stack + argCount + 1;
+	CallFrame* frame = &fiber->frames[fiber->frameCount++];
+	frame->function = function;
+	frame->ip = function->chunk.code;
+	frame->slots = fiber->stack;
+	frame->link = -1;
+	if (++function->chunk.calls == JIT_THRESHOLD && vm.jitEnabled)
+		jitCompile(&function->chunk);
+	vm.stackTop -= argCount + 1;
+	push(OBJ_VAL(fiber));
+	if (scheduled)
+		schedule(fiber);
+	return true;
+}
+static bool resumeFiber(Value value){
+	if (!IS_FIBER(value)){
+		runtimeError("Can only resume fibers.");
+		return false;
+	}
+	PObjFiber fiber = AS_FIBER(value);
+	switch (fiber->state){
+		case FIBER_SUSPENDED:
+			fiber->resumer = vm.fiber;
+			switchFiber(fiber);
+			return true;
+		case FIBER_READY:
+			runtimeError("Can't resume a scheduled fiber.");
+			return false;
+		case FIBER_RUNNING:
+			runtimeError("Can't resume a running fiber.");
+			return false;
+		case FIBER_DONE:
+			runtimeError("Can't resume a finished fiber.");
+			return false;
+	}
+	return false;
+}
+static void yieldFiber(Value value){
+	// back to whoever resumed us, with the value. a scheduled fiber (or the
+	// script) lets the next ready one run instead, or carries on if alone
+	PObjFiber fiber = vm.fiber;
+	PObjFiber resumer = fiber->resumer;
+	if (resumer != NULL){
+		fiber->resumer = NULL;
+		fiber->state = FIBER_SUSPENDED;
+		switchFiber(resumer);
+		push(value);
+	} else if (vm.ready != NULL){
+		schedule(fiber);
+		switchFiber(nextReady());
+	}
+}
+static bool finishFiber(Value result){
+	// the fiber's function returned. false once nothing is left to run
+	PObjFiber fiber = vm.fiber;
+	PObjFiber resumer = fiber->resumer;
+	fiber->state = FIBER_DONE;
+	fiber->resumer = NULL;
+	if (resumer != NULL){
+		switchFiber(resumer);
+		push(result);
+		return true;
+	}
+	if (vm.ready == NULL)
+		return false;
+	switchFiber(nextReady());
+	return true;
+}
+uint64_t monotonicNanos(){
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+static void grantFuel(){
+	// with a deadline the clock is read every FUEL_QUANTUM instructions
+	uint64_t grant = vm.deadline != 0 ? FUEL_QUANTUM : INT64_MAX;
+	if (vm.instructionsLeft < grant)
+		grant = vm.instructionsLeft;
+	vm.fuel = vm.fuelGranted = (int64_t)grant;
+}
+bool refuel(){
+	// the fuel ran out: either the budget is used up or it is just time to
+	// look at the clock again. false means yield
+	uint64_t used = (uint64_t)(vm.fuelGranted - vm.fuel);
+	vm.instructions += used;
+	if (vm.instructionsLeft != UINT64_MAX)
+		vm.instructionsLeft = used >= vm.instructionsLeft ? 0 : vm.instructionsLeft - used;
+	vm.fuel = vm.fuelGranted = 0;
+	if (vm.instructionsLeft == 0 || (vm.deadline != 0 && monotonicNanos() >= vm.deadline))
+		return false;
+	grantFuel();
+	return true;
+}
+static PObjFunction timedCompile(const char* source, int* start){
+	// start is NULL for a whole script, else a repl line goes onto vm.script
+	uint64_t time = monotonicNanos();
+	Phase outer = enterPhase(PHASE_SCAN);
+	if (phases.enabled){
+		phases.tokens += countTokens(source);
+		uint64_t now = monotonicNanos();
+		phases.nanos[PHASE_SCAN] += now - time;
+		time = now;
+	}
+	enterPhase(PHASE_COMPILE);
+	PObjFunction function = vm.script;
+	if (start == NULL)
+		function = compile(source);
+	else if ((*start = compileLine(vm.script, source, vm.line)) < 0)
+		function = NULL;
+	phases.nanos[PHASE_COMPILE] += monotonicNanos() - time;
+	enterPhase(outer);
+	return function;
+}
+static InterpretResult prepareScript(const char* source){
+	PObjFunction function = timedCompile(source, NULL);
+	if (function == NULL)
 		return INTERPRET_COMPILE_ERROR;
+	if (!checkMemoryLimit()) // the program alone is already too big
+		return INTERPRET_RUNTIME_ERROR;
+	push(OBJ_VAL(function));
+	call(function, 0);
+	vm.entryCost = function->chunk.cost;
+	return INTERPRET_OK;
+}
+InterpretResult prepare(const char* source){
+	// the vm outlives the call, the host's source doesn't have to
+	InterpretResult result = prepareScript(source);
+	releaseSource(source, strlen(source));
+	return result;
+}
+static void resetSession(){
+	// back to an idle main fiber. only a runtime error leaves anything
+	// behind: the fiber it happened in and fibers that never got to run
+	if (vm.fiber != vm.mainFiber){
+		vm.fiber->state = FIBER_DONE;
+		switchFiber(vm.mainFiber);
 	}
-	initVM();
-	vm.chunk = &chunk;
-	vm.ip = vm.chunk->code;
+	for (PObjFiber fiber = vm.ready; fiber != NULL; fiber = fiber->next)
+		fiber->state = FIBER_DONE;
+	vm.ready = vm.readyTail = NULL;
+	vm.fiber->state = FIBER_RUNNING;
+	resetStack();
+}
+InterpretResult prepareLine(const char* source){
+	resetSession();
+	if (vm.script == NULL)
+		vm.script = newFunction();
+	// native code for the script points into the code array about to grow
+	jitFree(&vm.script->chunk);
+	vm.script->chunk.jitFailed = false;
+	int start;
+	PObjFunction script = timedCompile(source, &start);
+	const char* c = source;
+	for (; *c != '\0'; c++)
+		if (*c == '\n')
+			vm.line++;
+	releaseSource(source, c - source); // the next line goes into the same buffer
+	if (script == NULL)
+		return INTERPRET_COMPILE_ERROR;
+	if (!checkMemoryLimit())
+		return INTERPRET_RUNTIME_ERROR;
+	push(OBJ_VAL(vm.script));
+	call(vm.script, 0);
+	vm.frames[vm.frameCount - 1].ip += start;
+	// only the new line is going to run
+	vm.entryCost = countInstructions(&vm.script->chunk, start, vm.script->chunk.count);
+	return INTERPRET_OK;
+}
+InterpretResult resume(Budget budget){
+	vm.instructionsLeft = budget.instructions == 0 ? UINT64_MAX : budget.instructions;
+	vm.deadline = budget.microseconds == 0 ? 0 : monotonicNanos() + budget.microseconds * 1000;
+	grantFuel();
+	uint64_t time = monotonicNanos();
+	uint64_t jitTime = phases.nanos[PHASE_JIT];
+	Phase outer = enterPhase(PHASE_RUN);
 	InterpretResult result = run();
-	time = clock() - time;
-	double seconds = ((double)time)/CLOCKS_PER_SEC;
-	printf("\tProgram compiled and ran in %fs\n",seconds);
-	freeChunk(vm.chunk);
+	enterPhase(outer);
+	vm.instructions += (uint64_t)(vm.fuelGranted - vm.fuel);
+	vm.fuelGranted = vm.fuel;
+	phases.nanos[PHASE_RUN] += monotonicNanos() - time - (phases.nanos[PHASE_JIT] - jitTime);
+	return result;
+}
+void swapVM(VM* other){
+	// everything else only ever looks at the global vm
+	VM active = vm;
+	vm = *other;
+	*other = active;
+}
+InterpretResult interpret(const char* source){
+	initVM(); // before compiling, so literals are interned in the live string table
+	// the source is freed after the vm, literals can keep pointing into it
+	InterpretResult result = prepareScript(source);
+	if (result != INTERPRET_OK){
+		freeVM();
+		return result;
+	}
+	#ifdef DEBUG_PROFILE_LOOPS
+	PObjFunction function = AS_FUNCTION(vm.stack[0]);
+	#endif
+	result = resume((Budget){ 0, 0 });
+	#ifdef DEBUG_PROFILE_LOOPS
+	printLoopCounters(&function->chunk);
+	#endif
 	freeVM();
 	return result;
 }
+void writeStats(FILE* out){
+	static const char* phaseNames[PHASE_COUNT] = {
+		"load", "scan", "compile", "jit", "run", "teardown"
+	};
+	fputs("{\"nanoseconds\": {", out);
+	for (int i = 0; i < PHASE_COUNT; i++)
+		fprintf(out, "\"%s\": %llu%s", phaseNames[i], (unsigned long long)phases.nanos[i],
+			i + 1 < PHASE_COUNT ? ", " : "},\n");
+	fprintf(out, " \"tokens\": %llu, \"charged_instructions\": %llu,\n",
+		(unsigned long long)phases.tokens, (unsigned long long)vm.instructions);
+	fprintf(out, " \"allocations\": {\"objects\": %zu, \"blocks\": %zu, \"peak_bytes\": %zu,"
+		" \"closures\": %zu, \"upvalues\": %zu},\n",
+		vm.memory.objectsAllocated, vm.memory.blocksAllocated, vm.memory.total.peak,
+		vm.memory.allocated[OBJ_CLOSURE], vm.memory.allocated[OBJ_UPVALUE]);
+	static const char* siteNames[SITE_KIND_COUNT] = { "get", "set", "invoke" };
+	uint64_t hits = 0, lookups = 0;
+	fputs(" \"inline_caches\": {", out);
+	for (int i = 0; i < SITE_KIND_COUNT; i++){
+		fprintf(out, "\"%s\": {\"hits\": %llu, \"misses\": %llu}, ", siteNames[i],
+			(unsigned long long)vm.caches.hits[i], (unsigned long long)vm.caches.misses[i]);
+		hits += vm.caches.hits[i];
+		lookups += vm.caches.hits[i] + vm.caches.misses[i];
+	}
+	fprintf(out, "\"megamorphic_sites\": %llu, \"hit_rate\": %.4f}",
+		(unsigned long long)vm.caches.megamorphic, lookups == 0 ? 0.0 : (double)hits / lookups);
+	writeCounters(out);
+	fputs("}\n", out);
+}
 static InterpretResult run(){
-  #define READ_BYTE() (*vm.ip++)
-  #define READ_CONSTANT() (vm.chunk->constants.values[READ_BYTE()])
-  #define READ_CONSTANT_LONG() (vm.chunk->constants.values[READ_BYTE() + READ_BYTE() << 8 + READ_BYTE() << 16])
+  CallFrame* frame = &vm.frames[vm.frameCount - 1];
+  #ifdef JIT_SUPPORTED
+  // hand over to native code whenever we land in a compiled chunk. it
+  // comes back at calls, returns and anything else it does not handle
+  #define ENTER_JIT() \
+    do { \
+	  if (frame->function->chunk.jit != NULL){ \
+		if (counterSampling) \
+			sampledOpcode = SAMPLE_NATIVE; \
+		JitStatus status = jitEnter(frame); \
+		if (status == JIT_ERROR) \
+			return INTERPRET_RUNTIME_ERROR; \
+		if (status == JIT_YIELD) \
+			return INTERPRET_YIELD; \
+	  } \
+    } while (false)
+  #else
+  #define ENTER_JIT() do { } while (false)
+  #endif
+  // after instructions that can allocate, so a runaway script stops with a
+  // runtime error instead of running into the allocator
+  #define CHECK_MEMORY() \
+    do { \
+	  if (vm.memory.limit != 0 && !checkMemoryLimit()) \
+		return INTERPRET_RUNTIME_ERROR; \
+    } while (false)
+  // the budget is only checked at back edges, calls and the frame prepare()
+  // pushed, charging the most instructions that can run before the next
+  // check. ip is already at a point the next run() can start from
+  #define CHARGE(cost) \
+    do { \
+	  if ((vm.fuel -= (cost)) <= 0 && !refuel()) \
+		return INTERPRET_YIELD; \
+    } while (false)
+  #define READ_BYTE() (*frame->ip++)
+  #define READ_SHORT() (frame->ip += 2, (uint16_t)(frame->ip[-2] | (frame->ip[-1] << 8)))
+  #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+  #define READ_CONSTANT_LONG() (frame->ip += 3, frame->function->chunk.constants.values[ \
+	frame->ip[-3] | (frame->ip[-2] << 8) | (frame->ip[-1] << 16)])
   #define BINARY_OP(TYPE_VAL,op) \
     do { \
 	  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))){ \
@@ -91,20 +561,56 @@ static InterpretResult run(){
       double a = AS_NUMBER(pop()); \
       push(TYPE_VAL(a op b)); \
     } while (false)
+  #define NUMBER_OP(TYPE_VAL,op) \
+    do { \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      push(TYPE_VAL(a op b)); \
+    } while (false)
+  #define COMPARE_JUMP(op,taken) \
+    do { \
+	  uint16_t offset = READ_SHORT(); \
+	  if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))){ \
+		runtimeError("Operands must be numbers."); \
+		return INTERPRET_RUNTIME_ERROR; \
+	  } \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      if ((a op b) == taken) frame->ip += offset; \
+    } while (false)
+  #define NUMBER_COMPARE_JUMP(op,taken) \
+    do { \
+	  uint16_t offset = READ_SHORT(); \
+      double b = AS_NUMBER(pop()); \
+      double a = AS_NUMBER(pop()); \
+      if ((a op b) == taken) frame->ip += offset; \
+    } while (false)
 		
+  // the entry frame is charged like any other call, once
+  if (vm.entryCost != 0){
+	  int cost = vm.entryCost;
+	  vm.entryCost = 0;
+	  CHARGE(cost);
+  }
   for (;;) {
 	  #ifdef DEBUG_TRACE_EXECUTION
-		printf("\tSTACK TRACE: ");
-		if (vm.stack.count == 0){
-			printf("EMPTY");
+		writeText("\tSTACK TRACE: ");
+		if (vm.stackTop == vm.stack){
+			writeText("EMPTY");
 		}
-		for (Value* slot = vm.stack.values; slot < (vm.stack.values + vm.stack.count); slot++){
-			printf("["); printValue(*slot);printf("] ");
+		for (Value* slot = vm.stack; slot < vm.stackTop; slot++){
+			writeText("["); printValue(*slot);writeText("] ");
 		}
-		printf("\n");
+		writeText("\n");
+		flushOutput(); // the disassembler prints with stdio
 		
-		disassembleInstruction(vm.chunk, (int)(vm.ip - vm.chunk->code));
+		disassembleInstruction(&frame->function->chunk, \
+			(int)(frame->ip - frame->function->chunk.code));
 	  #endif
+	  if (traceRing != NULL)
+		TRACE_RECORD(frame, vm.stackTop[-1]); // never empty, slot 0 is the callee
+	  if (counterSampling)
+		sampledOpcode = *frame->ip; // where the next overflow is charged, see counters.h
     uint8_t instruction;
     switch (instruction = READ_BYTE()) {
 	  case OP_CONSTANT: {
@@ -119,21 +625,23 @@ static InterpretResult run(){
 	  }
 	  case OP_GLOBAL_SET: {
 		  Value idValue = READ_CONSTANT();
-		  Value popped = pop();
-		  tableSet(&vm.globals,&idValue,&popped);
+		  Value value = peek(0); // assignment is an expression, the value stays
+		  tableSet(&vm.globals,&idValue,&value);
+		  CHECK_MEMORY();
 		  break;
 	  }
 	  case OP_GLOBAL_SET_LONG: {
 		  Value idValue = READ_CONSTANT_LONG();
-		  Value popped = pop();
-		  tableSet(&vm.globals,&idValue,&popped);
+		  Value value = peek(0); // assignment is an expression, the value stays
+		  tableSet(&vm.globals,&idValue,&value);
+		  CHECK_MEMORY();
 		  break;
 	  }	
 	  case OP_GLOBAL_GET: {
 		  Value idValue = READ_CONSTANT();
 		  Value value;
 		  if (!tableGet(&vm.globals,&idValue,&value)){
-			  runtimeError("Undefined variable '%s'.",AS_STRING(idValue)->chars);
+			  runtimeError("Undefined variable '%.*s'.",stringLength(&idValue),stringChars(&idValue));
 			  return INTERPRET_RUNTIME_ERROR;
 		  }
 		  push(value);
@@ -143,7 +651,7 @@ static InterpretResult run(){
 		  Value idValue = READ_CONSTANT_LONG();
 		  Value value;
 		  if (!tableGet(&vm.globals,&idValue,&value)){
-			  runtimeError("Undefined variable '%s'.",AS_STRING(idValue)->chars);
+			  runtimeError("Undefined variable '%.*s'.",stringLength(&idValue),stringChars(&idValue));
 			  return INTERPRET_RUNTIME_ERROR;
 		  }
 		  push(value);
@@ -152,15 +660,25 @@ static InterpretResult run(){
 	  }
 	  case OP_LOCAL_GET: {
 		  uint8_t slot = READ_BYTE();
-		  push(getValueArrayIndex(&vm.stack,slot));
+		  push(frame->slots[slot]);
 		  break;
 	  }
 	  case OP_LOCAL_SET: {
 		  uint8_t slot = READ_BYTE();
-		  writeValueArrayIndex(&vm.stack, peek(0),slot);
+		  frame->slots[slot] = peek(0);
 		  // no pop cause assignment is both statement and expression
 		  break;
 	  }
+	  case OP_LOCAL_GET_LONG: {
+		  uint16_t slot = READ_SHORT();
+		  push(frame->slots[slot]);
+		  break;
+	  }
+	  case OP_LOCAL_SET_LONG: {
+		  uint16_t slot = READ_SHORT();
+		  frame->slots[slot] = peek(0);
+		  break;
+	  }
 	  case OP_NIL: push(NIL_VAL());break;
 	  case OP_TRUE: push(BOOL_VAL(true)); break;
 	  case OP_FALSE: push(BOOL_VAL(false)); break;
@@ -174,8 +692,10 @@ static InterpretResult run(){
 	  case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
 	  case OP_ADD: {
 		  if (IS_STRING(peek(0)) && IS_STRING(peek(1))){
-				PObjString result = concat(pop(),pop());
-				push (OBJ_VAL(result));
+				Value b = pop();
+				Value a = pop();
+				push(concat(a, b));
+				CHECK_MEMORY();
 		  }
 		  else 
 				BINARY_OP(NUMBER_VAL,+); 
@@ -193,11 +713,64 @@ static InterpretResult run(){
 		}
 		push(NUMBER_VAL(-AS_NUMBER(pop())));
 		break;	  
-	  case OP_PRINT: {
-		  printValue(pop());
-		  printf("\n");
+	  case OP_EQUAL_NUM: NUMBER_OP(BOOL_VAL, ==); break;
+	  case OP_GREATER_NUM: NUMBER_OP(BOOL_VAL, >); break;
+	  case OP_LESS_NUM: NUMBER_OP(BOOL_VAL, <); break;
+	  case OP_ADD_NUM: NUMBER_OP(NUMBER_VAL, +); break;
+	  case OP_SUBTRACT_NUM: NUMBER_OP(NUMBER_VAL, -); break;
+	  case OP_MULTIPLY_NUM: NUMBER_OP(NUMBER_VAL, *); break;
+	  case OP_DIVIDE_NUM: NUMBER_OP(NUMBER_VAL, /); break;
+	  case OP_NEGATE_NUM:
+		push(NUMBER_VAL(-AS_NUMBER(pop())));
+		break;
+	  case OP_JUMP: {
+		  uint16_t offset = READ_SHORT();
+		  frame->ip += offset;
 		  break;
 	  }
+	  case OP_JUMP_IF_FALSE: {
+		  uint16_t offset = READ_SHORT();
+		  if (!ToBoolean(peek(0)))
+			  frame->ip += offset;
+		  break;
+	  }
+	  case OP_POP_JUMP_IF_FALSE: {
+		  uint16_t offset = READ_SHORT();
+		  if (!ToBoolean(pop()))
+			  frame->ip += offset;
+		  break;
+	  }
+	  case OP_LOOP: {
+		  uint16_t offset = READ_SHORT();
+		  uint16_t counter = READ_SHORT();
+		  PChunk chunk = &frame->function->chunk;
+		  frame->ip -= offset;
+		  if (++chunk->loops[counter].hits == JIT_THRESHOLD && vm.jitEnabled)
+			  jitCompile(chunk);
+		  CHARGE(chunk->loops[counter].cost);
+		  ENTER_JIT();
+		  break;
+	  }
+	  case OP_JUMP_IF_LESS: COMPARE_JUMP(<, true); break;
+	  case OP_JUMP_IF_NOT_LESS: COMPARE_JUMP(<, false); break;
+	  case OP_JUMP_IF_GREATER: COMPARE_JUMP(>, true); break;
+	  case OP_JUMP_IF_NOT_GREATER: COMPARE_JUMP(>, false); break;
+	  case OP_JUMP_IF_EQUAL:
+	  case OP_JUMP_IF_NOT_EQUAL: {
+		  uint16_t offset = READ_SHORT();
+		  Value b = pop();
+		  Value a = pop();
+		  if (valuesEqual(&a,&b) == (instruction == OP_JUMP_IF_EQUAL))
+			  frame->ip += offset;
+		  break;
+	  }
+	  case OP_JUMP_IF_LESS_NUM: NUMBER_COMPARE_JUMP(<, true); break;
+	  case OP_JUMP_IF_NOT_LESS_NUM: NUMBER_COMPARE_JUMP(<, false); break;
+	  case OP_JUMP_IF_GREATER_NUM: NUMBER_COMPARE_JUMP(>, true); break;
+	  case OP_JUMP_IF_NOT_GREATER_NUM: NUMBER_COMPARE_JUMP(>, false); break;
+	  case OP_JUMP_IF_EQUAL_NUM: NUMBER_COMPARE_JUMP(==, true); break;
+	  case OP_JUMP_IF_NOT_EQUAL_NUM: NUMBER_COMPARE_JUMP(==, false); break;
+	  case OP_PRINT: printLine(pop()); break;
 	  case OP_POP: pop();break;
 	  case OP_POPN: {
 		  uint8_t count = READ_BYTE();
@@ -205,14 +778,177 @@ static InterpretResult run(){
 			  pop();
 		  break;
 	  }
+	  case OP_CALL: {
+		  int argCount = READ_BYTE();
+		  if (!callValue(peek(argCount), argCount))
+			  return INTERPRET_RUNTIME_ERROR;
+		  frame = &vm.frames[vm.frameCount - 1];
+		  CHARGE(frame->function->chunk.cost);
+		  ENTER_JIT();
+		  break;
+	  }
+	  case OP_TAIL_CALL: {
+		  int argCount = READ_BYTE();
+		  if (!tailCall(frame, peek(argCount), argCount))
+			  return INTERPRET_RUNTIME_ERROR;
+		  frame = &vm.frames[vm.frameCount - 1];
+		  CHARGE(frame->function->chunk.cost);
+		  ENTER_JIT();
+		  break;
+	  }
       case OP_RETURN: {
-        return INTERPRET_OK;
+		Value result = pop();
+		if (vm.fiber->openUpvalues != NULL)
+			closeUpvalues(frame->slots);
+		vm.frameCount--;
+		if (vm.frameCount == 0){
+			pop(); // the fiber's function, or the script itself
+			if (!finishFiber(result))
+				return INTERPRET_OK;
+		} else {
+			vm.stackTop = frame->slots;
+			push(result);
+		}
+		frame = &vm.frames[vm.frameCount - 1];
+		ENTER_JIT();
+		break;
       }
-	  
+	  case OP_FIBER:
+	  case OP_SPAWN: {
+		  int argCount = READ_BYTE();
+		  if (!startFiber(argCount, instruction == OP_SPAWN))
+			  return INTERPRET_RUNTIME_ERROR;
+		  CHECK_MEMORY();
+		  break;
+	  }
+	  case OP_RESUME:
+		  if (!resumeFiber(pop()))
+			  return INTERPRET_RUNTIME_ERROR;
+		  frame = &vm.frames[vm.frameCount - 1];
+		  ENTER_JIT();
+		  break;
+	  case OP_ARRAY:
+		  if (!arrayLiteral(READ_BYTE()))
+			  return INTERPRET_RUNTIME_ERROR;
+		  CHECK_MEMORY();
+		  break;
+	  case OP_INDEX_GET:
+		  if (!indexGet())
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_INDEX_SET:
+		  if (!indexSet())
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_MAP:
+		  if (!mapLiteral(READ_BYTE()))
+			  return INTERPRET_RUNTIME_ERROR;
+		  CHECK_MEMORY();
+		  break;
+	  case OP_HAS:
+		  if (!mapHas())
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_DELETE:
+		  if (!mapDelete())
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_YIELD:
+		  yieldFiber(pop());
+		  frame = &vm.frames[vm.frameCount - 1];
+		  ENTER_JIT();
+		  break;
+	  case OP_IMPORT:
+		  if (!importModule())
+			  return INTERPRET_RUNTIME_ERROR;
+		  CHECK_MEMORY();
+		  frame = &vm.frames[vm.frameCount - 1];
+		  ENTER_JIT();
+		  break;
+	  // operands are read in place, ip is moved past them first so errors
+	  // report the right line
+	  case OP_CLASS:
+		  if (!declareClass(frame->function->chunk.constants.values[READ_SHORT()]))
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_INHERIT:
+		  if (!inheritClass())
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_METHOD:
+		  if (!defineMethod(frame->function->chunk.constants.values[READ_SHORT()]))
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_GET_PROPERTY:
+		  frame->ip += 4;
+		  if (!getProperty(frame->ip - 4))
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_SET_PROPERTY:
+		  frame->ip += 4;
+		  if (!setProperty(frame->ip - 4))
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_GET_SUPER:
+		  frame->ip += 2;
+		  if (!getSuper(frame->ip - 2))
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_INVOKE:
+	  case OP_SUPER_INVOKE: {
+		  int length = instruction == OP_INVOKE ? 5 : 3;
+		  frame->ip += length;
+		  if (!(instruction == OP_INVOKE ? invoke : superInvoke)(frame->ip - length))
+			  return INTERPRET_RUNTIME_ERROR;
+		  frame = &vm.frames[vm.frameCount - 1];
+		  CHARGE(frame->function->chunk.cost);
+		  ENTER_JIT();
+		  break;
+	  }
+	  case OP_CLOSURE:
+		  frame->ip += 2;
+		  if (!makeClosure(frame->ip - 2))
+			  return INTERPRET_RUNTIME_ERROR;
+		  break;
+	  case OP_OUTER_GET:
+		  frame->ip += 3;
+		  outerGet(frame->ip - 3);
+		  break;
+	  case OP_OUTER_SET:
+		  frame->ip += 3;
+		  outerSet(frame->ip - 3);
+		  break;
+	  case OP_CALL_NESTED:
+		  frame->ip += 2;
+		  if (!callNested(frame->ip - 2))
+			  return INTERPRET_RUNTIME_ERROR;
+		  frame = &vm.frames[vm.frameCount - 1];
+		  CHARGE(frame->function->chunk.cost);
+		  ENTER_JIT();
+		  break;
+	  case OP_TAIL_CALL_NESTED:
+		  frame->ip += 2;
+		  if (!tailCallNested(frame->ip - 2))
+			  return INTERPRET_RUNTIME_ERROR;
+		  frame = &vm.frames[vm.frameCount - 1];
+		  CHARGE(frame->function->chunk.cost);
+		  ENTER_JIT();
+		  break;
+	  case OP_CLOSE_UPVALUES:
+		  frame->ip += 2;
+		  closeScope(frame->ip - 2);
+		  break;
     }
   }
   #undef READ_BYTE
+  #undef READ_SHORT
   #undef READ_CONSTANT
   #undef READ_CONSTANT_LONG
   #undef BINARY_OP
+  #undef NUMBER_OP
+  #undef ENTER_JIT
+  #undef CHECK_MEMORY
+  #undef CHARGE
+  #undef COMPARE_JUMP
+  #undef NUMBER_COMPARE_JUMP
 }
\ No newline at end of file
@@ -2,26 +2,95 @@
 #define clox_vm_h
 #include "chunk.h"
 #include "value.h"
+#include "object.h"
 #include "table.h"
+#include "memory.h"
 typedef struct {
-	PChunk chunk;
-	uint8_t* ip;
-	ValueArray stack;
+	// the running fiber. frames and stack point into it, frameCount and
+	// stackTop are live here and saved back when another fiber takes over
+	PObjFiber fiber;
+	CallFrame* frames;
+	int frameCount;
+	Value* stack;
+	Value* stackTop;
+	PObjFiber ready; // round-robin queue of spawned fibers
+	PObjFiber readyTail;
+	PObjFiber mainFiber; // the script's
+	PObjFunction script; // of a repl session, every line is appended to it
+	int line; // where the next line of the session starts
 	PObj objects;
 	Table strings;
 	Table globals;
+	Table modules; // names imported into this vm
+	bool jitEnabled;
+	// budget of the current resume(), see refuel
+	int64_t fuel; // instructions until the next check
+	int64_t fuelGranted;
+	uint64_t instructionsLeft; // UINT64_MAX for no limit
+	uint64_t deadline; // monotonic nanoseconds, 0 for none
+	uint64_t instructions; // charged to budgets so far, see CHARGE in run()
+	int entryCost; // of the frame prepare() pushed, charged when run() starts
+	CacheStats caches; // inline cache hits and misses, see class.h
+	// the heap belongs to the VM, so swapVM moves a whole tenant
+	MemoryStats memory;
+	Slab* slabs;
+	SizeClass sizeClasses[SIZE_CLASS_COUNT];
+	uint8_t* image; // objects of a clone, see snapshot.h
+	size_t imageSize;
 } VM;
 typedef enum {
 	INTERPRET_OK,
 	INTERPRET_COMPILE_ERROR,
-	INTERPRET_RUNTIME_ERROR
+	INTERPRET_RUNTIME_ERROR,
+	INTERPRET_YIELD // the budget ran out, resume() carries on from here
 } InterpretResult;
+typedef struct {
+	uint64_t instructions; // 0 for no limit
+	uint64_t microseconds;
+} Budget;
+// where the time of a run goes, kept across initVM and freeVM. scanning
+// is interleaved with compiling, the scan phase is a separate pass that
+// only runs when the stats are asked for
+typedef enum {
+	PHASE_LOAD, // reading the source file
+	PHASE_SCAN,
+	PHASE_COMPILE,
+	PHASE_JIT,
+	PHASE_RUN, // without the jit's share
+	PHASE_TEARDOWN,
+	PHASE_COUNT
+} Phase;
+typedef struct {
+	bool enabled;
+	uint64_t nanos[PHASE_COUNT];
+	uint64_t tokens;
+} PhaseStats;
 extern VM vm;
+extern PhaseStats phases;
+uint64_t monotonicNanos();
+void writeStats(FILE*);
 void initVM();
 void freeVM();
-InterpretResult interpret(const char*);
+InterpretResult interpret(const char*); // the source has to stay put until it returns
+// resumable execution: prepare() compiles into the current vm, resume()
+// runs it for at most one budget, the source can go once prepare() returns.
+// hosts multiplexing several scripts keep each VM in its own struct and
+// swapVM() it in around resume()
+InterpretResult prepare(const char*);
+InterpretResult resume(Budget);
+void swapVM(VM*);
+// repl sessions keep one vm, each input is compiled onto the end of the
+// same script so globals and interned strings carry over. prepareLine()
+// takes the place of prepare()
+InterpretResult prepareLine(const char*);
+bool refuel();
 static InterpretResult run();
 void push(Value);
 Value pop();
+void runtimeError(const char*, ...);
+bool ToBoolean(Value);
+bool call(PObjFunction, int);
+bool callValue(Value, int);
+bool tailCall(CallFrame*, Value, int);
 
 #endif
\ No newline at end of file